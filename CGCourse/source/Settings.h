@@ -3,7 +3,21 @@
 #ifndef CGSETTINGS
 #define CGSETTINGS
 
+// The headless build passes its own ASSIGNMENT on the command line
+#ifndef ASSIGNMENT
 #define ASSIGNMENT 9
+#endif
 #define RTVersion ASSIGNMENT
 
+// Ray - triangle test, picked at build time:
+// TRIANGLE_WATERTIGHT  Woop, Benthin and Wald's test in a sheared ray
+//                      space, no cracks between triangles sharing an edge
+// TRIANGLE_WALD        Wald's projected test on a precomputed record,
+//                      fewer instructions but not watertight
+#define TRIANGLE_WATERTIGHT 1
+#define TRIANGLE_WALD 2
+#ifndef TRIANGLE_TEST
+#define TRIANGLE_TEST TRIANGLE_WATERTIGHT
+#endif
+
 #endif // CGSETTINGS
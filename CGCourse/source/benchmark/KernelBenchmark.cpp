@@ -0,0 +1,263 @@
+// ====================================================================
+// Microbenchmarks for the ray tracer's hot kernels.
+//
+// Every kernel runs over a fixed set of random rays (or boxes), made
+// from a fixed seed so runs are comparable. After a few warm-up passes
+// each repetition times one pass over the whole set, and the report
+// gives nanoseconds per call at several percentiles of the repetitions.
+//
+//   KernelBenchmark [-count n] [-warmup n] [-reps n] [-json]
+// ====================================================================
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <vector>
+#include <random>
+#include <chrono>
+#include <algorithm>
+#include <limits>
+#include <RayTracer/VersionControl.h>
+#include <RayTracer/Core/material.h>
+#include <RayTracer/Core/hit.h>
+#include <RayTracer/Core/ray.h>
+#include <RayTracer/Primitives/Triangle.h>
+#include <RayTracer/Primitives/Sphere.h>
+#include <RayTracer/Primitives/SphereBatch.h>
+#include <RayTracer/Primitives/Group.h>
+#include <RayTracer/Primitives/Plane.h>
+#include <RayTracer/Primitives/Transform.h>
+#include <RayTracer/Primitives/Grid.h>
+#include <matrix.h>
+
+static int numCalls = 4096;
+static int numWarmup = 5;
+static int numReps = 50;
+static bool json = false;
+
+// Keeps the compiler from dropping the benchmarked calls
+static volatile long long sink = 0;
+
+struct KernelResult
+{
+    const char* name;
+    double min, p50, p90, p99, max;
+};
+static std::vector<KernelResult> results;
+
+// Times kernel(i) for i in [0, numCalls), once per repetition
+template <class Kernel>
+static void Run(const char* name, Kernel kernel)
+{
+    long long hits = 0;
+    for (int w = 0; w < numWarmup; w++)
+        for (int i = 0; i < numCalls; i++)
+            hits += kernel(i);
+
+    std::vector<double> ns(numReps);
+    for (int r = 0; r < numReps; r++)
+    {
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < numCalls; i++)
+            hits += kernel(i);
+        auto end = std::chrono::steady_clock::now();
+        ns[r] = std::chrono::duration<double, std::nano>(end - start).count() / numCalls;
+    }
+    sink += hits;
+
+    std::sort(ns.begin(), ns.end());
+    auto percentile = [&](double p) { return ns[std::min(numReps - 1, int(p * numReps))]; };
+    results.push_back({ name, ns.front(), percentile(0.5), percentile(0.9), percentile(0.99), ns.back() });
+}
+
+static Vec3f RandomPoint(std::mt19937& rng, float extent)
+{
+    std::uniform_real_distribution<float> u(-extent, extent);
+    return Vec3f(u(rng), u(rng), u(rng));
+}
+
+static Vec3f RandomDirection(std::mt19937& rng)
+{
+    std::normal_distribution<float> n;
+    Vec3f d(n(rng), n(rng), n(rng));
+    d.Normalize();
+    return d;
+}
+
+// Rays starting on a shell of radius 4 around the origin and aimed at
+// random points of the unit cube, so most of them hit the primitive
+static std::vector<Ray> MakeRays(std::mt19937& rng)
+{
+    std::vector<Ray> rays;
+    for (int i = 0; i < numCalls; i++)
+    {
+        Vec3f origin = 4 * RandomDirection(rng);
+        Vec3f direction = RandomPoint(rng, 1) - origin;
+        direction.Normalize();
+        rays.push_back(Ray(origin, direction));
+    }
+    return rays;
+}
+
+static void PrintResults()
+{
+    if (json)
+    {
+        printf("{\n  \"count\": %d, \"warmup\": %d, \"reps\": %d,\n  \"kernels\": [\n", numCalls, numWarmup, numReps);
+        for (int i = 0; i < (int)results.size(); i++)
+        {
+            const KernelResult& r = results[i];
+            printf("    { \"name\": \"%s\", \"ns_min\": %.2f, \"ns_p50\": %.2f, \"ns_p90\": %.2f, \"ns_p99\": %.2f, \"ns_max\": %.2f }%s\n",
+                r.name, r.min, r.p50, r.p90, r.p99, r.max, (i + 1 < (int)results.size()) ? "," : "");
+        }
+        printf("  ]\n}\n");
+        return;
+    }
+
+    printf("%d calls per pass, %d warm-up passes, %d timed passes (ns per call)\n", numCalls, numWarmup, numReps);
+    printf("%-32s %9s %9s %9s %9s %9s\n", "kernel", "min", "p50", "p90", "p99", "max");
+    for (const KernelResult& r : results)
+        printf("%-32s %9.2f %9.2f %9.2f %9.2f %9.2f\n", r.name, r.min, r.p50, r.p90, r.p99, r.max);
+}
+
+int main(int argc, char* argv[])
+{
+    for (int i = 1; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "-count") && i + 1 < argc) {
+            numCalls = atoi(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "-warmup") && i + 1 < argc) {
+            numWarmup = atoi(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "-reps") && i + 1 < argc) {
+            numReps = atoi(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "-json")) {
+            json = true;
+        }
+        else {
+            printf("usage: %s [-count n] [-warmup n] [-reps n] [-json]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (numCalls < 1 || numReps < 1 || numWarmup < 0)
+    {
+        printf("ERROR: -count and -reps must be positive\n");
+        return 1;
+    }
+
+    std::mt19937 rng(6837);
+    std::vector<Ray> rays = MakeRays(rng);
+
+    Vec3f white(1, 1, 1);
+    Vec3f black(0, 0, 0);
+    Material* material = new PhongMaterial(white, black, 0, black, black, 1);
+    float tmax = std::numeric_limits<float>::max();
+
+    Vec3f a(-1, -1, 0), b(1, -1, 0), c(0, 1, 0);
+    Triangle triangle(a, b, c, material);
+    Run("Triangle::intersect", [&](int i) {
+        Hit h(tmax, material, black);
+        return (int)triangle.intersect(rays[i], h, 0);
+    });
+
+    Sphere sphere(Vec3f(0, 0, 0), 1, material);
+    Run("Sphere::intersect", [&](int i) {
+        Hit h(tmax, material, black);
+        return (int)sphere.intersect(rays[i], h, 0);
+    });
+
+    Vec3f normal(0.3f, 1, 0.2f);
+    Plane plane(normal, 0.1f, material);
+    Run("Plane::intersect", [&](int i) {
+        Hit h(tmax, material, black);
+        return (int)plane.intersect(rays[i], h, 0);
+    });
+
+    Matrix m = Matrix::MakeTranslation(Vec3f(0.1f, -0.2f, 0.3f)) *
+        Matrix::MakeAxisRotation(Vec3f(1, 1, 0), 0.7f) * Matrix::MakeScale(Vec3f(1, 0.5f, 0.8f));
+    Transform transform(m, &sphere);
+    Run("Transform::intersect (sphere)", [&](int i) {
+        Hit h(tmax, material, black);
+        return (int)transform.intersect(rays[i], h, 0);
+    });
+
+    BoundingBox box(Vec3f(-1, -1, -1), Vec3f(1, 1, 1));
+    Run("BoundingBox::Intersect", [&](int i) {
+        float tnear = 0, tfar = tmax;
+        return (int)box.Intersect(rays[i], tnear, tfar);
+    });
+    Grid grid(box, 16, 16, 16);
+    Run("Grid::initializeRayMarch", [&](int i) {
+        MarchingInfo mi;
+        grid.initializeRayMarch(mi, rays[i], 0);
+        return (int)mi.IntersectedBB;
+    });
+    Run("Grid march (init + nextCell)", [&](int i) {
+        MarchingInfo mi;
+        grid.initializeRayMarch(mi, rays[i], 0);
+        int cells = 0, surface;
+        if (mi.IntersectedBB)
+            while (mi.nextCell(surface))
+                cells++;
+        return cells;
+    });
+
+    // Random small triangles against the cells of the same 16^3 grid
+    std::vector<Triangle*> triangles;
+    std::vector<Vec3f> centers;
+    std::uniform_int_distribution<int> cell(0, 15);
+    for (int i = 0; i < numCalls; i++)
+    {
+        Vec3f p = RandomPoint(rng, 1);
+        Vec3f q = p + 0.2f * RandomPoint(rng, 1);
+        Vec3f r = p + 0.2f * RandomPoint(rng, 1);
+        triangles.push_back(new Triangle(p, q, r, material));
+        centers.push_back(grid.GetVoxelCenter(cell(rng), cell(rng), cell(rng)));
+    }
+    Vec3f extents = grid.GetVoxelSizeHalf();
+    Run("Triangle::TriangleAABB", [&](int i) {
+        return (int)Triangle::TriangleAABB(triangles[i], centers[i], extents, nullptr);
+    });
+
+    // The same triangles in a 16^3 grid of their own, a whole traversal
+    BoundingBox meshBox(triangles[0]->getBoundingBox()->getMin(), triangles[0]->getBoundingBox()->getMax());
+    for (Triangle* t : triangles)
+        meshBox.Extend(t->getBoundingBox());
+    Grid meshGrid(meshBox, 16, 16, 16);
+    for (Triangle* t : triangles)
+        t->insertIntoGrid(&meshGrid, nullptr);
+    meshGrid.Pack();
+    Run("Grid::intersect (triangles)", [&](int i) {
+        Hit h(tmax, material, black);
+        return (int)meshGrid.intersect(rays[i], h, 0);
+    });
+
+    // 64 small spheres in the unit cube, one by one and as a batch
+    std::vector<Sphere*> spheres;
+    std::uniform_real_distribution<float> radius(0.05f, 0.2f);
+    Group group(64);
+    for (int i = 0; i < 64; i++)
+    {
+        spheres.push_back(new Sphere(RandomPoint(rng, 1), radius(rng), material));
+        group.addObject(i, spheres.back());
+    }
+    Run("Group::intersect (64 spheres)", [&](int i) {
+        Hit h(tmax, material, black);
+        return (int)group.intersect(rays[i], h, 0);
+    });
+    SphereBatch batch(spheres);
+    Run("SphereBatch::intersect (64)", [&](int i) {
+        Hit h(tmax, material, black);
+        return (int)batch.intersect(rays[i], h, 0);
+    });
+
+    PrintResults();
+
+    for (Triangle* t : triangles)
+        delete t;
+    for (Sphere* s : spheres)
+        delete s;
+    return 0;
+}
@@ -0,0 +1,193 @@
+// ====================================================================
+// Render benchmark for the headless ray tracer (Linux only).
+//
+// Renders a fixed list of the bundled scenes with fixed settings, one
+// RayTracerHeadless process per scene, and writes a JSON report with
+// the wall time, rays per second, intersections per ray and peak memory
+// of every render.
+//
+//   RenderBenchmark [-renderer path] [-output file.json] [-size n]
+//
+// Run it from the CGCourse directory, like the renderer itself. By
+// default the renderer is looked up next to the benchmark executable.
+// ====================================================================
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+struct BenchmarkScene
+{
+    const char* input;  // relative to resource/assignment7, like -input
+    bool grid;
+};
+
+// The scene list and settings are fixed so reports can be compared
+static const BenchmarkScene scenes[] = {
+    { "../assignment4/scene4_03_mirrored_floor.txt", false },
+    { "../assignment4/scene4_06_transparent_bars.txt", false },
+    { "../assignment4/scene4_14_faceted_gem.txt", false },
+    { "../assignment5/scene5_08_bunny_mesh_5k.txt", true },
+    { "../assignment5/scene5_12_nested_transformations.txt", false },
+    { "../assignment6/scene6_07_bunny_mesh_40k.txt", true },
+    { "../assignment6/scene6_13_checkerboard.txt", false },
+    { "../assignment6/scene6_17_marble_vase.txt", true },
+    { "scene7_05_glass_sphere.txt", false },
+    { "../assignment8/scene8_10_transparent_vase.txt", true },
+    { "../assignment8/scene8_11_reflective_teapot.txt", true },
+};
+
+static const char* statsFile = "benchmark_stats.json";
+static const char* imageFile = "benchmark.tga";
+
+struct BenchmarkResult
+{
+    int exitCode = -1;
+    double wallSeconds = 0;
+    double renderSeconds = 0;
+    unsigned long long rays = 0;
+    double raysPerSecond = 0;
+    double intersectionsPerRay = 0;
+    long peakMemoryKB = 0;
+};
+
+// Reads the number stored under "key" in the stats file of the renderer
+static double ReadNumber(const std::string& json, const char* key)
+{
+    std::string pattern = std::string("\"") + key + "\":";
+    size_t pos = json.find(pattern);
+    if (pos == std::string::npos)
+        return 0;
+    return atof(json.c_str() + pos + pattern.size());
+}
+
+static std::string ReadFile(const char* filename)
+{
+    std::string text;
+    FILE* file = fopen(filename, "r");
+    if (file == NULL)
+        return text;
+    char buffer[4096];
+    size_t n;
+    while ((n = fread(buffer, 1, sizeof(buffer), file)) > 0)
+        text.append(buffer, n);
+    fclose(file);
+    return text;
+}
+
+static BenchmarkResult RunScene(const char* renderer, const BenchmarkScene& scene, const char* size)
+{
+    std::string statsPath = std::string("resource/output/") + statsFile;
+    remove(statsPath.c_str());
+
+    std::vector<const char*> args = {
+        renderer, "raytracer",
+        "-input", scene.input,
+        "-size", size, size,
+        "-output", imageFile,
+        "-shadows", "-bounces", "5", "-weight", "0.01",
+        "-stats_json", statsFile,
+    };
+    if (scene.grid)
+    {
+        args.push_back("-grid");
+        args.push_back("15");
+        args.push_back("15");
+        args.push_back("15");
+    }
+    args.push_back(NULL);
+
+    BenchmarkResult result;
+    auto start = std::chrono::steady_clock::now();
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        // The renderer prints its progress, keep the report clean
+        int null = open("/dev/null", O_WRONLY);
+        dup2(null, STDOUT_FILENO);
+        execv(renderer, (char* const*)args.data());
+        _exit(127);
+    }
+    if (pid < 0)
+        return result;
+
+    int status = 0;
+    struct rusage usage;
+    wait4(pid, &status, 0, &usage);
+    result.wallSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    result.exitCode = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+    result.peakMemoryKB = usage.ru_maxrss;
+
+    std::string json = ReadFile(statsPath.c_str());
+    result.renderSeconds = ReadNumber(json, "render_seconds");
+    result.rays = (unsigned long long)(ReadNumber(json, "nonshadow_rays") + ReadNumber(json, "shadow_rays"));
+    result.raysPerSecond = ReadNumber(json, "rays_per_second");
+    result.intersectionsPerRay = ReadNumber(json, "intersections_per_ray");
+    return result;
+}
+
+int main(int argc, char* argv[])
+{
+    std::string defaultRenderer = argv[0];
+    size_t slash = defaultRenderer.rfind('/');
+    defaultRenderer = (slash == std::string::npos ? std::string(".") : defaultRenderer.substr(0, slash)) + "/RayTracerHeadless";
+    const char* renderer = defaultRenderer.c_str();
+    const char* output = NULL;
+    const char* size = "200";
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "-renderer") && i + 1 < argc) {
+            renderer = argv[++i];
+        }
+        else if (!strcmp(argv[i], "-output") && i + 1 < argc) {
+            output = argv[++i];
+        }
+        else if (!strcmp(argv[i], "-size") && i + 1 < argc) {
+            size = argv[++i];
+        }
+        else {
+            printf("usage: %s [-renderer path] [-output file.json] [-size n]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    FILE* file = stdout;
+    if (output != NULL && (file = fopen(output, "w")) == NULL)
+    {
+        printf("ERROR: could not write %s\n", output);
+        return 1;
+    }
+
+    fprintf(file, "{\n");
+    fprintf(file, "  \"settings\": { \"size\": %s, \"bounces\": 5, \"weight\": 0.01, \"shadows\": true, \"grid\": [15, 15, 15] },\n", size);
+    fprintf(file, "  \"scenes\": [\n");
+    int count = sizeof(scenes) / sizeof(scenes[0]);
+    int failed = 0;
+    for (int i = 0; i < count; i++)
+    {
+        fprintf(stderr, "[%d/%d] %s\n", i + 1, count, scenes[i].input);
+        BenchmarkResult r = RunScene(renderer, scenes[i], size);
+        if (r.exitCode != 0)
+            failed++;
+        fprintf(file, "    { \"scene\": \"%s\", \"grid\": %s, \"exit_code\": %d, \"wall_seconds\": %f, "
+            "\"render_seconds\": %f, \"rays\": %llu, \"rays_per_second\": %f, "
+            "\"intersections_per_ray\": %f, \"peak_memory_kb\": %ld }%s\n",
+            scenes[i].input, scenes[i].grid ? "true" : "false", r.exitCode, r.wallSeconds,
+            r.renderSeconds, r.rays, r.raysPerSecond,
+            r.intersectionsPerRay, r.peakMemoryKB, (i + 1 < count) ? "," : "");
+        fflush(file);
+    }
+    fprintf(file, "  ]\n");
+    fprintf(file, "}\n");
+    if (file != stdout)
+        fclose(file);
+    return failed == 0 ? 0 : 1;
+}
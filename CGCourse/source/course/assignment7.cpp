@@ -1,15 +1,28 @@
 #include "AssignmentIndex.h"
 #include <assert.h>
 #include <string>
+#include <string.h>
 #include <RayTracer/Core/scene_parser.h>
 #include <Image/image.h>
 #include <RayTracer/Core/Camera.h>
 #include <RayTracer/Core/RayTracer.h>
+#include <RayTracer/Core/WavefrontTracer.h>
+#include <RayTracer/Core/FrameBuffer.h>
+#include <RayTracer/Core/RenderCheckpoint.h>
 #include <RayTracer/Primitives/Group.h>
 #include <RayTracer/Primitives/Sphere.h>
+#include <RayTracer/Primitives/TransformCollapse.h>
+#include <algorithm>
+#include <chrono>
 #include <limits>
+#include <memory>
+#include <thread>
+#include <vector>
+#include <sys/stat.h>
 #include <RayTracer/Core/light.h>
+#ifndef HEADLESS
 #include <OpenGL/Core/GLCanvas.h>
+#endif
 #include <RayTracer/Core/RayTracingStas.h>
 #include <RayTracer/AntiAliasing/Film.h>
 #include <RayTracer/AntiAliasing/Sampler.h>
@@ -28,15 +41,47 @@ extern char* output_file = NULL;
 extern char* depth_file = NULL;
 extern char* normal_file = NULL;
 extern float depth_min = 0, depth_max = 0, depth_rerange = 1;
+char* material_id_file = NULL;
+char* primitive_id_file = NULL;
+// -cost metric file, any number of times
+struct CostFile
+{
+    FrameBuffer::CostMetric metric;
+    char* filename;
+};
+std::vector<CostFile> cost_files;
 
 bool shadeback = false;
 bool shadows = false;
 bool bounces = false;
 bool weight = false;
 bool stats = false;
+char* stats_json_file = NULL;
+char* reference_file = NULL;
+char* compare_file = NULL;
+char* diff_file = NULL;
+float min_psnr = -1;
+bool quality_failed = false;
+bool wavefront = false;
+bool reorder = false;
+bool collapse_transforms = false;
+bool bake_transforms = false;
 int nBounce = 0;
 float fWeight = 0;
 
+// -tile renders the pixels [x0,x1) x [y0,y1) only and saves their
+// samples to tile_file, -merge puts such tiles back together
+int tile_x0 = 0, tile_y0 = 0, tile_x1 = 0, tile_y1 = 0;
+char* tile_file = NULL;
+std::vector<char*> merge_files;
+
+// -checkpoint saves the progress every checkpoint_interval seconds,
+// -resume goes on from there if the render settings are the same
+char* checkpoint_file = NULL;
+float checkpoint_interval = 0;
+bool resume = false;
+std::string checkpoint_settings;
+
 enum class SampleType
 {
     None,
@@ -69,6 +114,11 @@ Filter* filter = nullptr;
 
 SceneParser_v6* scene;
 RayTracer* rayTracer;
+WavefrontTracer* wavefrontTracer = nullptr;
+
+// -watch renders again every time the scene file is saved
+std::string scene_file;
+bool watch = false;
 
 Vec3f black(0, 0, 0);
 Material* black_mat = new PhongMaterial(black, black, 0, black, black, 1);
@@ -81,9 +131,197 @@ void TraceRay(float a, float b)
     Vec3f radiance = rayTracer->traceRay(r, 0, 5, 0, 5, hit);
 }
 
+// Traces sample k of pixel (i, j), used by the progressive preview
+Vec3f TraceSample(int i, int j, int k)
+{
+    Camera* camera = scene->getCamera();
+    float step_width = 1. / size_width;
+    float step_height = 1. / size_height;
+    float hdw = 1. * size_height / size_width;
+    float start_height = 0.5 - hdw * 0.5;
+
+    Vec2f offset(0.5, 0.5);
+    if (sampleType != SampleType::None)
+        offset = sampler->getSamplePosition(i, j, k);
+
+    SeedRoulette(RouletteSeed(i, j, k));
+    Hit hit((float)numeric_limits<float>::max(), black_mat, Vec3f(0, 0, 0));
+    Ray r = camera->generateRay(Vec2f(
+        step_width * (i + offset.x()),
+        start_height + hdw * step_height * (j + offset.y())));
+    Vec3f radiance = rayTracer->traceRay(r, 0, 5, 0, 5, hit);
+    if (radiance == Vec3f(-1, -1, -1))
+        radiance = scene->getBackgroundColor();
+    return radiance;
+}
+
+// Generates the camera samples of the columns [x0, x1) of the tile up
+// front and traces them as one batch
+void RenderWavefront(FrameBuffer& fb, int x0, int x1)
+{
+    Image& pImg = *fb.getColor();
+    Camera* camera = scene->getCamera();
+    float step_width = 1. / size_width;
+    float step_height = 1. / size_height;
+    float hdw = 1. * size_height / size_width;
+    float start_height = 0.5 - hdw * 0.5;
+    int samples = (sampleType == SampleType::None) ? 1 : spp;
+
+    int count = (x1 - x0) * (tile_y1 - tile_y0) * samples;
+
+    std::vector<Ray> rays;
+    std::vector<unsigned> seeds;
+    std::vector<Vec2f> offsets;
+    rays.reserve(count);
+    seeds.reserve(count);
+    offsets.reserve(count);
+    for (int i = x0; i < x1; i++)
+        for (int j = tile_y0; j < tile_y1; j++)
+            for (int k = 0; k < samples; k++)
+            {
+                Vec2f offset(0.5, 0.5);
+                if (sampleType != SampleType::None)
+                    offset = sampler->getSamplePosition(i, j, k);
+                rays.push_back(camera->generateRay(Vec2f(
+                    step_width * (i + offset.x()),
+                    start_height + hdw * step_height * (j + offset.y()))));
+                seeds.push_back(RouletteSeed(i, j, k));
+                offsets.push_back(offset);
+            }
+
+    std::vector<Vec3f> radiance;
+    std::vector<Hit> hits;
+    wavefrontTracer->traceRays(rays, seeds, radiance, &hits);
+
+    int index = 0;
+    for (int i = x0; i < x1; i++)
+        for (int j = tile_y0; j < tile_y1; j++)
+            for (int k = 0; k < samples; k++, index++)
+            {
+                pFilm->setSample(i, j, k, offsets[index], radiance[index]);
+                if (sampleType == SampleType::None)
+                    pImg.SetPixel(i, j, radiance[index]);
+                if (k == 0 && hits[index].getMaterial() != NULL)
+                    fb.setHit(i, j, hits[index]);
+            }
+}
+
+// Prints the error metrics of img against the reference image. Returns
+// false if the reference can't be used or the PSNR is below -min_psnr
+bool CompareWithReference(Image& img, const char* reference)
+{
+    FILE* file = fopen(reference, "rb");
+    if (file == NULL)
+    {
+        printf("ERROR: could not open reference %s\n", reference);
+        return false;
+    }
+    fclose(file);
+
+    Image* ref = Image::Load(reference);
+    if (ref == NULL)
+        return false;
+    if (ref->Width() != img.Width() || ref->Height() != img.Height())
+    {
+        printf("ERROR: reference is %dx%d, image is %dx%d\n",
+            ref->Width(), ref->Height(), img.Width(), img.Height());
+        delete ref;
+        return false;
+    }
+
+    ImageMetrics metrics = Image::CompareMetrics(&img, ref);
+    printf("********************************************\n");
+    printf("COMPARISON WITH %s\n", reference);
+    printf("  mse                        %g\n", metrics.mse);
+    printf("  psnr                       %0.2f dB\n", metrics.psnr);
+    printf("  ssim                       %0.5f\n", metrics.ssim);
+    printf("  max error                  %g\n", metrics.maxError);
+    printf("********************************************\n");
+
+    if (diff_file != NULL)
+    {
+        Image* diff = Image::Compare(&img, ref);
+        diff->Save((string("resource/output/") + string(diff_file)).c_str());
+        delete diff;
+    }
+    delete ref;
+
+    if (min_psnr >= 0 && !(metrics.psnr >= min_psnr))
+    {
+        printf("FAILED: psnr below %0.2f dB\n", min_psnr);
+        return false;
+    }
+    return true;
+}
+
+// Merge mode: puts the tiles of -merge back into one film, filters it
+// the way a full render would and saves it to -output. Returns false if
+// a tile can't be used or some pixel is in none of them
+bool MergeTiles()
+{
+    int width, height, samples;
+    if (output_file == NULL || !Film::ReadTileSize(merge_files[0], width, height, samples))
+    {
+        printf("ERROR: -merge needs readable tiles and an -output\n");
+        return false;
+    }
+
+    Film film(width, height, samples);
+    std::vector<char> covered(width * height, 0);
+    for (int t = 0; t < (int)merge_files.size(); t++)
+    {
+        int x0, y0, x1, y1;
+        if (!film.loadTile(merge_files[t], x0, y0, x1, y1))
+            return false;
+        for (int i = x0; i < x1; i++)
+            for (int j = y0; j < y1; j++)
+                covered[i * height + j] = 1;
+    }
+    int missing = 0;
+    for (int i = 0; i < width * height; i++)
+        missing += !covered[i];
+    if (missing > 0)
+    {
+        printf("ERROR: %d pixels are in none of the tiles\n", missing);
+        return false;
+    }
+
+    Image img(width, height);
+    for (int i = 0; i < width; i++)
+        for (int j = 0; j < height; j++)
+        {
+            Vec3f color(0, 0, 0);
+            if (filter != nullptr)
+                color = filter->getColor(i, j, &film);
+            else
+            {
+                bool outOfBound = false;
+                for (int k = 0; k < samples; k++)
+                    color += film.getSample(i, j, k, outOfBound).getColor();
+                color = color * (1.0f / samples);
+            }
+            img.SetPixel(i, j, color);
+        }
+    img.Save((string("resource/output/") + string(output_file)).c_str());
+    printf("merged %d tiles into a %dx%d image\n", (int)merge_files.size(), width, height);
+
+    if (reference_file != NULL)
+        return CompareWithReference(img, reference_file);
+    return true;
+}
+
 void Render()
 {
-    Image pImg = Image(size_width, size_height);
+    // Every AOV asked for on the command line is filled by the same pass
+    unsigned aovs = FrameBuffer::Color;
+    if (depth_file != NULL) aovs |= FrameBuffer::Depth;
+    if (normal_file != NULL) aovs |= FrameBuffer::Normal;
+    if (material_id_file != NULL) aovs |= FrameBuffer::MaterialID;
+    if (primitive_id_file != NULL) aovs |= FrameBuffer::PrimitiveID;
+    if (!cost_files.empty()) aovs |= FrameBuffer::Cost;
+    FrameBuffer fb(size_width, size_height, aovs);
+    fb.setMaterials(scene);
+    Image& pImg = *fb.getColor();
 
     int mx = -1, my = -1, mz = -1;
     if (scene->grid != nullptr)
@@ -93,7 +331,20 @@ void Render()
         scene->getGroup()->getBoundingBox(),
         mx, my, mz);
 
-    pImg.SetAllPixels(scene->getBackgroundColor());
+    fb.clear(scene->getBackgroundColor());
+
+    // With -resume the columns before start come from the checkpoint
+    std::unique_ptr<RenderCheckpoint> checkpoint;
+    int start = tile_x0;
+    if (checkpoint_file != NULL)
+    {
+        checkpoint.reset(new RenderCheckpoint((string("resource/output/") + string(checkpoint_file)).c_str(),
+            checkpoint_interval, checkpoint_settings));
+        if (resume)
+            start = checkpoint->load(tile_x0, tile_y0, tile_y1, fb, *pFilm);
+        if (start == tile_x0)
+            fb.clear(scene->getBackgroundColor());
+    }
 
     // prepare
     Camera* camera = scene->getCamera();
@@ -105,34 +356,34 @@ void Render()
     float step_height = 1. / size_height;
     float hdw = 1. * size_height / size_width;
     float start_height = 0.5 - hdw * 0.5;
-    for (int i = 0; i < size_width; i++)
-        for (int j = 0; j < size_height; j++)
+    if (wavefront)
+    {
+        // One wave per band of columns, the whole tile without checkpoints
+        int band = (checkpoint != nullptr) ? 16 : (std::max)(tile_x1 - tile_x0, 1);
+        for (int i = start; i < tile_x1; i += band)
         {
-            switch (sampleType)
-            {
-            case SampleType::None:
-            {
-                Vec2f offset(0.5, 0.5);
-
-                Hit hit((float)numeric_limits<float>::max(), black_mat, Vec3f(0, 0, 0));
-                Ray r = camera->generateRay(Vec2f(
-                    step_width * (i + offset.x()),
-                    start_height + hdw * step_height * (j + offset.y())));
-                Vec3f radiance = rayTracer->traceRay(r, 0, 5, 0, 5, hit);
-                if (radiance == Vec3f(-1, -1, -1))
-                    radiance = scene->getBackgroundColor();
-                pFilm->setSample(i, j, 0, offset, radiance);
-                pImg.SetPixel(i, j, radiance);
-            }
-            break;
-            case SampleType::RandomSample:
-            case SampleType::UniformSample:
-            case SampleType::JitteredSample:
+            int end = (std::min)(i + band, tile_x1);
+            RenderWavefront(fb, i, end);
+            if (checkpoint != nullptr && checkpoint->due())
+                checkpoint->save(end, tile_x0, tile_y0, tile_y1, fb, *pFilm);
+        }
+    }
+    else
+    {
+        bool measureCost = fb.has(FrameBuffer::Cost);
+        for (int i = start; i < tile_x1; i++)
+        {
+            for (int j = tile_y0; j < tile_y1; j++)
             {
-                for (int k = 0; k < spp; k++)
+                if (measureCost)
+                    fb.beginCost();
+                switch (sampleType)
                 {
-                    Vec2f offset = sampler->getSamplePosition(k);
+                case SampleType::None:
+                {
+                    Vec2f offset(0.5, 0.5);
 
+                    SeedRoulette(RouletteSeed(i, j, 0));
                     Hit hit((float)numeric_limits<float>::max(), black_mat, Vec3f(0, 0, 0));
                     Ray r = camera->generateRay(Vec2f(
                         step_width * (i + offset.x()),
@@ -140,18 +391,50 @@ void Render()
                     Vec3f radiance = rayTracer->traceRay(r, 0, 5, 0, 5, hit);
                     if (radiance == Vec3f(-1, -1, -1))
                         radiance = scene->getBackgroundColor();
-                    pFilm->setSample(i, j, k, offset, radiance);
+                    else
+                        fb.setHit(i, j, hit);
+                    pFilm->setSample(i, j, 0, offset, radiance);
+                    pImg.SetPixel(i, j, radiance);
                 }
-            }
-            break;
-            default:
                 break;
+                case SampleType::RandomSample:
+                case SampleType::UniformSample:
+                case SampleType::JitteredSample:
+                {
+                    for (int k = 0; k < spp; k++)
+                    {
+                        Vec2f offset = sampler->getSamplePosition(i, j, k);
+
+                        SeedRoulette(RouletteSeed(i, j, k));
+                        Hit hit((float)numeric_limits<float>::max(), black_mat, Vec3f(0, 0, 0));
+                        Ray r = camera->generateRay(Vec2f(
+                            step_width * (i + offset.x()),
+                            start_height + hdw * step_height * (j + offset.y())));
+                        Vec3f radiance = rayTracer->traceRay(r, 0, 5, 0, 5, hit);
+                        if (radiance == Vec3f(-1, -1, -1))
+                            radiance = scene->getBackgroundColor();
+                        else if (k == 0)
+                            fb.setHit(i, j, hit);
+                        pFilm->setSample(i, j, k, offset, radiance);
+                    }
+                }
+                break;
+                default:
+                    break;
+                }
+                if (measureCost)
+                    fb.endCost(i, j);
             }
+            if (checkpoint != nullptr && checkpoint->due())
+                checkpoint->save(i + 1, tile_x0, tile_y0, tile_y1, fb, *pFilm);
         }
+    }
 
+    // Near the border of a tile the filter misses the samples of the
+    // next tile, only the merged image is right there
     if (filterType != FilterType::None)
-        for (int i = 0; i < size_width; i++)
-            for (int j = 0; j < size_height; j++)
+        for (int i = tile_x0; i < tile_x1; i++)
+            for (int j = tile_y0; j < tile_y1; j++)
             {
                 Vec3f color = filter->getColor(i, j, pFilm);
                 pImg.SetPixel(i, j, color);
@@ -161,11 +444,37 @@ void Render()
     {
         RayTracingStats::PrintStatistics();
     }
+    if (stats_json_file != NULL)
+    {
+        RayTracingStats::SaveStatisticsJSON((string("resource/output/") + string(stats_json_file)).c_str());
+    }
     // Output
+    if (tile_file != NULL)
+    {
+        if (!pFilm->saveTile((string("resource/output/") + string(tile_file)).c_str(),
+            tile_x0, tile_y0, tile_x1, tile_y1))
+            quality_failed = true;
+    }
     if (output_file != NULL)
     {
-        pImg.SaveTGA((string("resource/output/") + string(output_file)).c_str());
+        pImg.Save((string("resource/output/") + string(output_file)).c_str());
     }
+    if (depth_file != NULL)
+        fb.saveDepth((string("resource/output/") + string(depth_file)).c_str(), depth_min, depth_max);
+    if (normal_file != NULL)
+        fb.saveNormal((string("resource/output/") + string(normal_file)).c_str());
+    if (material_id_file != NULL)
+        fb.saveMaterialIDs((string("resource/output/") + string(material_id_file)).c_str());
+    if (primitive_id_file != NULL)
+        fb.savePrimitiveIDs((string("resource/output/") + string(primitive_id_file)).c_str());
+    for (int i = 0; i < (int)cost_files.size(); i++)
+        fb.saveCost((string("resource/output/") + string(cost_files[i].filename)).c_str(), cost_files[i].metric);
+
+    if (reference_file != NULL && !CompareWithReference(pImg, reference_file))
+        quality_failed = true;
+
+    if (checkpoint != nullptr)
+        checkpoint->remove();
 
     if (render_samplesFile != NULL)
     {
@@ -178,6 +487,81 @@ void Render()
         pFilm->renderFilter((string("resource/output/") + string(render_filterfile)).c_str(), render_filterZoomFactor, filter);
     }
 }
+
+SceneParser_v6* LoadScene()
+{
+    SceneParser_v6* loaded = new SceneParser_v6(scene_file.c_str());
+    if (collapse_transforms)
+    {
+        TransformCollapse pass(bake_transforms, loaded->getArena());
+        pass.run(loaded->getGroup());
+        if (stats)
+            printf("collapsed transforms: %d merged, %d primitives baked\n", pass.getMerged(), pass.getBaked());
+    }
+    return loaded;
+}
+
+// Parses the scene file again and traces it from now on. The objects
+// that did not change keep their geometry and their grid cells, so an
+// edit of the camera, the lights or the materials builds nothing.
+SceneParser_v6* ReloadScene()
+{
+    auto start = std::chrono::steady_clock::now();
+    SceneParser_v6* loaded = LoadScene();
+    std::vector<int> owners = loaded->reuse(scene);
+    scene = loaded;
+    bool gridKept = rayTracer->Reload(scene, owners);
+    if (wavefrontTracer != nullptr)
+    {
+        delete wavefrontTracer;
+        wavefrontTracer = new WavefrontTracer(scene, nBounce, fWeight, shadows);
+        wavefrontTracer->setReorder(reorder);
+    }
+
+    int reused = (int)std::count_if(owners.begin(), owners.end(), [](int owner) { return owner >= 0; });
+    int objects = 0;
+    for (int i = 0; i < scene->getGroup()->getNumObjects(); i++)
+        objects += scene->getGroup()->getObject(i) != NULL;
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    printf("reloaded %s: %d of %d objects reused, %s (%.3f s)\n", scene_file.c_str(), reused, objects,
+        rayTracer->GetGrid() == nullptr ? "no grid" : (gridKept ? "grid updated" : "grid rebuilt"), seconds);
+    return scene;
+}
+
+// The size and time of the last write of the scene file, "" while it
+// can't be read
+static std::string SceneFileVersion()
+{
+    struct stat info;
+    if (stat(scene_file.c_str(), &info) != 0)
+        return "";
+    return std::to_string((long long)info.st_size) + " " + std::to_string((long long)info.st_mtime);
+}
+
+// Renders again after every save of the scene file, until the process
+// is stopped. A file is only read once it stayed the same for one poll,
+// so an editor still writing it is waited for.
+void WatchScene()
+{
+    std::string rendered = SceneFileVersion();
+    std::string seen = rendered;
+    printf("watching %s for changes\n", scene_file.c_str());
+    fflush(stdout);
+    while (true)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(250));
+        std::string version = SceneFileVersion();
+        bool settled = version == seen;
+        seen = version;
+        if (!settled || version.empty() || version == rendered)
+            continue;
+        rendered = version;
+        ReloadScene();
+        Render();
+        printf("watching %s for changes\n", scene_file.c_str());
+        fflush(stdout);
+    }
+}
 #endif
 
 #pragma warning(disable:4996)
@@ -215,6 +599,25 @@ int Assignment::Assignment7Main(int argc, char* argv[])
             i++; assert(i < argc);
             normal_file = argv[i];
         }
+        else if (!strcmp(argv[i], "-material_ids")) {
+            i++; assert(i < argc);
+            material_id_file = argv[i];
+        }
+        else if (!strcmp(argv[i], "-primitive_ids")) {
+            i++; assert(i < argc);
+            primitive_id_file = argv[i];
+        }
+        else if (!strcmp(argv[i], "-cost")) {
+            i++; assert(i < argc);
+            int metric = FrameBuffer::ParseCostMetric(argv[i]);
+            if (metric < 0)
+            {
+                printf("-cost measures time, rays, intersections or cells, not '%s'\n", argv[i]);
+                return 1;
+            }
+            i++; assert(i < argc);
+            cost_files.push_back({ (FrameBuffer::CostMetric)metric, argv[i] });
+        }
         else if (!strcmp(argv[i], "-shade_back")) {
             shadeback = true;
         }
@@ -255,9 +658,30 @@ int Assignment::Assignment7Main(int argc, char* argv[])
         else if (!strcmp(argv[i], "-visualize_grid")) {
             visualize_grid = true;
         }
+        else if (!strcmp(argv[i], "-russian_roulette")) {
+            russian_roulette = true;
+        }
         else if (!strcmp(argv[i], "-stats")) {
             stats = true;
         }
+        else if (!strcmp(argv[i], "-stats_json")) {
+            i++; assert(i < argc);
+            stats_json_file = argv[i];
+        }
+        else if (!strcmp(argv[i], "-wavefront")) {
+            wavefront = true;
+        }
+        else if (!strcmp(argv[i], "-reorder")) {
+            wavefront = true;
+            reorder = true;
+        }
+        else if (!strcmp(argv[i], "-collapse_transforms")) {
+            collapse_transforms = true;
+        }
+        else if (!strcmp(argv[i], "-bake_transforms")) {
+            collapse_transforms = true;
+            bake_transforms = true;
+        }
         else if (!strcmp(argv[i], "-box_filter")) {
             filterType = FilterType::BoxFilter;
             i++; assert(i < argc);
@@ -288,6 +712,50 @@ int Assignment::Assignment7Main(int argc, char* argv[])
             i++; assert(i < argc);
             spp = atoi(argv[i]);
         }
+        else if (!strcmp(argv[i], "-reference")) {
+            i++; assert(i < argc);
+            reference_file = argv[i];
+        }
+        else if (!strcmp(argv[i], "-compare")) {
+            i++; assert(i < argc);
+            compare_file = argv[i];
+        }
+        else if (!strcmp(argv[i], "-diff")) {
+            i++; assert(i < argc);
+            diff_file = argv[i];
+        }
+        else if (!strcmp(argv[i], "-min_psnr")) {
+            i++; assert(i < argc);
+            min_psnr = atof(argv[i]);
+        }
+        else if (!strcmp(argv[i], "-tile")) {
+            i++; assert(i < argc);
+            tile_x0 = atoi(argv[i]);
+            i++; assert(i < argc);
+            tile_y0 = atoi(argv[i]);
+            i++; assert(i < argc);
+            tile_x1 = atoi(argv[i]);
+            i++; assert(i < argc);
+            tile_y1 = atoi(argv[i]);
+            i++; assert(i < argc);
+            tile_file = argv[i];
+        }
+        else if (!strcmp(argv[i], "-merge")) {
+            i++; assert(i < argc);
+            merge_files.push_back(argv[i]);
+        }
+        else if (!strcmp(argv[i], "-checkpoint")) {
+            i++; assert(i < argc);
+            checkpoint_file = argv[i];
+            i++; assert(i < argc);
+            checkpoint_interval = atof(argv[i]);
+        }
+        else if (!strcmp(argv[i], "-resume")) {
+            resume = true;
+        }
+        else if (!strcmp(argv[i], "-watch")) {
+            watch = true;
+        }
         else if (!strcmp(argv[i], "-render_samples")) {
             i++; assert(i < argc);
             render_samplesFile = argv[i];
@@ -307,16 +775,120 @@ int Assignment::Assignment7Main(int argc, char* argv[])
         }
     }
 
+    switch (filterType)
+    {
+    case FilterType::None:
+        break;
+    case FilterType::BoxFilter:
+        filter = new BoxFilter(filterRadius);
+        break;
+    case FilterType::TentFilter:
+        filter = new TentFilter(filterRadius);
+        break;
+    case FilterType::GaussianFilter:
+        filter = new GaussianFilter(filterRadius);
+        break;
+    default:
+        break;
+    }
+
+    if (resume && checkpoint_file == NULL)
+    {
+        printf("ERROR: -resume needs the -checkpoint file to resume from\n");
+        return 1;
+    }
+
+    // Every argument that changes the image identifies a checkpoint
+    for (int i = 2; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "-checkpoint")) { i += 2; continue; }
+        if (!strcmp(argv[i], "-resume") || !strcmp(argv[i], "-stats") || !strcmp(argv[i], "-watch")) continue;
+        checkpoint_settings += argv[i];
+        checkpoint_settings += ' ';
+    }
+
+    // Every image to write has a format Image::Save knows, checked
+    // before anything is rendered. The -render_* images are always tga.
+    std::vector<const char*> images = { output_file, depth_file, normal_file,
+        material_id_file, primitive_id_file, diff_file };
+    for (const CostFile& cost : cost_files)
+        images.push_back(cost.filename);
+    for (const char* image : images)
+    {
+        if (image != NULL && !Image::IsKnownFormat(image))
+        {
+            printf("ERROR: %s: unknown image format, use .tga, .ppm, .pfm or .exr\n", image);
+            return 1;
+        }
+    }
+    for (const char* image : { render_samplesFile, render_filterfile })
+    {
+        if (image != NULL && (strlen(image) < 4 || strcmp(image + strlen(image) - 4, ".tga") != 0))
+        {
+            printf("ERROR: %s: -render_samples and -render_filter write .tga images\n", image);
+            return 1;
+        }
+    }
+
+    // Merge mode: -merge tile ... -output image, no rendering
+    if (!merge_files.empty())
+        return MergeTiles() ? 0 : 1;
+
+    // Compare mode: -compare image -reference reference, no rendering
+    if (compare_file != NULL)
+    {
+        FILE* file = fopen(compare_file, "rb");
+        if (file == NULL || reference_file == NULL)
+        {
+            printf("ERROR: -compare needs an existing image and a -reference\n");
+            if (file != NULL) fclose(file);
+            return 1;
+        }
+        fclose(file);
+        Image* img = Image::Load(compare_file);
+        if (img == NULL)
+            return 1;
+        bool passed = CompareWithReference(*img, reference_file);
+        delete img;
+        return passed ? 0 : 1;
+    }
+
     // ========================================================
     // ========================================================
     // open the file
     std::string file_path = "./resource/assignment7/";
     std::string file_input = input_file;
 
-    scene = new SceneParser_v6((file_path + file_input).c_str());
+    scene_file = file_path + file_input;
+    scene = LoadScene();
     rayTracer = new RayTracer(scene, nBounce, fWeight, shadows);
+    if (wavefront && !cost_files.empty())
+    {
+        // The wavefront tracer can't tell which pixel a count belongs to
+        printf("-cost renders with the recursive tracer, -wavefront is ignored\n");
+        wavefront = false;
+    }
+    if (wavefront && !visualize_grid)
+    {
+        wavefrontTracer = new WavefrontTracer(scene, nBounce, fWeight, shadows);
+        wavefrontTracer->setReorder(reorder);
+    }
+    else
+        wavefront = false;
     if (spp != 0) pFilm = new Film(size_width, size_height, spp);
 
+    // Without -tile the tile is the whole image
+    if (tile_file == NULL)
+    {
+        tile_x0 = tile_y0 = 0;
+        tile_x1 = size_width;
+        tile_y1 = size_height;
+    }
+    tile_x0 = (std::min)((std::max)(tile_x0, 0), size_width);
+    tile_y0 = (std::min)((std::max)(tile_y0, 0), size_height);
+    tile_x1 = (std::min)((std::max)(tile_x1, tile_x0), size_width);
+    tile_y1 = (std::min)((std::max)(tile_y1, tile_y0), size_height);
+
     switch (sampleType)
     {
     case SampleType::None:
@@ -334,33 +906,33 @@ int Assignment::Assignment7Main(int argc, char* argv[])
         break;
     }
 
-    switch (filterType)
+#ifdef HEADLESS
+    if (useGUI)
     {
-    case FilterType::None:
-        break;
-    case FilterType::BoxFilter:
-        filter = new BoxFilter(filterRadius);
-        break;
-    case FilterType::TentFilter:
-        filter = new TentFilter(filterRadius);
-        break;
-    case FilterType::GaussianFilter:
-        filter = new GaussianFilter(filterRadius);
-        break;
-    default:
-        break;
+        printf("-gui is not available in the headless build\n");
+        return 1;
     }
-
+    Render();
+    if (watch)
+        WatchScene();
+#else
     if (useGUI)
     {
         GLCanvas canvas;
+        if (!visualize_grid)
+            canvas.setProgressiveRender(TraceSample, size_width, size_height,
+                (sampleType == SampleType::None) ? 1 : spp);
+        canvas.setReload(ReloadScene);
         canvas.initialize(scene, Render, TraceRay, rayTracer->GetGrid(), visualize_grid);
     }
     else
     {
         Render();
+        if (watch)
+            WatchScene();
     }
-    return 0;
+#endif
+    return quality_failed ? 1 : 0;
 
 #else
     std::cout << "Please switch to RayTracer History Version 5" << endl;
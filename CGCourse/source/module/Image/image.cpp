@@ -1,6 +1,10 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <math.h>
+#include <vector>
+#include <thread>
+#include <algorithm>
 
 #include "image.h"
 
@@ -9,18 +13,6 @@
 // ====================================================================
 // some helper functions for save & load
 
-unsigned char ReadByte(FILE *file) {  
-  unsigned char b;
-  int success = fread((void*)&b,sizeof(unsigned char),1,file);
-  assert (success == 1);
-  return b;
-}
-
-void WriteByte(FILE *file, unsigned char b) {
-  int success = fwrite((void*)&b,sizeof(unsigned char),1,file);
-  assert (success == 1);
-}
-
 unsigned char ClampColorComponent(float c) {
   int tmp = int (c*255);
   if (tmp < 0) tmp = 0;
@@ -28,6 +20,62 @@ unsigned char ClampColorComponent(float c) {
   return (unsigned char)tmp;
 }
 
+static bool HasExtension(const char *filename, const char *ext) {
+  int n = strlen(filename);
+  int m = strlen(ext);
+  return n >= m && !strcmp(&filename[n-m],ext);
+}
+
+static bool ReadAll(void *data, size_t size, size_t count, FILE *file, const char *filename) {
+  if (fread(data,size,count,file) == count) return true;
+  printf("ERROR: %s: the file is truncated\n", filename);
+  return false;
+}
+
+// Runs rows(y0,y1,part) over [0,height) split into parts, one thread
+// per part. Small images are not worth the thread start-up and run as
+// a single part. Returns the number of parts.
+template <class RowRange>
+static int ParallelRows(int width, int height, RowRange rows) {
+  int threads = std::thread::hardware_concurrency();
+  if (threads <= 1 || width*height < 256*256) {
+    rows(0,height,0);
+    return 1;
+  }
+  std::vector<std::thread> workers;
+  int step = (height + threads - 1) / threads;
+  for (int y = 0; y < height; y += step)
+    workers.emplace_back(rows, y, std::min(y+step,height), (int)workers.size());
+  for (std::thread &w : workers)
+    w.join();
+  return workers.size();
+}
+
+static int MaxParts() {
+  return std::max(1u, std::thread::hardware_concurrency());
+}
+
+// ====================================================================
+// ====================================================================
+// Quantize the float data to bytes, in parallel for large images
+
+void Image::Quantize(unsigned char *out, bool bgr) const {
+  int first = bgr ? 2 : 0;
+  int last = bgr ? 0 : 2;
+  // flip y so that (0,0) is bottom left corner
+  ParallelRows(width, height, [=](int y0, int y1, int) {
+    for (int y = y0; y < y1; y++) {
+      const Vec3f *row = &data[(height-1-y)*width];
+      unsigned char *dst = &out[y*width*3];
+      for (int x = 0; x < width; x++) {
+        dst[3*x+0] = ClampColorComponent(row[x][first]);
+        dst[3*x+1] = ClampColorComponent(row[x][1]);
+        dst[3*x+2] = ClampColorComponent(row[x][last]);
+      }
+    }
+  });
+}
+
 // ====================================================================
 // ====================================================================
 // Save and Load data type 2 Targa (.tga) files
@@ -39,29 +87,22 @@ void Image::SaveTGA(const char *filename) const {
   const char *ext = &filename[strlen(filename)-4];
   assert(!strcmp(ext,".tga"));
   FILE *file = fopen(filename,"wb");
+  assert(file != NULL);
   // misc header information
-  for (int i = 0; i < 18; i++) {
-    unsigned char tmp;
-    if (i == 2) WriteByte(file,2);
-    else if (i == 12) WriteByte(file,width%256);
-    else if (i == 13) WriteByte(file,width/256);
-    else if (i == 14) WriteByte(file,height%256);
-    else if (i == 15) WriteByte(file,height/256);
-    else if (i == 16) WriteByte(file,24);
-    else if (i == 17) WriteByte(file,32);
-    else WriteByte(file,0);
-  }
-  // the data
-  // flip y so that (0,0) is bottom left corner
-  for (int y = height-1; y >= 0; y--) {
-    for (int x = 0; x < width; x++) {
-      Vec3f v = GetPixel(x,y);
-      // note reversed order: b, g, r
-      WriteByte(file,ClampColorComponent(v.b()));
-      WriteByte(file,ClampColorComponent(v.g()));
-      WriteByte(file,ClampColorComponent(v.r()));
-    }
-  }
+  unsigned char header[18] = { 0 };
+  header[2] = 2;
+  header[12] = width%256;
+  header[13] = width/256;
+  header[14] = height%256;
+  header[15] = height/256;
+  header[16] = 24;
+  header[17] = 32;
+  fwrite(header,1,18,file);
+  // the data, top row first
+  // note reversed order: b, g, r
+  std::vector<unsigned char> pixels(width*height*3);
+  Quantize(pixels.data(),true);
+  fwrite(pixels.data(),1,pixels.size(),file);
   fclose(file);
 }
 
@@ -71,31 +112,33 @@ Image* Image::LoadTGA(const char *filename) {
   const char *ext = &filename[strlen(filename)-4];
   assert(!strcmp(ext,".tga"));
   FILE *file = fopen(filename,"rb");
+  assert(file != NULL);
   // misc header information
-  int width = 0;
-  int height = 0;
-  for (int i = 0; i < 18; i++) {
-    unsigned char tmp;
-    tmp = ReadByte(file);
-    if (i == 2) assert(tmp == 2);
-    else if (i == 12) width += tmp;
-    else if (i == 13) width += 256*tmp;
-    else if (i == 14) height += tmp;
-    else if (i == 15) height += 256*tmp;
-    else if (i == 16) assert(tmp == 24);
-    else if (i == 17) assert(tmp == 32);
-    else assert(tmp == 0);
+  unsigned char header[18];
+  if (!ReadAll(header,1,18,file,filename)) {
+    fclose(file);
+    return NULL;
   }
+  assert(header[2] == 2);
+  assert(header[16] == 24);
+  assert(header[17] == 32);
+  int width = header[12] + 256*header[13];
+  int height = header[14] + 256*header[15];
   // the data
   Image *answer = new Image(width,height);
+  std::vector<unsigned char> row(width*3);
   // flip y so that (0,0) is bottom left corner
   for (int y = height-1; y >= 0; y--) {
+    if (!ReadAll(row.data(),1,row.size(),file,filename)) {
+      delete answer;
+      fclose(file);
+      return NULL;
+    }
     for (int x = 0; x < width; x++) {
-      unsigned char r,g,b;
       // note reversed order: b, g, r
-      b = ReadByte(file);
-      g = ReadByte(file);
-      r = ReadByte(file);
+      unsigned char b = row[3*x+0];
+      unsigned char g = row[3*x+1];
+      unsigned char r = row[3*x+2];
       Vec3f color(r/255.0,g/255.0,b/255.0);
       answer->SetPixel(x,y,color);
     }
@@ -114,23 +157,17 @@ void Image::SavePPM(const char *filename) const {
   // must end in .ppm
   const char *ext = &filename[strlen(filename)-4];
   assert(!strcmp(ext,".ppm"));
-  FILE *file = fopen(filename, "w");
+  FILE *file = fopen(filename, "wb");
   // misc header information
   assert(file != NULL);
   fprintf (file, "P6\n");
   fprintf (file, "# Creator: Image::SavePPM()\n");
   fprintf (file, "%d %d\n", width,height);
   fprintf (file, "255\n");
-  // the data
-  // flip y so that (0,0) is bottom left corner
-  for (int y = height-1; y >= 0; y--) {
-    for (int x=0; x<width; x++) {
-      Vec3f v = GetPixel(x,y);
-      fputc (ClampColorComponent(v.r()),file);
-      fputc (ClampColorComponent(v.g()),file);
-      fputc (ClampColorComponent(v.b()),file);
-    }
-  }
+  // the data, top row first
+  std::vector<unsigned char> pixels(width*height*3);
+  Quantize(pixels.data(),false);
+  fwrite(pixels.data(),1,pixels.size(),file);
   fclose(file);
 }
 
@@ -140,6 +177,7 @@ Image* Image::LoadPPM(const char *filename) {
   const char *ext = &filename[strlen(filename)-4];
   assert(!strcmp(ext,".ppm"));
   FILE *file = fopen(filename,"rb");
+  assert(file != NULL);
   // misc header information
   int width = 0;
   int height = 0;  
@@ -154,13 +192,18 @@ Image* Image::LoadPPM(const char *filename) {
   assert (strstr(tmp,"255"));
   // the data
   Image *answer = new Image(width,height);
+  std::vector<unsigned char> row(width*3);
   // flip y so that (0,0) is bottom left corner
   for (int y = height-1; y >= 0; y--) {
+    if (!ReadAll(row.data(),1,row.size(),file,filename)) {
+      delete answer;
+      fclose(file);
+      return NULL;
+    }
     for (int x = 0; x < width; x++) {
-      unsigned char r,g,b;
-      r = fgetc(file);
-      g = fgetc(file);
-      b = fgetc(file);
+      unsigned char r = row[3*x+0];
+      unsigned char g = row[3*x+1];
+      unsigned char b = row[3*x+2];
       Vec3f color(r/255.0,g/255.0,b/255.0);
       answer->SetPixel(x,y,color);
     }
@@ -169,6 +212,184 @@ Image* Image::LoadPPM(const char *filename) {
   return answer;
 }
 
+// ====================================================================
+// ====================================================================
+// Save and Load Portable Float Map (.pfm) files: 'PF' header, then
+// little endian float rgb triples, bottom row first
+
+void Image::SavePFM(const char *filename) const {
+  assert(filename != NULL);
+  assert(HasExtension(filename,".pfm"));
+  FILE *file = fopen(filename,"wb");
+  assert(file != NULL);
+  // a negative scale means little endian
+  fprintf (file, "PF\n%d %d\n-1.0\n", width,height);
+  std::vector<float> row(width*3);
+  for (int y = 0; y < height; y++) {
+    for (int x = 0; x < width; x++) {
+      const Vec3f &v = GetPixel(x,y);
+      row[3*x+0] = v.r();
+      row[3*x+1] = v.g();
+      row[3*x+2] = v.b();
+    }
+    fwrite(row.data(),sizeof(float),row.size(),file);
+  }
+  fclose(file);
+}
+
+Image* Image::LoadPFM(const char *filename) {
+  assert(filename != NULL);
+  assert(HasExtension(filename,".pfm"));
+  FILE *file = fopen(filename,"rb");
+  assert(file != NULL);
+  int width = 0;
+  int height = 0;
+  float scale = 0;
+  char tmp[100];
+  fgets(tmp,100,file);
+  assert (strstr(tmp,"PF"));
+  fgets(tmp,100,file);
+  sscanf(tmp,"%d %d",&width,&height);
+  fgets(tmp,100,file);
+  sscanf(tmp,"%f",&scale);
+  // only little endian files, as written by SavePFM
+  assert (scale < 0);
+  Image *answer = new Image(width,height);
+  std::vector<float> row(width*3);
+  for (int y = 0; y < height; y++) {
+    if (!ReadAll(row.data(),sizeof(float),row.size(),file,filename)) {
+      delete answer;
+      fclose(file);
+      return NULL;
+    }
+    for (int x = 0; x < width; x++)
+      answer->SetPixel(x,y,Vec3f(row[3*x+0],row[3*x+1],row[3*x+2]));
+  }
+  fclose(file);
+  return answer;
+}
+
+// ====================================================================
+// ====================================================================
+// Minimal OpenEXR writer: single part, uncompressed scanlines, 32 bit
+// float B, G, R channels. Every header value is little endian.
+
+static void PutInt(std::vector<unsigned char> &out, int v) {
+  for (int i = 0; i < 4; i++)
+    out.push_back((v >> (8*i)) & 0xff);
+}
+
+static void PutFloat(std::vector<unsigned char> &out, float f) {
+  int v;
+  memcpy(&v,&f,4);
+  PutInt(out,v);
+}
+
+static void PutString(std::vector<unsigned char> &out, const char *s) {
+  out.insert(out.end(),s,s+strlen(s)+1);
+}
+
+static void PutAttribute(std::vector<unsigned char> &out, const char *name, const char *type, int size) {
+  PutString(out,name);
+  PutString(out,type);
+  PutInt(out,size);
+}
+
+void Image::SaveEXR(const char *filename) const {
+  assert(filename != NULL);
+  assert(HasExtension(filename,".exr"));
+  FILE *file = fopen(filename,"wb");
+  assert(file != NULL);
+
+  std::vector<unsigned char> header;
+  PutInt(header,20000630);  // magic number
+  PutInt(header,2);         // version 2, scanline image
+  // channels are stored in alphabetical order
+  const char *channels[] = { "B", "G", "R" };
+  PutAttribute(header,"channels","chlist",3*(2+16)+1);
+  for (int c = 0; c < 3; c++) {
+    PutString(header,channels[c]);
+    PutInt(header,2);       // FLOAT
+    PutInt(header,0);       // pLinear + reserved
+    PutInt(header,1);       // x sampling
+    PutInt(header,1);       // y sampling
+  }
+  header.push_back(0);
+  PutAttribute(header,"compression","compression",1);
+  header.push_back(0);      // NO_COMPRESSION
+  PutAttribute(header,"dataWindow","box2i",16);
+  PutInt(header,0); PutInt(header,0); PutInt(header,width-1); PutInt(header,height-1);
+  PutAttribute(header,"displayWindow","box2i",16);
+  PutInt(header,0); PutInt(header,0); PutInt(header,width-1); PutInt(header,height-1);
+  PutAttribute(header,"lineOrder","lineOrder",1);
+  header.push_back(0);      // INCREASING_Y
+  PutAttribute(header,"pixelAspectRatio","float",4);
+  PutFloat(header,1);
+  PutAttribute(header,"screenWindowCenter","v2f",8);
+  PutFloat(header,0); PutFloat(header,0);
+  PutAttribute(header,"screenWindowWidth","float",4);
+  PutFloat(header,1);
+  header.push_back(0);      // end of header
+  fwrite(header.data(),1,header.size(),file);
+
+  // offset table, then one chunk per scanline: y, size, B row, G row, R row
+  int rowSize = width*3*4;
+  unsigned long long offset = header.size() + 8ull*height;
+  std::vector<unsigned char> table;
+  for (int y = 0; y < height; y++) {
+    unsigned long long o = offset + (unsigned long long)y*(8+rowSize);
+    PutInt(table,(int)(o & 0xffffffff));
+    PutInt(table,(int)(o >> 32));
+  }
+  fwrite(table.data(),1,table.size(),file);
+
+  std::vector<unsigned char> chunk;
+  for (int y = 0; y < height; y++) {
+    chunk.clear();
+    PutInt(chunk,y);
+    PutInt(chunk,rowSize);
+    // exr rows go top to bottom
+    const Vec3f *row = &data[(height-1-y)*width];
+    for (int c = 2; c >= 0; c--)
+      for (int x = 0; x < width; x++)
+        PutFloat(chunk,row[x][c]);
+    fwrite(chunk.data(),1,chunk.size(),file);
+  }
+  fclose(file);
+}
+
+// ====================================================================
+// ====================================================================
+
+bool Image::Save(const char *filename) const {
+  if (HasExtension(filename,".pfm")) SavePFM(filename);
+  else if (HasExtension(filename,".exr")) SaveEXR(filename);
+  else if (HasExtension(filename,".ppm")) SavePPM(filename);
+  else if (HasExtension(filename,".tga")) SaveTGA(filename);
+  else {
+    printf("ERROR: %s: unknown image format, use .tga, .ppm, .pfm or .exr\n", filename);
+    return false;
+  }
+  return true;
+}
+
+Image* Image::Load(const char *filename) {
+  if (HasExtension(filename,".pfm")) return LoadPFM(filename);
+  else if (HasExtension(filename,".ppm")) return LoadPPM(filename);
+  else if (HasExtension(filename,".tga")) return LoadTGA(filename);
+  printf("ERROR: %s: can't read this image format, use .tga, .ppm or .pfm\n", filename);
+  return NULL;
+}
+
+bool Image::IsKnownFormat(const char *filename) {
+  return HasExtension(filename,".tga") || HasExtension(filename,".ppm") ||
+    HasExtension(filename,".pfm") || HasExtension(filename,".exr");
+}
+
+bool Image::IsFloatFormat(const char *filename) {
+  return HasExtension(filename,".pfm") || HasExtension(filename,".exr");
+}
+
 // ====================================================================
 // ====================================================================
 
@@ -178,17 +399,99 @@ Image* Image::Compare(Image* img1, Image* img2) {
   
   Image* img3 = new Image(img1->Width(), img1->Height());
   
-  
-  for (int x = 0; x < img1->Width(); x++) {
-    for (int y = 0; y < img1->Height(); y++) {
-      Vec3f color1 = img1->GetPixel(x, y);
-      Vec3f color2 = img2->GetPixel(x, y);
-      Vec3f color3 = Vec3f(fabs(color1.r() - color2.r()),
-			   fabs(color1.g() - color2.g()),
-			   fabs(color1.b() - color2.b()));
-      img3->SetPixel(x, y, color3);
+  ParallelRows(img1->Width(), img1->Height(), [=](int y0, int y1, int) {
+    for (int y = y0; y < y1; y++) {
+      for (int x = 0; x < img1->Width(); x++) {
+        Vec3f color1 = img1->GetPixel(x, y);
+        Vec3f color2 = img2->GetPixel(x, y);
+        Vec3f color3 = Vec3f(fabs(color1.r() - color2.r()),
+                             fabs(color1.g() - color2.g()),
+                             fabs(color1.b() - color2.b()));
+        img3->SetPixel(x, y, color3);
+      }
     }
-  }
+  });
   
   return img3;
 }
+
+// ====================================================================
+// ====================================================================
+// Error metrics, with colors on a 0..1 scale (peak signal 1).
+// SSIM is the mean over 8x8 windows placed every 4 pixels, averaged
+// over the three channels.
+
+ImageMetrics Image::CompareMetrics(const Image* img1, const Image* img2) {
+  assert (img1->Width() == img2->Width());
+  assert (img1->Height() == img2->Height());
+  int width = img1->Width();
+  int height = img1->Height();
+
+  // per thread partial sums
+  int parts = MaxParts();
+  std::vector<double> squared(parts, 0);
+  std::vector<float> maxError(parts, 0);
+  ParallelRows(width, height, [&](int y0, int y1, int part) {
+    double sum = 0;
+    float worst = 0;
+    for (int y = y0; y < y1; y++)
+      for (int x = 0; x < width; x++) {
+        const Vec3f &a = img1->GetPixel(x, y);
+        const Vec3f &b = img2->GetPixel(x, y);
+        for (int c = 0; c < 3; c++) {
+          float d = fabs(a[c] - b[c]);
+          sum += d * d;
+          worst = std::max(worst, d);
+        }
+      }
+    squared[part] = sum;
+    maxError[part] = worst;
+  });
+
+  ImageMetrics metrics;
+  double total = 0;
+  metrics.maxError = 0;
+  for (int i = 0; i < parts; i++) {
+    total += squared[i];
+    metrics.maxError = std::max(metrics.maxError, maxError[i]);
+  }
+  metrics.mse = total / (3.0 * width * height);
+  metrics.psnr = (metrics.mse > 0) ? 10.0 * log10(1.0 / metrics.mse) : INFINITY;
+
+  const int window = 8;
+  const int stride = 4;
+  const double C1 = 0.01 * 0.01;
+  const double C2 = 0.03 * 0.03;
+  int windowsX = (width >= window) ? (width - window) / stride + 1 : 0;
+  int windowsY = (height >= window) ? (height - window) / stride + 1 : 0;
+  std::vector<double> ssim(parts, 0);
+  ParallelRows(width, windowsY, [&](int w0, int w1, int part) {
+    double sum = 0;
+    for (int wy = w0; wy < w1; wy++)
+      for (int wx = 0; wx < windowsX; wx++)
+        for (int c = 0; c < 3; c++) {
+          double ma = 0, mb = 0, aa = 0, bb = 0, ab = 0;
+          for (int y = wy * stride; y < wy * stride + window; y++)
+            for (int x = wx * stride; x < wx * stride + window; x++) {
+              double a = img1->GetPixel(x, y)[c];
+              double b = img2->GetPixel(x, y)[c];
+              ma += a; mb += b;
+              aa += a * a; bb += b * b; ab += a * b;
+            }
+          double n = window * window;
+          ma /= n; mb /= n;
+          double va = aa / n - ma * ma;
+          double vb = bb / n - mb * mb;
+          double cov = ab / n - ma * mb;
+          sum += ((2 * ma * mb + C1) * (2 * cov + C2)) /
+                 ((ma * ma + mb * mb + C1) * (va + vb + C2));
+        }
+    ssim[part] = sum;
+  });
+  double ssimTotal = 0;
+  for (int i = 0; i < parts; i++)
+    ssimTotal += ssim[i];
+  int windows = windowsX * windowsY * 3;
+  metrics.ssim = (windows > 0) ? ssimTotal / windows : 1.0;
+  return metrics;
+}
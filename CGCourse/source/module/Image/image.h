@@ -4,6 +4,17 @@
 #include <assert.h>
 #include <vectors.h>
 
+// ====================================================================
+// ====================================================================
+// Difference between two images, see Image::CompareMetrics
+
+struct ImageMetrics {
+  double mse;       // mean squared error over all channels
+  double psnr;      // in dB, infinite for identical images
+  double ssim;      // structural similarity, 1 for identical images
+  float maxError;   // largest absolute channel difference
+};
+
 // ====================================================================
 // ====================================================================
 // Simple image class
@@ -46,9 +57,28 @@ public:
   void SavePPM(const char *filename) const; 
   static Image* LoadTGA(const char *filename);
   void SaveTGA(const char *filename) const; 
+
+  // float images, the colors are written without clamping
+  static Image* LoadPFM(const char *filename);
+  void SavePFM(const char *filename) const;
+  void SaveEXR(const char *filename) const;
+
+  // picks the format from the extension (.tga, .ppm, .pfm or .exr).
+  // Any other extension is an error: nothing is written (Save returns
+  // false) or read (Load returns NULL, so does it for .exr and for a
+  // truncated file)
+  bool Save(const char *filename) const;
+  static Image* Load(const char *filename);
+  static bool IsKnownFormat(const char *filename);
+  static bool IsFloatFormat(const char *filename);
+
+  // clamps and quantizes to 8 bit rgb (or bgr) rows, top row first,
+  // split over several threads for large images
+  void Quantize(unsigned char *out, bool bgr) const;
   
   // extension for image comparison
   static Image* Compare(Image* img1, Image* img2);
+  static ImageMetrics CompareMetrics(const Image* img1, const Image* img2);
   
 private:
 
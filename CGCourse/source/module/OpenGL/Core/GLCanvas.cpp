@@ -17,6 +17,8 @@
 // These function will get called from the 'keyboard' routine
 void (*GLCanvas::renderFunction)(void);
 void (*GLCanvas::traceRayFunction)(float, float);
+Vec3f(*GLCanvas::sampleFunction)(int, int, int);
+SceneParser_v6* (*GLCanvas::reloadFunction)(void);
 
 // A pointer to the global SceneParser
 SceneParser_v6* GLCanvas::scene;
@@ -31,6 +33,17 @@ int GLCanvas::mouseButton;
 int GLCanvas::mouseX;
 int GLCanvas::mouseY;
 
+// State of the progressive render
+int GLCanvas::progressiveWidth = 0;
+int GLCanvas::progressiveHeight = 0;
+int GLCanvas::progressiveSamples = 1;
+std::thread* GLCanvas::renderThread = NULL;
+std::atomic<bool> GLCanvas::cancelRender(false);
+std::atomic<int> GLCanvas::passesDone(0);
+int GLCanvas::passesShown = 0;
+std::mutex GLCanvas::pixelsMutex;
+std::vector<unsigned char> GLCanvas::progressivePixels;
+
 // ========================================================
 // ========================================================
 
@@ -105,6 +118,13 @@ void GLCanvas::display(void)
     glClearColor(bgColor.x(), bgColor.y(), bgColor.z(), 1.0);
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
+    // Show the latest pass of the progressive render, if any
+    if (passesShown > 0) {
+        drawProgressive();
+        glutSwapBuffers();
+        return;
+    }
+
     // Set the camera parameters
     glMatrixMode(GL_MODELVIEW);
     glLoadIdentity();
@@ -217,6 +237,9 @@ void GLCanvas::mouse(int button, int state, int x, int y) {
 // ========================================================
 
 void GLCanvas::motion(int x, int y) {
+    // The render thread reads the camera, stop it before moving
+    cancelProgressiveRender();
+
     // Left button = rotation
     // (rotate camera around the up and horizontal vectors)
     if (mouseButton == GLUT_LEFT_BUTTON) {
@@ -249,13 +272,22 @@ void GLCanvas::motion(int x, int y) {
 
 void GLCanvas::keyboard(unsigned char key, int i, int j) {
     switch (key) {
-    case 'r':  case 'R':
+    case 'r':
+        if (sampleFunction) {
+            printf("Progressive rendering scene...\n");
+            startProgressiveRender();
+            break;
+        }
+        // fall through
+    case 'R':
+        cancelProgressiveRender();
         printf("Rendering scene... ");
         fflush(stdout);
         if (renderFunction) renderFunction();
         printf("done.\n");
         break;
     case 't':  case 'T': {
+        cancelProgressiveRender();
         // visualize the ray tree for the pixel at the current mouse position
         int width = glutGet(GLUT_WINDOW_WIDTH);
         int height = glutGet(GLUT_WINDOW_HEIGHT);
@@ -272,6 +304,20 @@ void GLCanvas::keyboard(unsigned char key, int i, int j) {
         // redraw
         display();
         break; }
+    case 'l':  case 'L': {
+        if (!reloadFunction)
+            break;
+        cancelProgressiveRender();
+        scene = reloadFunction();
+        grid = scene->grid;
+        // the new camera and ambient light
+        Vec3f ambColor = scene->getAmbientLight();
+        GLfloat ambArr[] = { ambColor.x(), ambColor.y(), ambColor.z(), 1.0 };
+        glLightModelfv(GL_LIGHT_MODEL_AMBIENT, ambArr);
+        reshape(glutGet(GLUT_WINDOW_WIDTH), glutGet(GLUT_WINDOW_HEIGHT));
+        // redraw
+        display();
+        break; }
     case 'g':  case 'G': {
         // toggle ray-grid march visualization
         visualize_grid_march = (visualize_grid_march + 1) % 3;
@@ -279,6 +325,7 @@ void GLCanvas::keyboard(unsigned char key, int i, int j) {
         display();
         break; }
     case 'q':  case 'Q':
+        cancelProgressiveRender();
         exit(0);
         break;
     default:
@@ -335,9 +382,131 @@ void GLCanvas::initialize(SceneParser_v6* _scene,
     glutReshapeFunc(reshape);
     glutKeyboardFunc(keyboard);
 
+    if (sampleFunction)
+        glutTimerFunc(0, idle, 0);
+
     // Enter the main rendering loop
     glutMainLoop();
 }
 
+// ========================================================
+// Progressive rendering
+// ========================================================
+
+void GLCanvas::setProgressiveRender(Vec3f(*_sampleFunction)(int, int, int),
+    int width, int height, int samples) {
+    sampleFunction = _sampleFunction;
+    progressiveWidth = width;
+    progressiveHeight = height;
+    progressiveSamples = samples;
+}
+
+void GLCanvas::setReload(SceneParser_v6* (*_reloadFunction)(void)) {
+    reloadFunction = _reloadFunction;
+}
+
+void GLCanvas::startProgressiveRender(void) {
+    cancelProgressiveRender();
+    cancelRender = false;
+    renderThread = new std::thread(progressiveRender);
+}
+
+void GLCanvas::cancelProgressiveRender(void) {
+    if (renderThread != NULL) {
+        cancelRender = true;
+        renderThread->join();
+        delete renderThread;
+        renderThread = NULL;
+    }
+    passesDone = 0;
+    passesShown = 0;
+}
+
+// Runs on the render thread. The first three passes trace one sample
+// per 4x4, 2x2 and 1x1 block, reusing the pixels of the coarser pass;
+// every further pass adds one more sample to each pixel
+void GLCanvas::progressiveRender(void) {
+    int width = progressiveWidth;
+    int height = progressiveHeight;
+    std::vector<Vec3f> accum(width * height);
+    std::vector<unsigned char> pixels(width * height * 3);
+
+    auto publish = [&](int block, float scale) {
+        for (int j = 0; j < height; j++)
+            for (int i = 0; i < width; i++) {
+                Vec3f color = scale * accum[(j - j % block) * width + (i - i % block)];
+                for (int c = 0; c < 3; c++) {
+                    float v = color[c] < 0 ? 0 : (color[c] > 1 ? 1 : color[c]);
+                    pixels[(j * width + i) * 3 + c] = (unsigned char)(v * 255 + 0.5f);
+                }
+            }
+        std::lock_guard<std::mutex> lock(pixelsMutex);
+        progressivePixels.swap(pixels);
+        pixels.resize(width * height * 3);
+        passesDone++;
+    };
+
+    for (int block = 4; block >= 1; block /= 2) {
+        for (int j = 0; j < height; j += block) {
+            if (cancelRender) return;
+            for (int i = 0; i < width; i += block) {
+                if (block < 4 && i % (2 * block) == 0 && j % (2 * block) == 0)
+                    continue;
+                accum[j * width + i] = sampleFunction(i, j, 0);
+            }
+        }
+        publish(block, 1);
+    }
+
+    for (int k = 1; k < progressiveSamples; k++) {
+        for (int j = 0; j < height; j++) {
+            if (cancelRender) return;
+            for (int i = 0; i < width; i++)
+                accum[j * width + i] += sampleFunction(i, j, k);
+        }
+        publish(1, 1.0f / (k + 1));
+    }
+}
+
+// Draws the latest finished pass stretched over the whole window
+void GLCanvas::drawProgressive(void) {
+    int width = glutGet(GLUT_WINDOW_WIDTH);
+    int height = glutGet(GLUT_WINDOW_HEIGHT);
+
+    glDisable(GL_LIGHTING);
+    glDisable(GL_DEPTH_TEST);
+    glMatrixMode(GL_PROJECTION);
+    glPushMatrix();
+    glLoadIdentity();
+    glOrtho(0, 1, 0, 1, -1, 1);
+    glMatrixMode(GL_MODELVIEW);
+    glLoadIdentity();
+
+    glRasterPos2f(0, 0);
+    glPixelZoom(width / float(progressiveWidth), height / float(progressiveHeight));
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    {
+        std::lock_guard<std::mutex> lock(pixelsMutex);
+        glDrawPixels(progressiveWidth, progressiveHeight, GL_RGB, GL_UNSIGNED_BYTE, progressivePixels.data());
+    }
+    glPixelZoom(1, 1);
+
+    glMatrixMode(GL_PROJECTION);
+    glPopMatrix();
+    glMatrixMode(GL_MODELVIEW);
+    glEnable(GL_DEPTH_TEST);
+    glEnable(GL_LIGHTING);
+}
+
+// Polls the render thread and redraws when a new pass is done
+void GLCanvas::idle(int value) {
+    glutTimerFunc(30, idle, 0);
+    int done = passesDone;
+    if (done != passesShown) {
+        passesShown = done;
+        glutPostRedisplay();
+    }
+}
+
 // ========================================================
 // ========================================================
\ No newline at end of file
@@ -6,12 +6,25 @@
 // the name of the routine that will perform the ray tracing.  Once the
 // OpenGL interface is open, the scene can be rendered from the current
 // camera position by pressing the 'r' key.
+//
+// If a sample function is given with 'setProgressiveRender', 'r' starts
+// a progressive render on a background thread instead: the image is
+// traced at 1/16 resolution first and refined pass by pass up to full
+// resolution and full spp, and each pass is shown as it completes.
+// Moving the camera cancels it. 'R' still runs the full render function.
+//
+// If a reload function is given with 'setReload', 'l' loads the scene
+// file again, to look at an edit of it without restarting.
 // ====================================================================
 
 #ifndef _GL_CANVAS_H_
 #define _GL_CANVAS_H_
 
 #include <stdlib.h>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <mutex>
 #include <RayTracer/Core/scene_parser.h>
 #include <RayTracer/VersionControl.h>
 
@@ -40,6 +53,14 @@ private:
 	// This gets called from the 'keyboard' routine
 	static void (*traceRayFunction)(float, float);
 
+	// A reference to the function that traces sample k of pixel (i, j)
+	// This gets called from the progressive render thread
+	static Vec3f(*sampleFunction)(int, int, int);
+
+	// A reference to the function that loads the scene file again and
+	// returns the new scene. This gets called from the 'keyboard' routine
+	static SceneParser_v6* (*reloadFunction)(void);
+
 	// A pointer to the global SceneParser
 	static SceneParser_v6* scene;
 
@@ -51,6 +72,23 @@ private:
 	// Helper function for the display routine
 	static void drawAxes(void);
 
+	// State of the progressive render
+	static int progressiveWidth;
+	static int progressiveHeight;
+	static int progressiveSamples;
+	static std::thread* renderThread;
+	static std::atomic<bool> cancelRender;
+	static std::atomic<int> passesDone;
+	static int passesShown;
+	static std::mutex pixelsMutex;
+	static std::vector<unsigned char> progressivePixels;
+
+	static void startProgressiveRender(void);
+	static void cancelProgressiveRender(void);
+	static void progressiveRender(void);
+	static void drawProgressive(void);
+	static void idle(int value);
+
 	// State of the mouse cursor
 	static int mouseButton;
 	static int mouseX;
@@ -68,6 +106,8 @@ public:
 	GLCanvas(void) {
 		renderFunction = NULL;
 		traceRayFunction = NULL;
+		sampleFunction = NULL;
+		reloadFunction = NULL;
 	}
 	~GLCanvas(void) { }
 
@@ -79,6 +119,14 @@ public:
 		void (*_renderFunction)(void),
 		void (*_traceRayFunction)(float, float),
 		Grid* _grid, bool _visualize_grid);
+
+	// Enable progressive rendering of a width x height image with
+	// the given number of samples per pixel. Call before 'initialize'
+	void setProgressiveRender(Vec3f(*_sampleFunction)(int, int, int),
+		int width, int height, int samples);
+
+	// Enable reloading the scene with the 'l' key. Call before 'initialize'
+	void setReload(SceneParser_v6* (*_reloadFunction)(void));
 };
 
 // ====================================================================
@@ -0,0 +1,94 @@
+// ====================================================================
+// Headless replacement for <GL/gl.h>.
+//
+// The headless build puts this directory in front of the include path,
+// so the paint/glInit code of the ray tracer still compiles on a
+// machine without OpenGL. Every GL call used by the ray tracer modules
+// becomes a no-op, and nothing has to be linked.
+// ====================================================================
+
+#ifndef _HEADLESS_GL_H_
+#define _HEADLESS_GL_H_
+
+typedef unsigned int GLenum;
+typedef unsigned int GLbitfield;
+typedef unsigned char GLboolean;
+typedef int GLint;
+typedef int GLsizei;
+typedef float GLfloat;
+typedef double GLdouble;
+
+#define GL_FALSE 0
+#define GL_TRUE 1
+
+#define GL_LINES 0x0001
+#define GL_TRIANGLES 0x0004
+#define GL_TRIANGLE_FAN 0x0006
+#define GL_QUADS 0x0007
+
+#define GL_LESS 0x0201
+#define GL_EQUAL 0x0202
+#define GL_ZERO 0
+#define GL_ONE 1
+#define GL_SRC_ALPHA 0x0302
+#define GL_ONE_MINUS_SRC_ALPHA 0x0303
+#define GL_DST_COLOR 0x0306
+
+#define GL_BACK 0x0405
+#define GL_FRONT_AND_BACK 0x0408
+#define GL_CULL_FACE 0x0B44
+#define GL_LIGHTING 0x0B50
+#define GL_LIGHT_MODEL_LOCAL_VIEWER 0x0B51
+#define GL_LIGHT_MODEL_TWO_SIDE 0x0B52
+#define GL_LIGHT_MODEL_AMBIENT 0x0B53
+#define GL_DEPTH_TEST 0x0B71
+#define GL_NORMALIZE 0x0BA1
+#define GL_BLEND 0x0BE2
+#define GL_UNPACK_ALIGNMENT 0x0CF5
+#define GL_SMOOTH 0x1D01
+#define GL_MODELVIEW 0x1700
+#define GL_PROJECTION 0x1701
+#define GL_UNSIGNED_BYTE 0x1401
+#define GL_RGB 0x1907
+
+#define GL_AMBIENT 0x1200
+#define GL_DIFFUSE 0x1201
+#define GL_SPECULAR 0x1202
+#define GL_POSITION 0x1203
+#define GL_SHININESS 0x1601
+
+#define GL_LIGHT0 0x4000
+#define GL_LIGHT1 0x4001
+#define GL_LIGHT2 0x4002
+#define GL_LIGHT3 0x4003
+#define GL_LIGHT4 0x4004
+#define GL_LIGHT5 0x4005
+#define GL_LIGHT6 0x4006
+#define GL_LIGHT7 0x4007
+
+#define GL_DEPTH_BUFFER_BIT 0x00000100
+#define GL_COLOR_BUFFER_BIT 0x00004000
+
+#define glBegin(...) ((void)0)
+#define glEnd(...) ((void)0)
+#define glVertex3f(...) ((void)0)
+#define glNormal3f(...) ((void)0)
+#define glColor3f(...) ((void)0)
+#define glColor4f(...) ((void)0)
+#define glEnable(...) ((void)0)
+#define glDisable(...) ((void)0)
+#define glBlendFunc(...) ((void)0)
+#define glLineWidth(...) ((void)0)
+#define glLightfv(...) ((void)0)
+#define glMaterialfv(...) ((void)0)
+#define glMatrixMode(...) ((void)0)
+#define glLoadIdentity(...) ((void)0)
+#define glMultMatrixf(...) ((void)0)
+#define glPushMatrix(...) ((void)0)
+#define glPopMatrix(...) ((void)0)
+#define glTranslatef(...) ((void)0)
+#define glScalef(...) ((void)0)
+#define glOrtho(...) ((void)0)
+#define glViewport(...) ((void)0)
+
+#endif
@@ -0,0 +1,13 @@
+// ====================================================================
+// Headless replacement for <GL/glu.h>, see GL/gl.h.
+// ====================================================================
+
+#ifndef _HEADLESS_GLU_H_
+#define _HEADLESS_GLU_H_
+
+#include "gl.h"
+
+#define gluLookAt(...) ((void)0)
+#define gluPerspective(...) ((void)0)
+
+#endif
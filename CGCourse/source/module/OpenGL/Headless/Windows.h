@@ -0,0 +1,4 @@
+// ====================================================================
+// Headless replacement for <Windows.h>. The ray tracer only includes
+// it because the Windows OpenGL headers need it, so it is empty.
+// ====================================================================
@@ -1,7 +1,9 @@
-#include "film.h"
+#include "Film.h"
 #include "image.h"
 #include "Filter.h"
 #include "math.h"
+#include <stdio.h>
+#include <string.h>
 
 void Film::renderSamples(const char* samples_file, int sample_zoom) {
 
@@ -81,4 +83,114 @@ void Film::renderFilter(const char* filter_file, int filter_zoom, Filter* filter
 
 	// save the image
 	image.SaveTGA(filter_file);
-}
\ No newline at end of file
+}
+
+// Tile file: the magic, the film size and the rectangle as ints, then
+// for every pixel of the rectangle (x major) and every sample of it the
+// position and the color as floats
+static const char TileMagic[8] = { 'F', 'I', 'L', 'M', 'T', 'I', 'L', 'E' };
+
+bool Film::writeTile(FILE* file, int x0, int y0, int x1, int y1) {
+
+	assert(x0 >= 0 && y0 >= 0 && x0 <= x1 && y0 <= y1 && x1 <= width && y1 <= height);
+	int header[7] = { width, height, num_samples, x0, y0, x1, y1 };
+	fwrite(TileMagic, sizeof(TileMagic), 1, file);
+	fwrite(header, sizeof(header), 1, file);
+	for (int i = x0; i < x1; i++) {
+		for (int j = y0; j < y1; j++) {
+			for (int n = 0; n < num_samples; n++) {
+				bool outofBound = false;
+				Sample s = getSample(i, j, n, outofBound);
+				Vec2f p = s.getPosition();
+				Vec3f c = s.getColor();
+				float data[5] = { p.x(), p.y(), c.x(), c.y(), c.z() };
+				fwrite(data, sizeof(data), 1, file);
+			}
+		}
+	}
+	return !ferror(file);
+}
+
+static bool ReadTileHeader(FILE* file, const char* name, int header[7]) {
+
+	char magic[sizeof(TileMagic)];
+	if (fread(magic, sizeof(magic), 1, file) != 1 || memcmp(magic, TileMagic, sizeof(magic)) != 0 ||
+		fread(header, 7 * sizeof(int), 1, file) != 1) {
+		printf("ERROR: %s is not a tile file\n", name);
+		return false;
+	}
+	return true;
+}
+
+bool Film::readTile(FILE* file, const char* name, int& x0, int& y0, int& x1, int& y1) {
+
+	int header[7];
+	if (!ReadTileHeader(file, name, header))
+		return false;
+	if (header[0] != width || header[1] != height || header[2] != num_samples) {
+		printf("ERROR: tile %s is for a %dx%d film with %d samples, not %dx%d with %d\n", name,
+			header[0], header[1], header[2], width, height, num_samples);
+		return false;
+	}
+	x0 = header[3]; y0 = header[4];
+	x1 = header[5]; y1 = header[6];
+	if (x0 < 0 || y0 < 0 || x0 > x1 || y0 > y1 || x1 > width || y1 > height) {
+		printf("ERROR: tile %s has a bad rectangle\n", name);
+		return false;
+	}
+	for (int i = x0; i < x1; i++) {
+		for (int j = y0; j < y1; j++) {
+			for (int n = 0; n < num_samples; n++) {
+				float data[5];
+				if (fread(data, sizeof(data), 1, file) != 1) {
+					printf("ERROR: tile %s is truncated\n", name);
+					return false;
+				}
+				setSample(i, j, n, Vec2f(data[0], data[1]), Vec3f(data[2], data[3], data[4]));
+			}
+		}
+	}
+	return true;
+}
+
+bool Film::saveTile(const char* filename, int x0, int y0, int x1, int y1) {
+
+	FILE* file = fopen(filename, "wb");
+	if (file == NULL) {
+		printf("ERROR: could not write %s\n", filename);
+		return false;
+	}
+	bool ok = writeTile(file, x0, y0, x1, y1);
+	fclose(file);
+	return ok;
+}
+
+bool Film::loadTile(const char* filename, int& x0, int& y0, int& x1, int& y1) {
+
+	FILE* file = fopen(filename, "rb");
+	if (file == NULL) {
+		printf("ERROR: could not open tile %s\n", filename);
+		return false;
+	}
+	bool ok = readTile(file, filename, x0, y0, x1, y1);
+	fclose(file);
+	return ok;
+}
+
+bool Film::ReadTileSize(const char* filename, int& width, int& height, int& num_samples) {
+
+	FILE* file = fopen(filename, "rb");
+	if (file == NULL) {
+		printf("ERROR: could not open tile %s\n", filename);
+		return false;
+	}
+	int header[7];
+	bool ok = ReadTileHeader(file, filename, header);
+	fclose(file);
+	if (!ok)
+		return false;
+	width = header[0];
+	height = header[1];
+	num_samples = header[2];
+	return width > 0 && height > 0 && num_samples > 0;
+}
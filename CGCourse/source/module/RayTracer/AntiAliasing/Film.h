@@ -2,7 +2,8 @@
 #define _FILM_H_
 
 #include <assert.h>
-#include "sample.h"
+#include <stdio.h>
+#include "Sample.h"
 
 class Filter;
 
@@ -46,6 +47,19 @@ public:
     void renderSamples(const char* samples_file, int sample_zoom);
     void renderFilter(const char* filter_file, int filter_zoom, Filter* filter);
 
+    // TILES
+    // A tile file holds the raw samples of the pixels [x0,x1) x [y0,y1).
+    // Filters reach across tile borders, so tiles are merged as samples
+    // and only filtered once the whole film is back together.
+    bool saveTile(const char* filename, int x0, int y0, int x1, int y1);
+    // Fails (and says why) if the tile was made for another film size
+    bool loadTile(const char* filename, int& x0, int& y0, int& x1, int& y1);
+    // The film size a tile file was made for
+    static bool ReadTileSize(const char* filename, int& width, int& height, int& num_samples);
+    // The same tile format inside a larger file, name is for the messages
+    bool writeTile(FILE* file, int x0, int y0, int x1, int y1);
+    bool readTile(FILE* file, const char* name, int& x0, int& y0, int& x1, int& y1);
+
 private:
 
     Film() { assert(0); } // don't use this constructor
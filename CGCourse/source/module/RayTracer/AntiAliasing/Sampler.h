@@ -1,7 +1,39 @@
 #pragma once
 
 #include <vectors.h>
-#include <Random/RandomModule.h>
+
+// Mixes the pixel (i, j) and the sample index n into 32 random bits.
+// The random samplers draw from it instead of a running generator, so a
+// sample does not depend on the order the pixels are rendered in, and a
+// tile of the image renders exactly as it does in the full frame
+inline unsigned HashSample(int i, int j, int n)
+{
+	unsigned h = (unsigned)i * 0x8da6b343u ^ (unsigned)j * 0xd8163841u ^ (unsigned)n * 0xcb1ab31fu;
+	h ^= h >> 16; h *= 0x7feb352du;
+	h ^= h >> 15; h *= 0x846ca68bu;
+	h ^= h >> 16;
+	return h;
+}
+
+// Two numbers in [0,1) for sample n of pixel (i, j)
+inline Vec2f HashSample2f(int i, int j, int n)
+{
+	unsigned a = HashSample(i, j, n);
+	unsigned b = HashSample(i, j, n) * 0x9e3779b9u + 0x7f4a7c15u;
+	b ^= b >> 16; b *= 0x7feb352du; b ^= b >> 15;
+	return Vec2f((a >> 8) * (1.0f / 16777216), (b >> 8) * (1.0f / 16777216));
+}
+
+// Seed of the russian roulette for sample n of pixel (i, j). Salted and
+// mixed again, so it is not the number the sample position came from
+inline unsigned RouletteSeed(int i, int j, int n)
+{
+	unsigned h = HashSample(i, j, n) + 0x2545f491u;
+	h ^= h >> 16; h *= 0x7feb352du;
+	h ^= h >> 15; h *= 0x846ca68bu;
+	h ^= h >> 16;
+	return h;
+}
 
 class Sampler
 {
@@ -9,8 +41,8 @@ public:
 	Sampler(int spp) {}
 	virtual ~Sampler() = default;
 
-	// Returns the 2D offset for the specified sample
-	virtual Vec2f getSamplePosition(int n) = 0;
+	// Returns the 2D offset for sample n of pixel (i, j)
+	virtual Vec2f getSamplePosition(int i, int j, int n) = 0;
 };
 
 class RandomSampler :public Sampler
@@ -19,14 +51,11 @@ public:
 	RandomSampler(int spp) :Sampler(spp) {}
 	virtual ~RandomSampler() = default;
 
-	// Returns the 2D offset for the specified sample
-	virtual Vec2f getSamplePosition(int n) override
+	// Returns the 2D offset for sample n of pixel (i, j)
+	virtual Vec2f getSamplePosition(int i, int j, int n) override
 	{
-		return random.RandVec2f_0101();
+		return HashSample2f(i, j, n);
 	}
-
-private:
-	RandomModule random;
 };
 
 class UniformSampler :public Sampler
@@ -39,13 +68,13 @@ public:
 	}
 	virtual ~UniformSampler() = default;
 
-	// Returns the 2D offset for the specified sample
-	virtual Vec2f getSamplePosition(int n) override
+	// Returns the 2D offset for sample n of pixel (i, j)
+	virtual Vec2f getSamplePosition(int, int, int n) override
 	{
-		int i = n / width;
-		int j = n % width;
+		int x = n / width;
+		int y = n % width;
 
-		return Vec2f(step * (1 + i * 2), step * (1 + j * 2));
+		return Vec2f(step * (1 + x * 2), step * (1 + y * 2));
 	}
 
 private:
@@ -63,19 +92,18 @@ public:
 	}
 	virtual ~JitteredSampler() = default;
 
-	// Returns the 2D offset for the specified sample
-	virtual Vec2f getSamplePosition(int n) override
+	// Returns the 2D offset for sample n of pixel (i, j)
+	virtual Vec2f getSamplePosition(int i, int j, int n) override
 	{
-		int i = n / width;
-		int j = n % width;
+		int x = n / width;
+		int y = n % width;
 
-		Vec2f offset = random.RandVec2f_0101();
+		Vec2f offset = HashSample2f(i, j, n);
 		offset.Scale(step, step);
-		return Vec2f(step * i + offset.x(), step * j + offset.y());
+		return Vec2f(step * x + offset.x(), step * y + offset.y());
 	}
 
 private:
 	int width = 0;
 	float step = 0;
-	RandomModule random;
 };
\ No newline at end of file
@@ -2,12 +2,71 @@
 #define _BOUNDING_BOX_H_
 
 #include "vectors.h"
+#include "ray.h"
 
 #include <assert.h>
+#include <limits>
+
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#define SLAB_SSE
+#include <xmmintrin.h>
+#endif
 
 #define min2(a,b) (((a)<(b))?(a):(b))
 #define max2(a,b) (((a)>(b))?(a):(b))
 
+// ====================================================================
+// ====================================================================
+// Ray - box slab test over the part of the ray between tnear and tfar.
+// On a hit both are narrowed to the part inside [lo, hi].
+// No branches on the data: the near and far planes come from the sign
+// bits of the ray, a zero direction component gives infinite distances
+// (1/-0 is -inf), and the NaN of a ray lying in a slab plane (0 * inf)
+// drops out of the max / min, so such a ray counts as inside that slab.
+
+inline bool IntersectSlabs(const Ray& r, const Vec3f& lo, const Vec3f& hi, float& tnear, float& tfar)
+{
+    const Vec3f& o = r.getOrigin();
+    const Vec3f& inv = r.getInvDirection();
+#ifdef SLAB_SSE
+    // The fourth lane is NaN, so it never wins over tnear / tfar
+    const float nan = std::numeric_limits<float>::quiet_NaN();
+    __m128 vo = _mm_setr_ps(o.x(), o.y(), o.z(), 0);
+    __m128 vinv = _mm_setr_ps(inv.x(), inv.y(), inv.z(), nan);
+    __m128 t0 = _mm_mul_ps(_mm_sub_ps(_mm_setr_ps(lo.x(), lo.y(), lo.z(), 0), vo), vinv);
+    __m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_setr_ps(hi.x(), hi.y(), hi.z(), 0), vo), vinv);
+    // swap the planes where the direction is negative
+    __m128 neg = _mm_cmplt_ps(vinv, _mm_setzero_ps());
+    __m128 tn = _mm_or_ps(_mm_and_ps(neg, t1), _mm_andnot_ps(neg, t0));
+    __m128 tf = _mm_or_ps(_mm_and_ps(neg, t0), _mm_andnot_ps(neg, t1));
+    // _mm_max_ps(a, b) returns b when a is NaN
+    tn = _mm_max_ps(tn, _mm_set1_ps(tnear));
+    tf = _mm_min_ps(tf, _mm_set1_ps(tfar));
+    tn = _mm_max_ps(tn, _mm_shuffle_ps(tn, tn, _MM_SHUFFLE(1, 0, 3, 2)));
+    tn = _mm_max_ps(tn, _mm_shuffle_ps(tn, tn, _MM_SHUFFLE(2, 3, 0, 1)));
+    tf = _mm_min_ps(tf, _mm_shuffle_ps(tf, tf, _MM_SHUFFLE(1, 0, 3, 2)));
+    tf = _mm_min_ps(tf, _mm_shuffle_ps(tf, tf, _MM_SHUFFLE(2, 3, 0, 1)));
+    float n = _mm_cvtss_f32(tn);
+    float f = _mm_cvtss_f32(tf);
+#else
+    const Vec3f* bounds[2] = { &lo, &hi };
+    float n = tnear, f = tfar;
+    for (int a = 0; a < 3; a++)
+    {
+        float t0 = ((*bounds[r.getSign(a)])[a] - o[a]) * inv[a];
+        float t1 = ((*bounds[1 - r.getSign(a)])[a] - o[a]) * inv[a];
+        n = t0 > n ? t0 : n;
+        f = t1 < f ? t1 : f;
+    }
+#endif
+    // a few ulps of slack, so rounding never culls a hit on the box surface
+    if (n > f * 1.0000004f)
+        return false;
+    tnear = n;
+    tfar = f;
+    return true;
+}
+
 // ====================================================================
 // ====================================================================
 
@@ -28,6 +87,9 @@ public:
     }
     Vec3f getMin() const { return min; }
     Vec3f getMax() const { return max; }
+    bool Intersect(const Ray& r, float& tnear, float& tfar) const {
+        return IntersectSlabs(r, min, max, tnear, tfar);
+    }
 
     // MODIFIERS
     void Set(BoundingBox* bb) {
@@ -3,7 +3,7 @@
 #include "../VersionControl.h"
 
 // Included files for OpenGL Rendering
-#include<windows.h>
+#include<Windows.h>
 #include <GL/gl.h>
 #include <OpenGL/ThirdParty/glut.h>
 #include <matrix.h>
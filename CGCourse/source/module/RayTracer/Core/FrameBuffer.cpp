@@ -0,0 +1,265 @@
+#include "FrameBuffer.h"
+
+#include "Object3D.h"
+#include "scene_parser.h"
+#include "RayTracingStas.h"
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+
+FrameBuffer::FrameBuffer(int w, int h, unsigned a)
+    :width(w), height(h), aovs(a), color(nullptr)
+{
+    int n = width * height;
+    if (has(Color)) color = new Image(width, height);
+    if (has(Depth)) depth.resize(n);
+    if (has(Normal)) normals.resize(3 * n);
+    if (has(MaterialID)) materialIDs.resize(n);
+    if (has(PrimitiveID)) primitiveIDs.resize(n);
+    if (has(Cost)) cost.resize(NumCostMetrics * n);
+}
+
+int FrameBuffer::ParseCostMetric(const char* name)
+{
+    static const char* names[NumCostMetrics] = { "time", "rays", "intersections", "cells" };
+    for (int i = 0; i < NumCostMetrics; i++)
+        if (!strcmp(name, names[i]))
+            return i;
+    return -1;
+}
+
+void FrameBuffer::setMaterials(const SceneParser_v6* scene)
+{
+    materialIndex.clear();
+    for (int i = 0; i < scene->getNumMaterials(); i++)
+        materialIndex[scene->getMaterial(i)] = i;
+}
+
+void FrameBuffer::clear(const Vec3f& background)
+{
+    if (color != nullptr) color->SetAllPixels(background);
+    std::fill(depth.begin(), depth.end(), INFINITY);
+    std::fill(normals.begin(), normals.end(), 0);
+    std::fill(materialIDs.begin(), materialIDs.end(), -1);
+    std::fill(primitiveIDs.begin(), primitiveIDs.end(), -1);
+    std::fill(cost.begin(), cost.end(), 0.0f);
+}
+
+void FrameBuffer::setColor(int x, int y, const Vec3f& c)
+{
+    if (color != nullptr) color->SetPixel(x, y, c);
+}
+
+// Maps [-1, 1] to a 16 bit signed normalized integer
+static short PackSnorm(float v)
+{
+    v = (std::max)(-1.0f, (std::min)(1.0f, v));
+    return (short)lrintf(v * 32767.0f);
+}
+
+void FrameBuffer::setHit(int x, int y, const Hit& hit)
+{
+    int i = index(x, y);
+    if (has(Depth))
+        depth[i] = hit.getT();
+    if (has(Normal))
+    {
+        Vec3f n = hit.getNormal();
+        normals[3 * i + 0] = PackSnorm(n.x());
+        normals[3 * i + 1] = PackSnorm(n.y());
+        normals[3 * i + 2] = PackSnorm(n.z());
+    }
+    if (has(MaterialID))
+    {
+        auto found = materialIndex.find(hit.getMaterial());
+        materialIDs[i] = (found == materialIndex.end()) ? -1 : found->second;
+    }
+    if (has(PrimitiveID))
+        primitiveIDs[i] = (hit.getObject() == nullptr) ? -1 : hit.getObject()->getID();
+}
+
+// Reads the counters of every metric, in CostMetric order
+static void ReadCostCounters(double counters[FrameBuffer::NumCostMetrics])
+{
+    counters[FrameBuffer::CostTime] = RayTracingStats::GetSeconds();
+    counters[FrameBuffer::CostRays] = (double)RayTracingStats::GetNumRays();
+    counters[FrameBuffer::CostIntersections] = (double)RayTracingStats::GetNumIntersections();
+    counters[FrameBuffer::CostCells] = (double)RayTracingStats::GetNumGridCellsTraversed();
+}
+
+void FrameBuffer::beginCost()
+{
+    ReadCostCounters(costStart);
+}
+
+void FrameBuffer::endCost(int x, int y)
+{
+    double counters[NumCostMetrics];
+    ReadCostCounters(counters);
+    float* c = &cost[NumCostMetrics * index(x, y)];
+    for (int m = 0; m < NumCostMetrics; m++)
+        c[m] += (float)(counters[m] - costStart[m]);
+}
+
+Vec3f FrameBuffer::getNormal(int x, int y) const
+{
+    const short* n = &normals[3 * index(x, y)];
+    return Vec3f(n[0] / 32767.0f, n[1] / 32767.0f, n[2] / 32767.0f);
+}
+
+void FrameBuffer::saveDepth(const char* filename, float depthMin, float depthMax) const
+{
+    bool raw = Image::IsFloatFormat(filename);
+    float rerange = 1.0f / (depthMax - depthMin);
+    Image img(width, height);
+    for (int y = 0; y < height; y++)
+        for (int x = 0; x < width; x++)
+        {
+            float t = depth[index(x, y)];
+            if (!raw)
+            {
+                if (t == INFINITY)
+                    t = 0;
+                else
+                    t = 1 - (std::min)(1.0f, (t - depthMin) * rerange);
+            }
+            img.SetPixel(x, y, Vec3f(t, t, t));
+        }
+    img.Save(filename);
+}
+
+void FrameBuffer::saveNormal(const char* filename) const
+{
+    bool raw = Image::IsFloatFormat(filename);
+    Image img(width, height);
+    for (int y = 0; y < height; y++)
+        for (int x = 0; x < width; x++)
+        {
+            Vec3f n = getNormal(x, y);
+            if (!raw)
+                n.Set(fabsf(n.x()), fabsf(n.y()), fabsf(n.z()));
+            img.SetPixel(x, y, n);
+        }
+    img.Save(filename);
+}
+
+void FrameBuffer::saveMaterialIDs(const char* filename) const
+{
+    saveIDs(filename, materialIDs);
+}
+
+void FrameBuffer::savePrimitiveIDs(const char* filename) const
+{
+    saveIDs(filename, primitiveIDs);
+}
+
+void FrameBuffer::saveIDs(const char* filename, const std::vector<int>& ids) const
+{
+    bool raw = Image::IsFloatFormat(filename);
+    Image img(width, height);
+    for (int y = 0; y < height; y++)
+        for (int x = 0; x < width; x++)
+        {
+            int id = ids[index(x, y)];
+            if (raw)
+            {
+                img.SetPixel(x, y, Vec3f(id, id, id));
+                continue;
+            }
+            if (id < 0)
+            {
+                img.SetPixel(x, y, Vec3f(0, 0, 0));
+                continue;
+            }
+            // Hash the id so neighbouring ids get unrelated colors
+            unsigned int h = (unsigned int)id * 2654435761u;
+            h ^= h >> 15;
+            img.SetPixel(x, y, Vec3f(
+                0.2f + 0.8f * ((h >> 0) & 0xff) / 255.0f,
+                0.2f + 0.8f * ((h >> 8) & 0xff) / 255.0f,
+                0.2f + 0.8f * ((h >> 16) & 0xff) / 255.0f));
+        }
+    img.Save(filename);
+}
+
+// Blue - cyan - green - yellow - red for t from 0 to 1
+static Vec3f HeatColor(float t)
+{
+    static const Vec3f stops[5] = {
+        Vec3f(0, 0, 1), Vec3f(0, 1, 1), Vec3f(0, 1, 0), Vec3f(1, 1, 0), Vec3f(1, 0, 0) };
+    t = (std::max)(0.0f, (std::min)(1.0f, t)) * 4;
+    int i = (std::min)((int)t, 3);
+    float f = t - i;
+    return (1 - f) * stops[i] + f * stops[i + 1];
+}
+
+void FrameBuffer::saveCost(const char* filename, CostMetric metric) const
+{
+    bool raw = Image::IsFloatFormat(filename);
+    float maxCost = 0;
+    for (int i = 0; i < width * height; i++)
+        maxCost = (std::max)(maxCost, cost[NumCostMetrics * i + metric]);
+    float scale = (maxCost > 0) ? 1 / maxCost : 0;
+
+    Image img(width, height);
+    for (int y = 0; y < height; y++)
+        for (int x = 0; x < width; x++)
+        {
+            float c = cost[NumCostMetrics * index(x, y) + metric];
+            img.SetPixel(x, y, raw ? Vec3f(c, c, c) : HeatColor(c * scale));
+        }
+    img.Save(filename);
+    if (!raw)
+        printf("cost map %s: red is %g per pixel\n", filename, maxCost);
+}
+
+// Raw elements of an AOV array, nothing for an AOV that is not selected
+template <class T>
+static void WriteArray(FILE* file, const std::vector<T>& v)
+{
+    if (!v.empty())
+        fwrite(v.data(), sizeof(T), v.size(), file);
+}
+
+template <class T>
+static bool ReadArray(FILE* file, std::vector<T>& v)
+{
+    return v.empty() || fread(v.data(), sizeof(T), v.size(), file) == v.size();
+}
+
+bool FrameBuffer::write(FILE* file) const
+{
+    int header[3] = { width, height, (int)aovs };
+    fwrite(header, sizeof(header), 1, file);
+    if (color != nullptr)
+        for (int y = 0; y < height; y++)
+            for (int x = 0; x < width; x++)
+                fwrite(&color->GetPixel(x, y), sizeof(Vec3f), 1, file);
+    WriteArray(file, depth);
+    WriteArray(file, normals);
+    WriteArray(file, materialIDs);
+    WriteArray(file, primitiveIDs);
+    WriteArray(file, cost);
+    return !ferror(file);
+}
+
+bool FrameBuffer::read(FILE* file)
+{
+    int header[3];
+    if (fread(header, sizeof(header), 1, file) != 1 ||
+        header[0] != width || header[1] != height || header[2] != (int)aovs)
+        return false;
+    if (color != nullptr)
+        for (int y = 0; y < height; y++)
+            for (int x = 0; x < width; x++)
+            {
+                Vec3f c;
+                if (fread(&c, sizeof(Vec3f), 1, file) != 1)
+                    return false;
+                color->SetPixel(x, y, c);
+            }
+    return ReadArray(file, depth) && ReadArray(file, normals) &&
+        ReadArray(file, materialIDs) && ReadArray(file, primitiveIDs) &&
+        ReadArray(file, cost);
+}
@@ -0,0 +1,103 @@
+#pragma once
+#include <LinearAlgebra/vectors.h>
+#include <RayTracer/VersionControl.h>
+#include <RayTracer/Core/hit.h>
+#include <Image/image.h>
+#include <stdio.h>
+#include <unordered_map>
+#include <vector>
+
+class SceneParser_v6;
+
+// The images one trace pass can write besides the color: the distance
+// and normal of the primary hit, and the ids of its material and primitive.
+// Only the selected AOVs get storage, each in its own compact array:
+// depth as a float, the normal as three 16 bit snorms and the ids as ints.
+class FrameBuffer
+{
+public:
+	enum AOV
+	{
+		Color = 1 << 0,
+		Depth = 1 << 1,
+		Normal = 1 << 2,
+		MaterialID = 1 << 3,
+		PrimitiveID = 1 << 4,
+		Cost = 1 << 5,
+	};
+
+	// What the cost AOV measures per pixel
+	enum CostMetric
+	{
+		CostTime,           // seconds
+		CostRays,           // rays of any kind
+		CostIntersections,  // ray - primitive tests
+		CostCells,          // grid cells traversed
+		NumCostMetrics,
+	};
+	// "time", "rays", "intersections" or "cells", -1 for anything else
+	static int ParseCostMetric(const char* name);
+
+	FrameBuffer(int w, int h, unsigned aovs);
+	~FrameBuffer() { delete color; }
+
+	int getWidth() const { return width; }
+	int getHeight() const { return height; }
+	bool has(AOV aov) const { return (aovs & aov) != 0; }
+
+	// Material ids are the indices of the materials in the scene file
+	void setMaterials(const SceneParser_v6* scene);
+
+	// Background values: the color, infinite depth, a zero normal, id -1
+	void clear(const Vec3f& background);
+
+	// Records the primary hit of pixel (x, y) in every selected AOV
+	void setColor(int x, int y, const Vec3f& color);
+	void setHit(int x, int y, const Hit& hit);
+
+	// The work RayTracingStats counts between beginCost() and
+	// endCost(x, y) is added to the cost of pixel (x, y)
+	void beginCost();
+	void endCost(int x, int y);
+
+	// NULL unless Color is selected
+	Image* getColor() { return color; }
+	float getDepth(int x, int y) const { return depth[index(x, y)]; }
+	Vec3f getNormal(int x, int y) const;
+	int getMaterialID(int x, int y) const { return materialIDs[index(x, y)]; }
+	int getPrimitiveID(int x, int y) const { return primitiveIDs[index(x, y)]; }
+
+	// Float formats (.pfm, .exr) get the raw values. Others get the
+	// course visualizations: 1 - (t - min) / (max - min) for depth,
+	// the absolute normal, and a color per id (black for no hit).
+	void saveDepth(const char* filename, float depthMin, float depthMax) const;
+	void saveNormal(const char* filename) const;
+	void saveMaterialIDs(const char* filename) const;
+	void savePrimitiveIDs(const char* filename) const;
+	// The visualization is a heat map scaled to the most expensive pixel
+	void saveCost(const char* filename, CostMetric metric) const;
+
+	// Raw dump of every selected AOV, for checkpoints. read fails if the
+	// file was written by a frame buffer of another size or AOV set
+	bool write(FILE* file) const;
+	bool read(FILE* file);
+
+private:
+	FrameBuffer(const FrameBuffer&) = delete;
+	FrameBuffer& operator=(const FrameBuffer&) = delete;
+	int index(int x, int y) const { return y * width + x; }
+	void saveIDs(const char* filename, const std::vector<int>& ids) const;
+
+	int width;
+	int height;
+	unsigned aovs;
+
+	Image* color;
+	std::vector<float> depth;
+	std::vector<short> normals;
+	std::vector<int> materialIDs;
+	std::vector<int> primitiveIDs;
+	std::vector<float> cost;  // NumCostMetrics per pixel
+	double costStart[NumCostMetrics];
+	std::unordered_map<const Material*, int> materialIndex;
+};
@@ -10,19 +10,49 @@ class Grid;
 class Object3D
 {
 public:
-	virtual ~Object3D()
-	{
-		if (boundingBox != nullptr)
-			delete boundingBox;
-	}
+	Object3D() : id(NextID()) {}
+	virtual ~Object3D() {}
 	virtual bool intersect(const Ray& r, Hit& h, float tmin) = 0;
 	virtual void paint(void) = 0;
 	Material* mat;
 
-	BoundingBox* getBoundingBox() { return boundingBox; }
-	void setBoundingBox(BoundingBox* bb) { boundingBox = new BoundingBox(*bb); }
+	// NULL for unbounded objects (planes)
+	BoundingBox* getBoundingBox() { return bounded ? &boundingBox : nullptr; }
+	void setBoundingBox(BoundingBox* bb) { setBoundingBox(bb->getMin(), bb->getMax()); }
+	void setBoundingBox(const Vec3f& min, const Vec3f& max)
+	{
+		boundingBox.Set(min, max);
+		bounded = true;
+	}
 	virtual void insertIntoGrid(Grid* g, Matrix* m) {}
+	// Moves the primitive into the space of m. Returns false for objects
+	// that can't be baked (or not with this matrix), they stay as they are.
+	virtual bool bakeTransform(const Matrix& /*m*/) { return false; }
+	// Normal at a point of a recorded hit (see Hit::record), in the
+	// space of the object. u, v are what the intersection recorded.
+	virtual Vec3f getHitNormal(const Vec3f& /*point*/, float /*u*/, float /*v*/) const { return Vec3f(0, 0, 0); }
+
+	// Unique per object of a scene, in creation order (so in scene file
+	// order). Every parse of a scene file starts again from 0.
+	int getID() const { return id; }
+	// An object reused by a reload takes the id of the one it replaces
+	void setID(int i) { id = i; }
+	static void RestartIDs() { Counter() = 0; }
+
+	// Set on objects placed several times in the scene (a mesh file
+	// loaded once and used by several transforms). The grid builds one
+	// local grid for them and only references it from every placement.
+	bool isShared() const { return shared; }
+	void setShared(bool s) { shared = s; }
 
 protected:
-	BoundingBox* boundingBox = nullptr;
+	// Stored in the object, valid when bounded is set
+	BoundingBox boundingBox = BoundingBox(Vec3f(0, 0, 0), Vec3f(0, 0, 0));
+	bool bounded = false;
+	bool shared = false;
+
+private:
+	static int& Counter() { static int next = 0; return next; }
+	static int NextID() { return Counter()++; }
+	int id;
 };
\ No newline at end of file
@@ -4,28 +4,117 @@
 #include <RayTracer/Primitives/Group.h>
 #include <RayTracer/Core/light.h>
 #include <RayTracer/Core/RayTree.h>
+#include <RayTracer/Primitives/Transform.h>
 #include <limits>
+#include <random>
+#include <vector>
 
 static Vec3f black(0, 0, 0);
 static Vec3f invalid(-1, -1, -1);
 static Material* black_mat = new PhongMaterial(black, black, 0, black, black, 1);
 
+// The primitive that last blocked a shadow ray towards each light.
+// Neighbouring shadow rays are usually blocked by the same primitive,
+// so it is tested before the full traversal. Kept per thread, and
+// dropped when the thread starts tracing another scene.
+struct ShadowOccluder
+{
+    Object3D* object = nullptr;
+    const GridInstance* instance = nullptr;
+};
+static thread_local const SceneParser_v6* occluderScene = nullptr;
+static thread_local std::vector<ShadowOccluder> lastOccluders;
+
 bool visualize_grid = false;
 int gridx = 0, gridy = 0, gridz = 0;
 bool grid = false;
+bool russian_roulette = false;
+
+// Fixed seed, so a render with roulette is reproducible
+static thread_local std::minstd_rand rouletteEngine(5489u);
 
 RayTracer::RayTracer(SceneParser_v6* s, int max_bounces, float cutoff_weight, bool shadows)
     :pSceneParser(s), mUseShadow(shadows), mMaxBounce(max_bounces), mCutoffweight(cutoff_weight)
 {
-    mShadeback = true;
-
     if (grid)
+        buildGrid();
+    selectTrace();
+}
+
+bool RayTracer::Reload(SceneParser_v6* s, const std::vector<int>& owners)
+{
+    pSceneParser = s;
+    Group* group = s->getGroup();
+    std::vector<bool> inserted(group->getNumObjects(), true);
+    bool kept = false;
+    for (int owner : owners)
+    {
+        if (owner >= 0)
+        {
+            inserted[owner] = false;
+            kept = true;
+        }
+    }
+
+    // The cells can't move, only a scene still inside them keeps the
+    // grid. One that shrank by more than a cell gets a tighter grid.
+    BoundingBox* bb = group->getBoundingBox();
+    bool keep = ScopeGrid != nullptr && kept && bb != nullptr;
+    if (keep)
     {
-        ScopeGrid = std::make_unique<Grid>(pSceneParser->getGroup()->getBoundingBox(), gridx, gridy, gridz);
-        ScopeGrid->setBoundingBox(pSceneParser->getGroup()->getBoundingBox());
-        pSceneParser->getGroup()->insertIntoGrid(ScopeGrid.get(), nullptr);
+        Vec3f cell = 2.0f * ScopeGrid->GetVoxelSizeHalf();
+        const BoundingBox* cells = ScopeGrid->getBoundingBox();
+        for (int a = 0; a < 3 && keep; a++)
+        {
+            float below = bb->getMin()[a] - cells->getMin()[a];
+            float above = cells->getMax()[a] - bb->getMax()[a];
+            keep = below >= 0 && above >= 0 && below <= cell[a] && above <= cell[a];
+        }
+    }
+
+    if (keep)
+    {
+        ScopeGrid->Reassign(owners);
+        ScopeGrid->InsertObjects(group, &inserted);
+        ScopeGrid->BatchSpheres();
+        ScopeGrid->Pack();
         pSceneParser->grid = ScopeGrid.get();
     }
+    else if (ScopeGrid != nullptr)
+    {
+        ScopeGrid.reset();
+        buildGrid();
+    }
+    selectTrace();
+    return keep;
+}
+
+void RayTracer::buildGrid()
+{
+    ScopeGrid = std::make_unique<Grid>(*pSceneParser->getGroup()->getBoundingBox(), gridx, gridy, gridz);
+    ScopeGrid->InsertObjects(pSceneParser->getGroup());
+    ScopeGrid->BatchSpheres();
+    ScopeGrid->Pack();
+    pSceneParser->grid = ScopeGrid.get();
+}
+
+void RayTracer::selectTrace()
+{
+    // Secondary rays are only traced for the kinds of material the
+    // scene has
+    bool reflections = false, refractions = false;
+    for (int i = 0; i < pSceneParser->getNumMaterials() && mMaxBounce >= 1; i++)
+    {
+        reflections = reflections || pSceneParser->getMaterial(i)->getReflectiveColor() != Vec3f();
+        refractions = refractions || pSceneParser->getMaterial(i)->getTransparentColor() != Vec3f();
+    }
+
+    if (visualize_grid && pSceneParser->grid != nullptr)
+        mTrace = &RayTracer::trace<Grid, true, false, false, false>;
+    else if (pSceneParser->grid != nullptr)
+        mTrace = selectKernel<Grid>(mUseShadow, reflections, refractions);
+    else
+        mTrace = selectKernel<Group>(mUseShadow, reflections, refractions);
 }
 
 void Reflect(Vec3f& in, Vec3f& norm, Vec3f& out)
@@ -35,296 +124,297 @@ void Reflect(Vec3f& in, Vec3f& norm, Vec3f& out)
     out.Normalize();
 }
 
-void Refract(Vec3f& in, Vec3f& norm, Vec3f& out, float eta)
+bool Refract(Vec3f& in, Vec3f& norm, Vec3f& out, float eta)
 {
     float NdotI = norm.Dot3(in);
     float k = 1 - eta * eta * (1.0 - NdotI * NdotI);
     if (k < 0)
+    {
         out = Vec3f();
-    else
-        out = in * eta - (eta * NdotI + sqrt(k)) * norm;
+        return false;
+    }
+    out = in * eta - (eta * NdotI + sqrt(k)) * norm;
     out.Normalize();
+    return true;
+}
+
+void SeedRoulette(unsigned seed)
+{
+    rouletteEngine.seed(seed);
+}
+
+bool ContinueRay(const Vec3f& weight, float cutoff, float& scale)
+{
+    scale = 1;
+    float length = weight.Length();
+    if (length > cutoff)
+        return true;
+
+    if (russian_roulette && length > 0)
+    {
+        float survive = length / cutoff;
+        std::uniform_real_distribution<float> uniform(0, 1);
+        if (uniform(rouletteEngine) < survive)
+        {
+            RayTracingStats::IncrementNumRouletteRays();
+            scale = 1 / survive;
+            return true;
+        }
+    }
+    RayTracingStats::IncrementNumPrunedRays();
+    return false;
+}
+
+// The scene's acceleration structures, called without the vtable
+static inline bool Intersect(Grid* grid, const Ray& ray, Hit& hit, float tmin)
+{
+    return grid->Grid::intersect(ray, hit, tmin);
+}
+
+static inline bool Intersect(Group* group, const Ray& ray, Hit& hit, float tmin)
+{
+    return group->Group::intersect(ray, hit, tmin);
+}
+
+static inline bool IntersectVisualize(Grid* grid, const Ray& ray, Hit& hit, float tmin)
+{
+    return grid->intersectVisualize(ray, hit, tmin);
+}
+
+static inline bool IntersectVisualize(Group*, const Ray&, Hit&, float)
+{
+    return false;
 }
 
+static inline const GridInstance* InstanceOf(Grid* grid, const Matrix* m)
+{
+    return grid->GetInstance(m);
+}
+
+static inline const GridInstance* InstanceOf(Group*, const Matrix*)
+{
+    return nullptr;
+}
+
+static inline void GetAccel(SceneParser_v6* scene, Grid*& grid) { grid = scene->grid; }
+static inline void GetAccel(SceneParser_v6* scene, Group*& group) { group = scene->getGroup(); }
+
 Vec3f RayTracer::traceRay(Ray& ray, float tmin, int bounces, float weight,
 		float indexOfRefraction, Hit& hit) const
 {
-    RayTracingStats::IncrementNumNonShadowRays();
-    bool intersected = false;
+    return (this->*mTrace)(ray, tmin, 0, RayType::Primary, Vec3f(1, 1, 1), hit);
+}
 
-    if (visualize_grid)
+template <class Accel>
+RayTracer::TraceKernel RayTracer::selectKernel(bool shadows, bool reflections, bool refractions)
+{
+    static const TraceKernel kernels[8] =
     {
-        bool intersected = pSceneParser->grid->intersectVisualize(ray, hit, tmin);
-        if (intersected)
-        {
-            Vec3f radiance(0, 0, 0);
-            Vec3f albedo = hit.getMaterial()->getDiffuseColor();
-            Vec3f::Mult(radiance, albedo, pSceneParser->getAmbientLight());
-            Vec3f position = hit.getIntersectionPoint();
+        &RayTracer::trace<Accel, false, false, false, false>,
+        &RayTracer::trace<Accel, false, false, false, true>,
+        &RayTracer::trace<Accel, false, false, true, false>,
+        &RayTracer::trace<Accel, false, false, true, true>,
+        &RayTracer::trace<Accel, false, true, false, false>,
+        &RayTracer::trace<Accel, false, true, false, true>,
+        &RayTracer::trace<Accel, false, true, true, false>,
+        &RayTracer::trace<Accel, false, true, true, true>,
+    };
+    return kernels[shadows * 4 + reflections * 2 + refractions];
+}
 
-            for (int k = 0; k < pSceneParser->getNumLights(); k++)
-            {
-                Light* light = pSceneParser->getLight(k);
-
-                bool inShadow = false;
-                //if (mUseShadow)
-                //{
-                //    Vec3f hitPos = hit.getIntersectionPoint();
-                //    Vec3f normal = hit.getNormal();
-                //    hitPos += 0.001 * normal;
-                //    inShadow = shadowRay(hitPos, light);
-                //}
-
-                Vec3f dir, col;
-                light->getIllumination(position, dir, col);
-                Vec3f outrad = hit.getMaterial()->Shade(ray, hit, dir, col);
-
-                if (!inShadow)
-                    radiance += outrad;
-            }
+template <class Accel, bool Visualize, bool Shadows, bool Reflections, bool Refractions>
+Vec3f RayTracer::trace(Ray& ray, float tmin, int bounces, RayType type, const Vec3f& weight, Hit& hit) const
+{
+    RayTracingStats::IncrementNumNonShadowRays();
 
-            return radiance;
-        }
-        return pSceneParser->getBackgroundColor();
-    }
-    else if (pSceneParser->grid != nullptr)
+    Accel* accel;
+    GetAccel(pSceneParser, accel);
+    bool intersected = Visualize ? IntersectVisualize(accel, ray, hit, tmin) : Intersect(accel, ray, hit, tmin);
+    if (intersected)
+        hit.finalize(ray);
+
+    switch (type)
     {
-        intersected = pSceneParser->grid->intersect(ray, hit, tmin);
+    case RayType::Primary:
+        // the visualization adds its own segment
+        if (!Visualize)
+            RayTree::SetMainSegment(ray, 0, hit.getT());
+        break;
+    case RayType::Reflect:
+        RayTree::AddReflectedSegment(ray, 0, hit.getT());
+        break;
+    case RayType::Refract:
+        RayTree::AddTransmittedSegment(ray, 0, hit.getT());
+        break;
     }
-    else
+
+    if (!intersected)
     {
-        Group* group = pSceneParser->getGroup();
-        intersected = group->intersect(ray, hit, tmin);
+        // A primary miss is left to the caller, a refracted ray that
+        // leaves the scene adds nothing
+        if (type == RayType::Primary)
+            return Visualize ? pSceneParser->getBackgroundColor() : invalid;
+        return (type == RayType::Reflect) ? pSceneParser->getBackgroundColor() : black;
     }
 
-    RayTree::SetMainSegment(ray, 0, hit.getT());
+    // Shading
+    Material* material = hit.getMaterial();
+    Vec3f radiance(0, 0, 0);
+    Vec3f albedo = material->getDiffuseColor();
+    Vec3f::Mult(radiance, albedo, pSceneParser->getAmbientLight());
+    Vec3f position = hit.getIntersectionPoint();
+    Vec3f normal = hit.getNormal();
 
-    if (intersected)
+    for (int k = 0; k < pSceneParser->getNumLights(); k++)
     {
-        // Shading
-        Vec3f radiance(0, 0, 0);
-        Vec3f albedo = hit.getMaterial()->getDiffuseColor();
-        Vec3f::Mult(radiance, albedo, pSceneParser->getAmbientLight());
-        Vec3f position = hit.getIntersectionPoint();
-        Vec3f normal = hit.getNormal();
-
-        if (!mShadeback && normal.Dot3(ray.getDirection()) > 0)
+        Light* light = pSceneParser->getLight(k);
+
+        bool inShadow = false;
+        if (Shadows)
         {
-            return black;
+            Vec3f hitPos = hit.getIntersectionPoint();
+            hitPos += 0.001 * normal;
+            inShadow = shadowRay<Accel>(hitPos, light, k);
         }
-        //return hit.getMaterial()->getDiffuseColor();
-        for (int k = 0; k < pSceneParser->getNumLights(); k++)
-        {
-            Light* light = pSceneParser->getLight(k);
-
-            bool inShadow = false;
-            if (mUseShadow)
-            {
-                Vec3f hitPos = hit.getIntersectionPoint();
-                Vec3f normal = hit.getNormal();
-                hitPos += 0.001 * normal;
-                inShadow = shadowRay(hitPos, light);
-            }
 
+        if (!inShadow)
+        {
             Vec3f dir, col;
             light->getIllumination(position, dir, col);
-            Vec3f outrad = hit.getMaterial()->Shade(ray, hit, dir, col);
-
-            if (!inShadow)
-                radiance += outrad;
+            radiance += material->Shade(ray, hit, dir, col);
         }
+    }
 
-        Vec3f refectiveColor = hit.getMaterial()->getReflectiveColor();
-        if (refectiveColor != Vec3f())
+    // Secondary rays start off the side the ray came from. Primary rays
+    // have always used the normal as it is, whichever side they hit.
+    Vec3f sideNormal = (type != RayType::Primary && normal.Dot3(ray.getDirection()) > 0) ? -1 * normal : normal;
+
+    // Decide on the subtrees before tracing them: past the last
+    // bounce or below the cutoff weight they are not spawned at all
+    float scale;
+    if (Reflections && bounces < mMaxBounce)
+    {
+        Vec3f reflectiveColor = material->getReflectiveColor();
+        if (reflectiveColor != Vec3f() && ContinueRay(weight * reflectiveColor, mCutoffweight, scale))
         {
-            //Ray()
             Vec3f inRay = ray.getDirection();
-            Vec3f nor = hit.getNormal();
             Vec3f outRay;
             Reflect(inRay, normal, outRay);
-            Ray reflectRay(hit.getIntersectionPoint() + 0.001 * hit.getNormal(), outRay);
-            radiance += refectiveColor * iteratorRay(reflectRay, 1, tmin, RayType::Reflect, refectiveColor);
+            Ray reflectRay(hit.getIntersectionPoint() + 0.001 * sideNormal, outRay);
+            Hit reflectHit(999999, black_mat, Vec3f(0, 0, 0));
+            radiance += scale * reflectiveColor * trace<Accel, Visualize, Shadows, Reflections, Refractions>(
+                reflectRay, tmin, bounces + 1, RayType::Reflect, scale * weight * reflectiveColor, reflectHit);
         }
+    }
 
-        Vec3f transparentColor = hit.getMaterial()->getTransparentColor();
+    if (Refractions && bounces < mMaxBounce)
+    {
+        Vec3f transparentColor = material->getTransparentColor();
         if (transparentColor != Vec3f())
         {
-            //Ray()
             Vec3f inRay = ray.getDirection();
-            Vec3f nor = hit.getNormal();
             Vec3f outRay;
+            bool refracted;
             // Ray is getting out of the material
-            if (nor.Dot3(ray.getDirection()) >= 0)
+            if (normal.Dot3(ray.getDirection()) >= 0)
+                refracted = Refract(inRay, sideNormal, outRay, material->getIndexOfRefraction());
+            else
+                refracted = Refract(inRay, sideNormal, outRay, 1.0f / material->getIndexOfRefraction());
+
+            if (!refracted)
             {
-                Refract(inRay, nor, outRay, hit.getMaterial()->getIndexOfRefraction());
+                RayTracingStats::IncrementNumTotalInternalReflections();
             }
-            else
+            else if (ContinueRay(weight * transparentColor, mCutoffweight, scale))
             {
-                Refract(inRay, nor, outRay, 1.0f / hit.getMaterial()->getIndexOfRefraction());
+                Ray refractRay(hit.getIntersectionPoint() - 0.001 * sideNormal, outRay);
+                Hit refractHit(999999, black_mat, Vec3f(0, 0, 0));
+                radiance += scale * transparentColor * trace<Accel, Visualize, Shadows, Reflections, Refractions>(
+                    refractRay, tmin, bounces + 1, RayType::Refract, scale * weight * transparentColor, refractHit);
             }
-            Ray refractRay(hit.getIntersectionPoint() - 0.001 * hit.getNormal(), outRay);
-            radiance += transparentColor * iteratorRay(refractRay, 1, tmin, RayType::Refract, transparentColor);
         }
-
-        return radiance;
     }
 
-	return invalid;
+    return radiance;
 }
 
-bool RayTracer::shadowRay(Vec3f& position, Light* light) const
+bool RayTracer::shadowRayCached(const Ray& ray, float distance, int lightIndex) const
 {
-    RayTracingStats::IncrementNumShadowRays();
+    if (occluderScene != pSceneParser)
+    {
+        occluderScene = pSceneParser;
+        lastOccluders.clear();
+    }
+    if ((int)lastOccluders.size() <= lightIndex)
+        lastOccluders.resize(pSceneParser->getNumLights());
 
-    Hit hit(999999, black_mat, Vec3f(0, 0, 0));
-    float distance;
-    Vec3f direction, color;
-    light->getIllumination(position, direction, color, distance);
-    Ray ray(position, direction);
+    ShadowOccluder& occluder = lastOccluders[lightIndex];
+    if (occluder.object == nullptr)
+        return false;
+
+    RayTracingStats::IncrementNumShadowCacheTests();
+
+    // Only a hit closer than the light counts, so start the hit there
+    Hit hit(distance, black_mat, Vec3f(0, 0, 0));
     float tmin = 0.0001;
-    bool intersected = false;
-    if (pSceneParser->grid != nullptr)
+    if (occluder.instance != nullptr)
     {
-        intersected = pSceneParser->grid->intersect(ray, hit, tmin);
+        Transform::IntersectTransformed(occluder.object, occluder.instance->inverse,
+            occluder.instance->invTranspose, ray, hit, tmin);
     }
     else
     {
-        Group* group = pSceneParser->getGroup();
-        intersected = group->intersect(ray, hit, tmin);
+        occluder.object->intersect(ray, hit, tmin);
     }
 
-    if (intersected && hit.getT() > distance)
+    if (hit.getT() < distance)
     {
-        intersected = false;
-        RayTree::AddShadowSegment(ray, 0, hit.getT() + 0.1);
-    }
-    else
-    {
-        RayTree::AddShadowSegment(ray, 0, distance + 0.1);
-
+        RayTracingStats::IncrementNumShadowCacheHits();
+        return true;
     }
-    //float distance = hit.getT();
-    return intersected;
+    return false;
 }
 
-Vec3f RayTracer::iteratorRay(Ray& ray, int bounces, float tmin, RayType type, Vec3f weight) const
+template <class Accel>
+bool RayTracer::shadowRay(Vec3f& position, Light* light, int lightIndex) const
 {
-    RayTracingStats::IncrementNumNonShadowRays();
-
-    Vec3f radiance(0, 0, 0);
-
-    // If reach max iteration
-    if (bounces > mMaxBounce)
-        return radiance;
+    RayTracingStats::IncrementNumShadowRays();
 
-    // Else, calc the radiance
     Hit hit(999999, black_mat, Vec3f(0, 0, 0));
-    bool intersected = false;
-    if (pSceneParser->grid != nullptr)
-    {
-        intersected = pSceneParser->grid->intersect(ray, hit, tmin);
-    }
-    else
-    {
-        Group* group = pSceneParser->getGroup();
-        intersected = group->intersect(ray, hit, tmin);
-    }
+    float distance;
+    Vec3f direction, color;
+    light->getIllumination(position, direction, color, distance);
+    Ray ray(position, direction);
+    float tmin = 0.0001;
 
-    switch (type)
+    // Try the occluder that blocked the previous ray towards this light
+    if (shadowRayCached(ray, distance, lightIndex))
     {
-    case RayTracer::RayType::Reflect:
-        RayTree::AddReflectedSegment(ray, 0, hit.getT());
-        break;
-    case RayTracer::RayType::Refract:
-        RayTree::AddTransmittedSegment(ray, 0, hit.getT());
-        break;
-    default:
-        break;
+        RayTree::AddShadowSegment(ray, 0, distance + 0.1);
+        return true;
     }
-    if (intersected)
-    {
-        // Shading
-        Vec3f albedo = hit.getMaterial()->getDiffuseColor();
-        Vec3f::Mult(radiance, albedo, pSceneParser->getAmbientLight());
-        Vec3f position = hit.getIntersectionPoint();
-        Vec3f normal = hit.getNormal();
-        Vec3f hitNormal = (normal.Dot3(ray.getDirection()) > 0) ? -1 * normal : normal;
-
-        if (!mShadeback && normal.Dot3(ray.getDirection()) > 0)
-        {
-            return black;
-        }
-        
-        //if (mShadeback && normal.Dot3(ray.getDirection()) < 0)
-        {
-            for (int k = 0; k < pSceneParser->getNumLights(); k++)
-            {
-                Light* light = pSceneParser->getLight(k);
-
-                bool inShadow = false;
-                if (mUseShadow)
-                {
-                    Vec3f hitPos = hit.getIntersectionPoint();
-                    hitPos += 0.001 * normal;
-                    inShadow = shadowRay(hitPos, light);
-                }
-
-                Vec3f dir, col;
-                light->getIllumination(position, dir, col);
-                Vec3f outrad = hit.getMaterial()->Shade(ray, hit, dir, col);
-
-                if (!inShadow)
-                    radiance += outrad;
-            }
-
-        }
-
-        Vec3f refectiveColor = hit.getMaterial()->getReflectiveColor();
-        if (refectiveColor != Vec3f())
-        {
-            //Ray()
-            Vec3f inRay = ray.getDirection();
-            Vec3f nor = hitNormal;
-            Vec3f outRay;
-            Reflect(inRay, normal, outRay);
-            Ray reflectRay(hit.getIntersectionPoint() + 0.001 * hitNormal, outRay);
-            Vec3f iterRes = refectiveColor * iteratorRay(reflectRay, bounces + 1, tmin, RayType::Reflect, weight * refectiveColor);
-            if ((weight).Length() > mCutoffweight)
-                radiance += iterRes;
-
-        }
 
-        Vec3f transparentColor = hit.getMaterial()->getTransparentColor();
-        if (transparentColor != Vec3f())
-        {
-            //Ray()
-            Vec3f inRay = ray.getDirection();
-            Vec3f nor = hit.getNormal();
-            Vec3f outRay;
-            // Ray is getting out of the material
-            if (nor.Dot3(ray.getDirection()) >= 0)
-            {
-                Refract(inRay, hitNormal, outRay, hit.getMaterial()->getIndexOfRefraction());
-            }
-            else
-            {
-                Refract(inRay, hitNormal, outRay, 1.0f / hit.getMaterial()->getIndexOfRefraction());
-            }
-            Ray refractRay(hit.getIntersectionPoint() - 0.001 * hitNormal, outRay);
-            Vec3f iterRes = transparentColor * iteratorRay(refractRay, bounces + 1, tmin, RayType::Refract, weight * transparentColor);
-            if ((weight).Length() > mCutoffweight)
-                radiance += iterRes;
-        }
+    Accel* accel;
+    GetAccel(pSceneParser, accel);
+    bool intersected = Intersect(accel, ray, hit, tmin);
 
-        return radiance;
+    if (intersected && hit.getT() > distance)
+    {
+        intersected = false;
+        RayTree::AddShadowSegment(ray, 0, hit.getT() + 0.1);
     }
     else
     {
-        if (type == RayTracer::RayType::Reflect)
-            radiance += pSceneParser->getBackgroundColor();
+        RayTree::AddShadowSegment(ray, 0, distance + 0.1);
 
-        return radiance;
     }
 
-    return radiance;
-}
\ No newline at end of file
+    if (intersected && hit.getWorldObject() != nullptr)
+    {
+        ShadowOccluder& occluder = lastOccluders[lightIndex];
+        occluder.object = hit.getWorldObject();
+        occluder.instance = InstanceOf(accel, hit.getObjectMatrix());
+    }
+    //float distance = hit.getT();
+    return intersected;
+}
@@ -3,13 +3,33 @@
 #include <RayTracer/Core/scene_parser.h>
 #include <RayTracer/VersionControl.h>
 #include <RayTracer/Primitives/Grid.h>
+#include <memory>
 
 class Ray;
 class Hit;
+class Group;
 
 extern int gridx, gridy, gridz;
 extern bool grid;
 extern bool visualize_grid;
+extern bool russian_roulette;
+
+// Mirror the direction in around norm
+void Reflect(Vec3f& in, Vec3f& norm, Vec3f& out);
+// Bend the direction in through a surface of normal norm, eta being the
+// ratio of the indices of refraction. Returns false on total internal
+// reflection, out is then left zero
+bool Refract(Vec3f& in, Vec3f& norm, Vec3f& out, float eta);
+
+// Decides whether a secondary ray whose path weight is weight gets traced.
+// Rays at or below the cutoff are dropped, or with russian_roulette kept
+// with probability weight / cutoff; scale receives the factor to apply to
+// the ray's weight and radiance so the estimate stays unbiased.
+bool ContinueRay(const Vec3f& weight, float cutoff, float& scale);
+// Restarts the roulette sequence of this thread. The driver seeds it per
+// camera sample and the wavefront tracer per queued ray, so a pixel gets
+// the same roulette decisions whichever part of the image is being rendered
+void SeedRoulette(unsigned seed);
 
 // computes the radiance (color) along a ray.
 class RayTracer
@@ -42,21 +62,44 @@ public:
 
 	Grid* GetGrid() { return ScopeGrid.get(); }
 
+	// Traces s from now on, a reload of the scene file with owners as
+	// SceneParser_v6::reuse returned them. The grid keeps the cells of
+	// the objects that were taken over and only the new ones are
+	// inserted, unless the scene grew out of it or shrank by more than a
+	// cell, then it is built again.
+	// Returns whether the grid was kept.
+	bool Reload(SceneParser_v6* s, const std::vector<int>& owners);
+
 private:
 	enum class RayType
 	{
+		Primary,
 		Reflect,
 		Refract,
 	};
 
-	Vec3f iteratorRay(Ray& ray, int bounces, float tmin, RayType type, Vec3f weight) const;
-	bool shadowRay(Vec3f& position, Light* light) const;
+	// Traces and shades one ray of any depth. Accel is the Group or the
+	// Grid of the scene, the flags compile out what the render never
+	// needs, so the loop over rays tests none of them. The constructor
+	// picks the instantiation, see selectKernel.
+	template <class Accel, bool Visualize, bool Shadows, bool Reflections, bool Refractions>
+	Vec3f trace(Ray& ray, float tmin, int bounces, RayType type, const Vec3f& weight, Hit& hit) const;
+	template <class Accel>
+	bool shadowRay(Vec3f& position, Light* light, int lightIndex) const;
+	bool shadowRayCached(const Ray& ray, float distance, int lightIndex) const;
+
+	typedef Vec3f (RayTracer::*TraceKernel)(Ray&, float, int, RayType, const Vec3f&, Hit&) const;
+	template <class Accel>
+	static TraceKernel selectKernel(bool shadows, bool reflections, bool refractions);
+
+	void buildGrid();
+	void selectTrace();
 
 	SceneParser_v6* pSceneParser;
 	bool mUseShadow;
-	bool mShadeback;
 	int mMaxBounce;
 	float mCutoffweight;
+	TraceKernel mTrace;
 
 	std::unique_ptr<Grid> ScopeGrid;
 };
\ No newline at end of file
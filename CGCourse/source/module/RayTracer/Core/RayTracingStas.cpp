@@ -1,5 +1,10 @@
 #include <stdio.h>
+#include <algorithm>
+#include <chrono>
+#include <mutex>
+#include <vector>
 #include "RayTracingStas.h"
+#pragma warning(disable:4996)
 
 int RayTracingStats::width;
 int RayTracingStats::height;
@@ -9,14 +14,67 @@ int RayTracingStats::num_y;
 int RayTracingStats::num_z;
 
 unsigned long long RayTracingStats::start_time;
-unsigned long long RayTracingStats::num_nonshadow_rays;
-unsigned long long RayTracingStats::num_shadow_rays;
-unsigned long long RayTracingStats::num_intersections;
-unsigned long long RayTracingStats::num_grid_cells_traversed;
+double RayTracingStats::start_seconds;
+thread_local RayTracingStats::ThreadCounters RayTracingStats::counters;
+
+// The counters of the running threads, and the sum of those that ended
+static std::mutex& CountersMutex() {
+	static std::mutex mutex;
+	return mutex;
+}
+static std::vector<RayTracingStats::Counters*>& LiveCounters() {
+	static std::vector<RayTracingStats::Counters*> live;
+	return live;
+}
+static RayTracingStats::Counters& RetiredCounters() {
+	static RayTracingStats::Counters retired;
+	return retired;
+}
+
+void RayTracingStats::Counters::add(const Counters& c) {
+	nonshadow_rays += c.nonshadow_rays;
+	shadow_rays += c.shadow_rays;
+	shadow_cache_tests += c.shadow_cache_tests;
+	shadow_cache_hits += c.shadow_cache_hits;
+	pruned_rays += c.pruned_rays;
+	roulette_rays += c.roulette_rays;
+	total_internal_reflections += c.total_internal_reflections;
+	intersections += c.intersections;
+	grid_cells_traversed += c.grid_cells_traversed;
+}
+
+RayTracingStats::ThreadCounters::ThreadCounters() {
+	std::lock_guard<std::mutex> lock(CountersMutex());
+	LiveCounters().push_back(this);
+}
+
+RayTracingStats::ThreadCounters::~ThreadCounters() {
+	std::lock_guard<std::mutex> lock(CountersMutex());
+	std::vector<Counters*>& live = LiveCounters();
+	live.erase(std::find(live.begin(), live.end(), this));
+	RetiredCounters().add(*this);
+}
+
+RayTracingStats::Counters RayTracingStats::Totals() {
+	std::lock_guard<std::mutex> lock(CountersMutex());
+	Counters total = RetiredCounters();
+	for (Counters* c : LiveCounters())
+		total.add(*c);
+	return total;
+}
 
 // ====================================================================
 // ====================================================================
 
+static double NowSeconds() {
+	return std::chrono::duration<double>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+double RayTracingStats::GetSeconds() {
+	return NowSeconds() - start_seconds;
+}
+
 void RayTracingStats::Initialize(int _width, int _height, BoundingBox* _bbox,
 	int nx, int ny, int nz) {
 	width = _width;
@@ -26,10 +84,13 @@ void RayTracingStats::Initialize(int _width, int _height, BoundingBox* _bbox,
 	num_y = ny;
 	num_z = nz;
 	start_time = time(NULL);
-	num_nonshadow_rays = 0;
-	num_shadow_rays = 0;
-	num_intersections = 0;
-	num_grid_cells_traversed = 0;
+	start_seconds = NowSeconds();
+	// registers the counters of this thread if it has none yet
+	counters.nonshadow_rays = 0;
+	std::lock_guard<std::mutex> lock(CountersMutex());
+	RetiredCounters() = Counters();
+	for (Counters* c : LiveCounters())
+		*c = Counters();
 }
 
 // ====================================================================
@@ -37,16 +98,19 @@ void RayTracingStats::Initialize(int _width, int _height, BoundingBox* _bbox,
 
 void RayTracingStats::PrintStatistics() {
 
+	Counters c = Totals();
 	int delta_time = time(NULL) - start_time;
 	if (delta_time == 0) delta_time = 1;
 	int secs = delta_time % 60;
 	int min = (delta_time / 60) % 60;
 	int hours = delta_time / (60 * 60);
-	int num_rays = num_nonshadow_rays + num_shadow_rays;
+	int num_rays = c.nonshadow_rays + c.shadow_rays;
 	float rays_per_sec = float(num_rays) / float(delta_time);
 	float rays_per_pixel = float(num_rays) / float(width * height);
-	float intersections_per_ray = num_intersections / float(num_rays);
-	float traversed_per_ray = num_grid_cells_traversed / float(num_rays);
+	float intersections_per_ray = c.intersections / float(num_rays);
+	float traversed_per_ray = c.grid_cells_traversed / float(num_rays);
+	float shadow_cache_hit_rate = (c.shadow_cache_tests == 0) ? 0 :
+		100.0f * c.shadow_cache_hits / float(c.shadow_cache_tests);
 
 	printf("********************************************\n");
 	printf("RAY TRACING STATISTICS\n");
@@ -58,10 +122,15 @@ void RayTracingStats::PrintStatistics() {
 	printf("  num grid cells             ");
 	if (num_x == 0) printf("NULL\n");
 	else printf("%d (%dx%dx%d)\n", num_x * num_y * num_z, num_x, num_y, num_z);
-	printf("  num non-shadow rays        %lld\n", num_nonshadow_rays);
-	printf("  num shadow rays            %lld\n", num_shadow_rays);
-	printf("  total intersections        %lld\n", num_intersections);
-	printf("  total cells traversed      %lld\n", num_grid_cells_traversed);
+	printf("  num non-shadow rays        %lld\n", c.nonshadow_rays);
+	printf("  num shadow rays            %lld\n", c.shadow_rays);
+	printf("  shadow cache tests         %lld\n", c.shadow_cache_tests);
+	printf("  shadow cache hits          %lld (%0.1f%%)\n", c.shadow_cache_hits, shadow_cache_hit_rate);
+	printf("  pruned rays                %lld\n", c.pruned_rays);
+	printf("  roulette survivors         %lld\n", c.roulette_rays);
+	printf("  total internal reflections %lld\n", c.total_internal_reflections);
+	printf("  total intersections        %lld\n", c.intersections);
+	printf("  total cells traversed      %lld\n", c.grid_cells_traversed);
 	printf("  rays per second            %0.1f\n", rays_per_sec);
 	printf("  rays per pixel             %0.1f\n", rays_per_pixel);
 	printf("  intersections per ray      %0.1f\n", intersections_per_ray);
@@ -70,5 +139,44 @@ void RayTracingStats::PrintStatistics() {
 
 }
 
+// ====================================================================
+// ====================================================================
+
+void RayTracingStats::SaveStatisticsJSON(const char* filename) {
+
+	FILE* file = fopen(filename, "w");
+	if (file == NULL) {
+		printf("ERROR: could not write %s\n", filename);
+		return;
+	}
+
+	Counters c = Totals();
+	double seconds = NowSeconds() - start_seconds;
+	unsigned long long num_rays = c.nonshadow_rays + c.shadow_rays;
+	double rays_per_sec = (seconds > 0) ? num_rays / seconds : 0;
+	double intersections_per_ray = (num_rays == 0) ? 0 : c.intersections / double(num_rays);
+	double traversed_per_ray = (num_rays == 0) ? 0 : c.grid_cells_traversed / double(num_rays);
+
+	fprintf(file, "{\n");
+	fprintf(file, "  \"width\": %d,\n", width);
+	fprintf(file, "  \"height\": %d,\n", height);
+	fprintf(file, "  \"grid\": [%d, %d, %d],\n", num_x, num_y, num_z);
+	fprintf(file, "  \"render_seconds\": %f,\n", seconds);
+	fprintf(file, "  \"nonshadow_rays\": %llu,\n", c.nonshadow_rays);
+	fprintf(file, "  \"shadow_rays\": %llu,\n", c.shadow_rays);
+	fprintf(file, "  \"shadow_cache_tests\": %llu,\n", c.shadow_cache_tests);
+	fprintf(file, "  \"shadow_cache_hits\": %llu,\n", c.shadow_cache_hits);
+	fprintf(file, "  \"pruned_rays\": %llu,\n", c.pruned_rays);
+	fprintf(file, "  \"roulette_rays\": %llu,\n", c.roulette_rays);
+	fprintf(file, "  \"total_internal_reflections\": %llu,\n", c.total_internal_reflections);
+	fprintf(file, "  \"intersections\": %llu,\n", c.intersections);
+	fprintf(file, "  \"cells_traversed\": %llu,\n", c.grid_cells_traversed);
+	fprintf(file, "  \"rays_per_second\": %f,\n", rays_per_sec);
+	fprintf(file, "  \"intersections_per_ray\": %f,\n", intersections_per_ray);
+	fprintf(file, "  \"cells_traversed_per_ray\": %f\n", traversed_per_ray);
+	fprintf(file, "}\n");
+	fclose(file);
+}
+
 // ====================================================================
 // ====================================================================
\ No newline at end of file
@@ -5,7 +5,7 @@
 #include <limits.h>
 
 #include "vectors.h"
-#include "boundingbox.h"
+#include "BoundingBox.h"
 
 // ====================================================================
 // ====================================================================
@@ -13,6 +13,8 @@
 // This class only contains static variables and static member
 // functions so there is no need to call the constructor, destructor
 // etc.  It's just a wrapper for the global statistics data.
+// The counters are kept per thread (the GUI renders on a thread of its
+// own) and added up when they are printed.
 
 class RayTracingStats {
 
@@ -23,10 +25,22 @@ public:
         int nx, int ny, int nz);
 
     // Call for each non-shadow ray
-    static void IncrementNumNonShadowRays() { num_nonshadow_rays++; }
+    static void IncrementNumNonShadowRays() { counters.nonshadow_rays++; }
 
     // Call for each shadow ray
-    static void IncrementNumShadowRays() { num_shadow_rays++; }
+    static void IncrementNumShadowRays() { counters.shadow_rays++; }
+
+    // Call for each shadow ray that tests the cached occluder of its light,
+    // and for each of those the cached occluder alone proved to be blocked
+    static void IncrementNumShadowCacheTests() { counters.shadow_cache_tests++; }
+    static void IncrementNumShadowCacheHits() { counters.shadow_cache_hits++; }
+
+    // Call for each secondary ray that is not spawned because its weight
+    // is below the cutoff, for each one Russian roulette kept, and for
+    // each refraction that turned out to be total internal reflection
+    static void IncrementNumPrunedRays() { counters.pruned_rays++; }
+    static void IncrementNumRouletteRays() { counters.roulette_rays++; }
+    static void IncrementNumTotalInternalReflections() { counters.total_internal_reflections++; }
 
     // Add this to each Object3D primitive's intersect routine 
     // (but not group and transform). 
@@ -34,15 +48,42 @@ public:
     // is computed, not the number of times it returns true
     static void IncrementNumIntersections() {
         // WARNING:  this might overflow
-        num_intersections++;
+        counters.intersections++;
     }
+    // For primitives that test several shapes in one call
+    static void AddNumIntersections(unsigned long long n) { counters.intersections += n; }
 
     // Call each time a new cell is entered by a ray
-    static void IncrementNumGridCellsTraversed() { num_grid_cells_traversed++; }
+    static void IncrementNumGridCellsTraversed() { counters.grid_cells_traversed++; }
+
+    // Running totals of the calling thread since Initialize, the
+    // difference of two readings is the work it did in between (see the
+    // cost AOV of FrameBuffer)
+    static unsigned long long GetNumRays() { return counters.nonshadow_rays + counters.shadow_rays; }
+    static unsigned long long GetNumIntersections() { return counters.intersections; }
+    static unsigned long long GetNumGridCellsTraversed() { return counters.grid_cells_traversed; }
+    static double GetSeconds();
 
     // Call when you're all done
     static void PrintStatistics();
 
+    // Same numbers as a JSON object, for scripts and the benchmark driver
+    static void SaveStatisticsJSON(const char* filename);
+
+    // What is counted, per thread
+    struct Counters {
+        unsigned long long nonshadow_rays = 0;
+        unsigned long long shadow_rays = 0;
+        unsigned long long shadow_cache_tests = 0;
+        unsigned long long shadow_cache_hits = 0;
+        unsigned long long pruned_rays = 0;
+        unsigned long long roulette_rays = 0;
+        unsigned long long total_internal_reflections = 0;
+        unsigned long long intersections = 0;
+        unsigned long long grid_cells_traversed = 0;
+        void add(const Counters& c);
+    };
+
 private:
 
     // TIMING VARIABLES
@@ -55,10 +96,17 @@ private:
     static int num_y;
     static int num_z;
     static unsigned long long start_time;
-    static unsigned long long num_nonshadow_rays;
-    static unsigned long long num_shadow_rays;
-    static unsigned long long num_intersections;
-    static unsigned long long num_grid_cells_traversed;
+    static double start_seconds;
+
+    // The counters of one thread. They are known to Initialize and
+    // Totals while the thread runs, and added to the totals when it ends.
+    struct ThreadCounters : Counters {
+        ThreadCounters();
+        ~ThreadCounters();
+    };
+    static thread_local ThreadCounters counters;
+    // The sum over all threads
+    static Counters Totals();
 };
 
 // ====================================================================
@@ -1,4 +1,4 @@
-#include "rayTree.h"
+#include "RayTree.h"
 #include <GL/gl.h>
 
 // ====================================================================
@@ -0,0 +1,108 @@
+#include "RenderCheckpoint.h"
+
+#include "FrameBuffer.h"
+#include <RayTracer/AntiAliasing/Film.h>
+#include <chrono>
+#include <stdio.h>
+#include <string.h>
+
+// Magic, settings length and settings, the done column, the frame
+// buffer, then the done columns of the film as a tile
+static const char CheckpointMagic[8] = { 'R', 'T', 'C', 'H', 'E', 'C', 'K', '1' };
+
+static double NowSeconds()
+{
+    return std::chrono::duration<double>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+RenderCheckpoint::RenderCheckpoint(const char* filename, float interval, const std::string& settings)
+    :filename(filename), settings(settings), interval(interval), lastSave(NowSeconds())
+{
+}
+
+bool RenderCheckpoint::due() const
+{
+    return NowSeconds() - lastSave >= interval;
+}
+
+bool RenderCheckpoint::save(int column, int x0, int y0, int y1, const FrameBuffer& fb, Film& film)
+{
+    lastSave = NowSeconds();
+
+    std::string temp = filename + ".tmp";
+    FILE* file = fopen(temp.c_str(), "wb");
+    if (file == NULL)
+    {
+        printf("ERROR: could not write checkpoint %s\n", temp.c_str());
+        return false;
+    }
+    int length = (int)settings.size();
+    fwrite(CheckpointMagic, sizeof(CheckpointMagic), 1, file);
+    fwrite(&length, sizeof(length), 1, file);
+    fwrite(settings.data(), 1, length, file);
+    fwrite(&column, sizeof(column), 1, file);
+    bool ok = fb.write(file) && film.writeTile(file, x0, y0, column, y1);
+    ok = (fclose(file) == 0) && ok;
+    if (!ok)
+    {
+        printf("ERROR: could not write checkpoint %s\n", temp.c_str());
+        ::remove(temp.c_str());
+        return false;
+    }
+
+#ifdef _WIN32
+    // rename does not replace an existing file there
+    ::remove(filename.c_str());
+#endif
+    if (rename(temp.c_str(), filename.c_str()) != 0)
+    {
+        printf("ERROR: could not replace checkpoint %s\n", filename.c_str());
+        return false;
+    }
+    return true;
+}
+
+int RenderCheckpoint::load(int x0, int y0, int y1, FrameBuffer& fb, Film& film)
+{
+    FILE* file = fopen(filename.c_str(), "rb");
+    if (file == NULL)
+    {
+        printf("no checkpoint %s, starting from the beginning\n", filename.c_str());
+        return x0;
+    }
+
+    char magic[sizeof(CheckpointMagic)];
+    int length = -1, column = x0;
+    std::string saved;
+    bool ok = fread(magic, sizeof(magic), 1, file) == 1 &&
+        memcmp(magic, CheckpointMagic, sizeof(magic)) == 0 &&
+        fread(&length, sizeof(length), 1, file) == 1 && length >= 0;
+    if (ok)
+    {
+        saved.resize(length);
+        ok = fread(&saved[0], 1, length, file) == (size_t)length && saved == settings;
+        if (!ok)
+            printf("ERROR: checkpoint %s was made with other settings\n", filename.c_str());
+    }
+
+    int tx0, ty0, tx1, ty1;
+    ok = ok && fread(&column, sizeof(column), 1, file) == 1 &&
+        fb.read(file) && film.readTile(file, filename.c_str(), tx0, ty0, tx1, ty1) &&
+        tx0 == x0 && ty0 == y0 && ty1 == y1 && tx1 == column;
+    fclose(file);
+
+    if (!ok)
+    {
+        printf("ERROR: can't resume from checkpoint %s, starting from the beginning\n", filename.c_str());
+        return x0;
+    }
+    printf("resuming from checkpoint %s at column %d\n", filename.c_str(), column);
+    lastSave = NowSeconds();
+    return column;
+}
+
+void RenderCheckpoint::remove()
+{
+    ::remove(filename.c_str());
+}
@@ -0,0 +1,39 @@
+#pragma once
+#include <string>
+
+class FrameBuffer;
+class Film;
+
+// Snapshot of a render in progress (-checkpoint), so a render that is
+// killed can go on with -resume. The driver renders the image a column
+// at a time; a snapshot holds the columns that are done, as film samples
+// and AOVs. Samples and roulette are seeded per camera sample, so there
+// is no generator state to keep and a resumed render comes out the same
+// as an uninterrupted one.
+class RenderCheckpoint
+{
+public:
+	// settings identifies the render (scene, size, options); a snapshot
+	// made with other settings is never resumed
+	RenderCheckpoint(const char* filename, float interval, const std::string& settings);
+
+	// True once interval seconds passed since the last save
+	bool due() const;
+
+	// Saves the columns [x0, column) of the rows [y0, y1). The file is
+	// replaced in one step, a crash while saving keeps the previous one
+	bool save(int column, int x0, int y0, int y1, const FrameBuffer& fb, Film& film);
+
+	// Restores the snapshot and returns the first column left to render,
+	// x0 if there is no snapshot or it belongs to another render
+	int load(int x0, int y0, int y1, FrameBuffer& fb, Film& film);
+
+	// Deletes the snapshot once the render is complete
+	void remove();
+
+private:
+	std::string filename;
+	std::string settings;
+	float interval;
+	double lastSave;
+};
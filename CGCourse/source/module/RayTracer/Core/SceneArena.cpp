@@ -0,0 +1,45 @@
+#include "SceneArena.h"
+
+#include <stdint.h>
+
+SceneArena::SceneArena(size_t blockSize)
+	:blockSize(blockSize), head(nullptr), end(nullptr), used(0), reserved(0)
+{
+}
+
+void* SceneArena::allocate(size_t size, size_t align)
+{
+	used += size;
+	if (size + align > blockSize)
+	{
+		// A block of its own, the current one stays open
+		char* block = new char[size + align];
+		blocks.push_back(block);
+		reserved += size + align;
+		return (void*)(((uintptr_t)block + align - 1) & ~(uintptr_t)(align - 1));
+	}
+
+	uintptr_t p = ((uintptr_t)head + align - 1) & ~(uintptr_t)(align - 1);
+	if (head == nullptr || p + size > (uintptr_t)end)
+	{
+		head = new char[blockSize];
+		end = head + blockSize;
+		blocks.push_back(head);
+		reserved += blockSize;
+		p = ((uintptr_t)head + align - 1) & ~(uintptr_t)(align - 1);
+	}
+	head = (char*)(p + size);
+	return (void*)p;
+}
+
+void SceneArena::release()
+{
+	for (size_t i = destructors.size(); i > 0; i--)
+		destructors[i - 1].destroy(destructors[i - 1].first, destructors[i - 1].count);
+	destructors.clear();
+	for (char* block : blocks)
+		delete[] block;
+	blocks.clear();
+	head = end = nullptr;
+	used = reserved = 0;
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <stddef.h>
+#include <new>
+#include <utility>
+#include <vector>
+#include <type_traits>
+
+// Owns the objects of one parsed scene. They are placed back to back in
+// large blocks, in parse order, so the triangles of a mesh end up next to
+// each other in memory. Nothing is freed one by one: release() runs the
+// destructors in reverse creation order and then drops every block.
+class SceneArena
+{
+public:
+	SceneArena(size_t blockSize = 1 << 18);
+	~SceneArena() { release(); }
+
+	template <class T, class... Args>
+	T* create(Args&&... args)
+	{
+		T* object = new (allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+		if (!std::is_trivially_destructible<T>::value)
+		{
+			// Objects of one type made back to back (the triangles of a
+			// mesh) share one record
+			Destructor* last = destructors.empty() ? nullptr : &destructors.back();
+			if (last != nullptr && last->destroy == &Destroy<T> &&
+				(T*)last->first + last->count == object)
+				last->count++;
+			else
+				destructors.push_back({ object, 1, &Destroy<T> });
+		}
+		return object;
+	}
+
+	// Uninitialized storage, valid until release()
+	void* allocate(size_t size, size_t align);
+	void release();
+
+	// Bytes handed out and bytes reserved in blocks
+	size_t getUsed() const { return used; }
+	size_t getReserved() const { return reserved; }
+
+private:
+	SceneArena(const SceneArena&) = delete;
+	SceneArena& operator=(const SceneArena&) = delete;
+
+	template <class T>
+	static void Destroy(void* first, size_t count)
+	{
+		for (size_t i = count; i > 0; i--)
+			static_cast<T*>(first)[i - 1].~T();
+	}
+
+	struct Destructor
+	{
+		void* first;
+		size_t count;
+		void (*destroy)(void*, size_t);
+	};
+
+	size_t blockSize;
+	std::vector<char*> blocks;
+	char* head;
+	char* end;
+	size_t used;
+	size_t reserved;
+	std::vector<Destructor> destructors;
+};
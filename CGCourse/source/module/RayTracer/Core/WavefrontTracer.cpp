@@ -0,0 +1,269 @@
+#include "WavefrontTracer.h"
+
+#include "RayTracer.h"
+#include "RayTracingStas.h"
+#include <RayTracer/Primitives/Group.h>
+#include <RayTracer/Primitives/Grid.h>
+#include <RayTracer/Core/light.h>
+#include <RayTracer/AntiAliasing/Sampler.h>
+#include <algorithm>
+
+static Vec3f black(0, 0, 0);
+static Material* black_mat = new PhongMaterial(black, black, 0, black, black, 1);
+
+WavefrontTracer::WavefrontTracer(SceneParser_v6* s, int max_bounces, float cutoff_weight, bool shadows)
+    :pSceneParser(s), mUseShadow(shadows), mMaxBounce(max_bounces), mCutoffweight(cutoff_weight)
+{
+    mShadeback = true;
+    mReorder = false;
+}
+
+// Spreads the low 10 bits of v so that there are two zero bits between each of them
+static unsigned int SpreadBits(unsigned int v)
+{
+    v &= 0x3ff;
+    v = (v | (v << 16)) & 0x030000ff;
+    v = (v | (v << 8)) & 0x0300f00f;
+    v = (v | (v << 4)) & 0x030c30c3;
+    v = (v | (v << 2)) & 0x09249249;
+    return v;
+}
+
+void WavefrontTracer::sortQueue(std::vector<QueuedRay>& queue)
+{
+    if (queue.size() < 2)
+        return;
+
+    // Quantize the origins on a 1024^3 lattice over the bounds of the wave
+    Vec3f lo = queue[0].ray.getOrigin();
+    Vec3f hi = lo;
+    for (int i = 1; i < (int)queue.size(); i++)
+    {
+        const Vec3f& o = queue[i].ray.getOrigin();
+        Vec3f::Min(lo, lo, o);
+        Vec3f::Max(hi, hi, o);
+    }
+    Vec3f extent = hi - lo;
+
+    // Key = direction octant (3 bits) above the Morton code of the origin cell
+    mSortKeys.resize(queue.size());
+    for (int i = 0; i < (int)queue.size(); i++)
+    {
+        const Vec3f& o = queue[i].ray.getOrigin();
+        const Vec3f& d = queue[i].ray.getDirection();
+        unsigned int cell[3];
+        for (int a = 0; a < 3; a++)
+            cell[a] = extent[a] > 0 ? (unsigned int)((o[a] - lo[a]) / extent[a] * 1023.0f) : 0;
+        unsigned long long octant = (d.x() < 0 ? 1 : 0) | (d.y() < 0 ? 2 : 0) | (d.z() < 0 ? 4 : 0);
+        unsigned long long morton = SpreadBits(cell[0]) | (SpreadBits(cell[1]) << 1) | (SpreadBits(cell[2]) << 2);
+        mSortKeys[i] = { (octant << 30) | morton, i };
+    }
+    std::sort(mSortKeys.begin(), mSortKeys.end());
+
+    mSorted.resize(queue.size());
+    for (int i = 0; i < (int)queue.size(); i++)
+        mSorted[i] = queue[mSortKeys[i].second];
+    queue.swap(mSorted);
+}
+
+bool WavefrontTracer::intersect(const Ray& ray, Hit& hit, float tmin) const
+{
+    if (pSceneParser->grid != nullptr)
+        return pSceneParser->grid->intersect(ray, hit, tmin);
+    else
+        return pSceneParser->getGroup()->intersect(ray, hit, tmin);
+}
+
+void WavefrontTracer::traceRays(const std::vector<Ray>& primary, const std::vector<unsigned>& seeds,
+    std::vector<Vec3f>& radiance, std::vector<Hit>* primaryHits)
+{
+    radiance.assign(primary.size(), black);
+
+    std::vector<QueuedRay> queue;
+    queue.reserve(primary.size());
+    for (int i = 0; i < (int)primary.size(); i++)
+        queue.push_back({ primary[i], Vec3f(1, 1, 1), i, 0, RayType::Primary, seeds[i] });
+
+    mReflected.clear();
+    mRefracted.clear();
+
+    // Primary wave
+    intersectQueue(queue);
+    if (primaryHits != nullptr)
+    {
+        primaryHits->assign(queue.size(), Hit());
+        for (int i = 0; i < (int)queue.size(); i++)
+            if (mIntersected[i])
+                (*primaryHits)[i] = mHits[i];
+    }
+    shadeQueue(queue, radiance);
+    traceShadowQueue(radiance);
+
+    // Secondary waves, until no ray spawns another one
+    while (!mNextReflected.empty() || !mNextRefracted.empty())
+    {
+        mReflected.swap(mNextReflected);
+        mRefracted.swap(mNextRefracted);
+        mNextReflected.clear();
+        mNextRefracted.clear();
+
+        if (mReorder)
+        {
+            sortQueue(mReflected);
+            sortQueue(mRefracted);
+        }
+
+        intersectQueue(mReflected);
+        shadeQueue(mReflected, radiance);
+        intersectQueue(mRefracted);
+        shadeQueue(mRefracted, radiance);
+        traceShadowQueue(radiance);
+    }
+}
+
+void WavefrontTracer::intersectQueue(const std::vector<QueuedRay>& queue)
+{
+    mHits.assign(queue.size(), Hit(999999, black_mat, Vec3f(0, 0, 0)));
+    mIntersected.assign(queue.size(), 0);
+
+    for (int i = 0; i < (int)queue.size(); i++)
+    {
+        RayTracingStats::IncrementNumNonShadowRays();
+        mIntersected[i] = intersect(queue[i].ray, mHits[i], 0);
+        if (mIntersected[i])
+            mHits[i].finalize(queue[i].ray);
+    }
+}
+
+void WavefrontTracer::shadeQueue(const std::vector<QueuedRay>& queue, std::vector<Vec3f>& radiance)
+{
+    // Shade the hits grouped by material, so consecutive shading calls
+    // run the same material code on the same material data
+    mShadingOrder.resize(queue.size());
+    for (int i = 0; i < (int)queue.size(); i++)
+        mShadingOrder[i] = i;
+    std::stable_sort(mShadingOrder.begin(), mShadingOrder.end(), [this](int a, int b) {
+        Material* ma = mIntersected[a] ? mHits[a].getMaterial() : nullptr;
+        Material* mb = mIntersected[b] ? mHits[b].getMaterial() : nullptr;
+        return ma < mb;
+    });
+
+    for (int i = 0; i < (int)mShadingOrder.size(); i++)
+    {
+        int index = mShadingOrder[i];
+        const QueuedRay& queued = queue[index];
+        if (mIntersected[index])
+        {
+            shadeHit(queued, mHits[index], radiance);
+        }
+        else if (queued.type == RayType::Primary || queued.type == RayType::Reflect)
+        {
+            // Primary and reflected rays that leave the scene see the background
+            radiance[queued.pixel] += queued.weight * pSceneParser->getBackgroundColor();
+        }
+    }
+}
+
+void WavefrontTracer::shadeHit(const QueuedRay& queued, const Hit& hit, std::vector<Vec3f>& radiance)
+{
+    const Ray& ray = queued.ray;
+    Material* material = hit.getMaterial();
+    Vec3f position = hit.getIntersectionPoint();
+    Vec3f normal = hit.getNormal();
+    bool primary = queued.type == RayType::Primary;
+
+    if (!mShadeback && normal.Dot3(ray.getDirection()) > 0)
+        return;
+
+    // Primary rays keep the geometric normal, secondary rays face it to the ray
+    Vec3f hitNormal = normal;
+    if (!primary && normal.Dot3(ray.getDirection()) > 0)
+        hitNormal = -1 * normal;
+
+    Vec3f ambient;
+    Vec3f::Mult(ambient, material->getDiffuseColor(), pSceneParser->getAmbientLight());
+    radiance[queued.pixel] += queued.weight * ambient;
+
+    for (int k = 0; k < pSceneParser->getNumLights(); k++)
+    {
+        Light* light = pSceneParser->getLight(k);
+
+        Vec3f dir, col;
+        light->getIllumination(position, dir, col);
+        Vec3f outrad = queued.weight * material->Shade(ray, hit, dir, col);
+
+        if (mUseShadow)
+        {
+            Vec3f hitPos = position + 0.001 * normal;
+            float distance;
+            Vec3f direction, color;
+            light->getIllumination(hitPos, direction, color, distance);
+            mShadow.push_back({ Ray(hitPos, direction), distance, outrad, queued.pixel });
+        }
+        else
+        {
+            radiance[queued.pixel] += outrad;
+        }
+    }
+
+    // Like the recursive tracer, never spawn past the last bounce, and
+    // only spawn rays whose weight passes ContinueRay
+    int bounces = queued.bounces + 1;
+    if (bounces > mMaxBounce)
+        return;
+
+    // The roulette draws of this ray, and the seeds of its children, only
+    // depend on its own seed
+    SeedRoulette(queued.seed);
+    float scale;
+    Vec3f reflectiveColor = material->getReflectiveColor();
+    Vec3f reflectWeight = queued.weight * reflectiveColor;
+    if (reflectiveColor != Vec3f() && ContinueRay(reflectWeight, mCutoffweight, scale))
+    {
+        Vec3f inRay = ray.getDirection();
+        Vec3f outRay;
+        Reflect(inRay, normal, outRay);
+        Ray reflectRay(position + 0.001 * hitNormal, outRay);
+        mNextReflected.push_back({ reflectRay, scale * reflectWeight, queued.pixel, bounces, RayType::Reflect,
+            HashSample((int)queued.seed, (int)RayType::Reflect, bounces) });
+    }
+
+    Vec3f transparentColor = material->getTransparentColor();
+    if (transparentColor != Vec3f())
+    {
+        Vec3f inRay = ray.getDirection();
+        Vec3f outRay;
+        bool refracted;
+        // Ray is getting out of the material
+        if (normal.Dot3(ray.getDirection()) >= 0)
+            refracted = Refract(inRay, hitNormal, outRay, material->getIndexOfRefraction());
+        else
+            refracted = Refract(inRay, hitNormal, outRay, 1.0f / material->getIndexOfRefraction());
+        Vec3f refractWeight = queued.weight * transparentColor;
+        if (!refracted)
+        {
+            RayTracingStats::IncrementNumTotalInternalReflections();
+        }
+        else if (ContinueRay(refractWeight, mCutoffweight, scale))
+        {
+            Ray refractRay(position - 0.001 * hitNormal, outRay);
+            mNextRefracted.push_back({ refractRay, scale * refractWeight, queued.pixel, bounces, RayType::Refract,
+                HashSample((int)queued.seed, (int)RayType::Refract, bounces) });
+        }
+    }
+}
+
+void WavefrontTracer::traceShadowQueue(std::vector<Vec3f>& radiance)
+{
+    for (int i = 0; i < (int)mShadow.size(); i++)
+    {
+        RayTracingStats::IncrementNumShadowRays();
+
+        const ShadowRay& shadow = mShadow[i];
+        Hit hit(999999, black_mat, Vec3f(0, 0, 0));
+        bool intersected = intersect(shadow.ray, hit, 0.0001);
+        if (!intersected || hit.getT() > shadow.distance)
+            radiance[shadow.pixel] += shadow.radiance;
+    }
+    mShadow.clear();
+}
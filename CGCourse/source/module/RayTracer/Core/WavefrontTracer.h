@@ -0,0 +1,89 @@
+#pragma once
+#include <LinearAlgebra/vectors.h>
+#include <RayTracer/Core/scene_parser.h>
+#include <RayTracer/Core/ray.h>
+#include <RayTracer/Core/hit.h>
+#include <RayTracer/VersionControl.h>
+#include <vector>
+
+// Breadth-first alternative to RayTracer::traceRay.
+// Instead of following one ray tree at a time, all camera rays are
+// traced together as a wave: every ray of a queue is intersected first,
+// then all the hits are shaded (sorted by material), which fills the
+// shadow queue and the reflected / refracted queues of the next wave.
+// The result matches the recursive tracer for the same settings.
+class WavefrontTracer
+{
+public:
+	WavefrontTracer(SceneParser_v6* s, int max_bounces, float cutoff_weight, bool shadows);
+
+	// Traces a batch of camera rays. radiance[i] receives the color seen
+	// along primary[i], or the background color if the ray misses the scene.
+	// seeds[i] seeds the russian roulette of the rays spawned from primary[i].
+	// If primaryHits is given it receives the first hit of every camera ray,
+	// with a NULL material for the rays that miss.
+	void traceRays(const std::vector<Ray>& primary, const std::vector<unsigned>& seeds,
+		std::vector<Vec3f>& radiance, std::vector<Hit>* primaryHits = nullptr);
+
+	// Sorts every secondary wave by ray origin and direction before it
+	// is intersected, so neighbouring rays visit the same voxels and triangles
+	void setReorder(bool reorder) { mReorder = reorder; }
+
+private:
+	enum class RayType
+	{
+		Primary,
+		Reflect,
+		Refract,
+	};
+
+	// A ray waiting in one of the queues, with the weight its radiance
+	// contributes to the pixel it belongs to. seed restarts the roulette
+	// for the rays it spawns, whichever order the wave is shaded in
+	struct QueuedRay
+	{
+		Ray ray;
+		Vec3f weight;
+		int pixel;
+		int bounces;
+		RayType type;
+		unsigned seed;
+	};
+
+	// A light contribution that still has to pass its shadow test
+	struct ShadowRay
+	{
+		Ray ray;
+		float distance;
+		Vec3f radiance;
+		int pixel;
+	};
+
+	void sortQueue(std::vector<QueuedRay>& queue);
+	void intersectQueue(const std::vector<QueuedRay>& queue);
+	void shadeQueue(const std::vector<QueuedRay>& queue, std::vector<Vec3f>& radiance);
+	void shadeHit(const QueuedRay& queued, const Hit& hit, std::vector<Vec3f>& radiance);
+	void traceShadowQueue(std::vector<Vec3f>& radiance);
+	bool intersect(const Ray& ray, Hit& hit, float tmin) const;
+
+	SceneParser_v6* pSceneParser;
+	bool mUseShadow;
+	bool mShadeback;
+	bool mReorder;
+	int mMaxBounce;
+	float mCutoffweight;
+
+	// Ray queues of the current and the next wave
+	std::vector<QueuedRay> mReflected;
+	std::vector<QueuedRay> mRefracted;
+	std::vector<QueuedRay> mNextReflected;
+	std::vector<QueuedRay> mNextRefracted;
+	std::vector<ShadowRay> mShadow;
+
+	// Per-ray results of the intersection pass
+	std::vector<Hit> mHits;
+	std::vector<char> mIntersected;
+	std::vector<int> mShadingOrder;
+	std::vector<std::pair<unsigned long long, int>> mSortKeys;
+	std::vector<QueuedRay> mSorted;
+};
@@ -0,0 +1,27 @@
+#include "hit.h"
+#include "Object3D.h"
+#include <matrix.h>
+
+#if (RTVersion>2)
+void Hit_v2::finalize(const Ray& ray)
+{
+    intersectionPoint = ray.pointAtParameter(t);
+    if (primitive == NULL)
+        return;
+
+    // Down to the space of the primitive for its normal, then back out
+    // through the inverse transposes, innermost first
+    Vec3f point = intersectionPoint;
+    for (int i = numSpaces - 1; i >= 0; i--)
+        spaces[i].inverse->Transform(point);
+    normal = primitive->getHitNormal(point, u, v);
+    for (int i = 0; i < numSpaces; i++)
+    {
+        spaces[i].invTranspose->TransformDirection(normal);
+        normal.Normalize();
+    }
+    material = primitive->mat;
+    primitive = NULL;
+    numSpaces = 0;
+}
+#endif
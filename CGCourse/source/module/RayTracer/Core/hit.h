@@ -6,6 +6,8 @@
 #include "../VersionControl.h"
 
 class Material;
+class Object3D;
+class Matrix;
 
 // ====================================================================
 // ====================================================================
@@ -16,15 +18,11 @@ class Hit_v2 {
 public:
 
     // CONSTRUCTOR & DESTRUCTOR
-    Hit_v2() { material = NULL; }
+    Hit_v2() { material = NULL; object = NULL; objectMatrix = NULL; transform = NULL; primitive = NULL; numSpaces = 0; }
     Hit_v2(float _t, Material* m, Vec3f n) {
         t = _t; material = m; normal = n;
-    }
-    Hit_v2(const Hit_v2& h) {
-        t = h.t;
-        material = h.material;
-        normal = h.normal;
-        intersectionPoint = h.intersectionPoint;
+        object = NULL; objectMatrix = NULL; transform = NULL;
+        primitive = NULL; numSpaces = 0;
     }
     ~Hit_v2() {}
 
@@ -33,12 +31,48 @@ public:
     Material* getMaterial() const { return material; }
     Vec3f getNormal() const { return normal; }
     Vec3f getIntersectionPoint() const { return intersectionPoint; }
+    // The primitive that produced this hit, with the grid matrix it
+    // was inserted with (NULL if none)
+    Object3D* getObject() const { return object; }
+    Matrix* getObjectMatrix() const { return objectMatrix; }
+    // The object that reproduces this hit for a world-space ray: the
+    // outermost Transform the primitive was reached through, if any
+    Object3D* getWorldObject() const { return (transform != NULL) ? transform : object; }
+    // True between record() and finalize(): only t and the object are
+    // known, the material, normal and point are not computed yet
+    bool isPending() const { return primitive != NULL; }
 
     // MODIFIER
     void set(float _t, Material* m, Vec3f n, const Ray& ray) {
         t = _t; material = m; normal = n;
         intersectionPoint = ray.pointAtParameter(t);
+        primitive = NULL;
+    }
+    void setObject(Object3D* o, Matrix* m = NULL) {
+        object = o; objectMatrix = m; transform = NULL;
+    }
+    void setTransform(Object3D* tr) { transform = tr; }
+    void setT(float _t) { t = _t; }
+
+    // Deferred evaluation. Traversal only records the closest candidate
+    // (t, the primitive and its barycentrics u, v), and every Transform
+    // it passes on the way out adds its matrices. finalize() then works
+    // out the point, normal and material once, for the hit that won.
+    void record(float _t, Object3D* p, float _u = 0, float _v = 0) {
+        t = _t; primitive = p; u = _u; v = _v; numSpaces = 0;
+        object = p; objectMatrix = NULL; transform = NULL;
+    }
+    // Returns false when the hit is already MaxSpaces deep, the caller
+    // then finalizes it and transforms the normal itself
+    bool pushSpace(const Matrix* inverse, const Matrix* invTranspose) {
+        if (numSpaces == MaxSpaces) return false;
+        spaces[numSpaces].inverse = inverse;
+        spaces[numSpaces].invTranspose = invTranspose;
+        numSpaces++;
+        return true;
     }
+    // ray is the ray the hit was found with, in the space of this hit
+    void finalize(const Ray& ray);
 
 private:
 
@@ -47,6 +81,17 @@ private:
     Material* material;
     Vec3f normal;
     Vec3f intersectionPoint;
+    Object3D* object;
+    Matrix* objectMatrix;
+    Object3D* transform;
+
+    // Deferred state, see record()
+    enum { MaxSpaces = 4 };
+    struct Space { const Matrix* inverse; const Matrix* invTranspose; };
+    Object3D* primitive;
+    float u, v;
+    int numSpaces;
+    Space spaces[MaxSpaces];  // innermost first
 
 };
 
@@ -2,7 +2,7 @@
 #define _LIGHT_H_
 
 #include "vectors.h"
-#include "object3d.h"
+#include "Object3D.h"
 
 // ====================================================================
 // ====================================================================
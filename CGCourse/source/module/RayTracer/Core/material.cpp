@@ -4,7 +4,7 @@
 #include <OpenGL/Core/GLCanvas.h> 
 
 #include <Windows.h>
-#include <gl/GL.h>
+#include <GL/gl.h>
 #include <OpenGL/ThirdParty/glut.h>
 
 Vec3f Material::Shade(const Ray& ray, const Hit& hit, const Vec3f& dirToLight,
@@ -122,7 +122,7 @@ Vec3f PhongMaterial_v2::Shade(const Ray& ray, const Hit& hit, const Vec3f& dirTo
     //float NdH = max(half.Dot3(normal), 0.0);
     float NdL = normal.Dot3(dirToLight);
     //float NdH = max(reflected.Dot3(-1.f * viewDir), 0.0);
-    float NdH = max(reflected.Dot3(-1.f * viewDir), 0.0);
+    float NdH = max(reflected.Dot3(-1.f * viewDir), 0.0f);
     float spec = pow(NdH, exponent);
     Vec3f specular = spec * lightColor * specularColor;
     radiance += specular;
@@ -246,7 +246,7 @@ Vec3f PhongMaterial_v1::Shade(const Ray& ray, const Hit& hit, const Vec3f& dirTo
     //float NdH = max(half.Dot3(normal), 0.0);
     float NdL = normal.Dot3(dirToLight);
     //float NdH = max(reflected.Dot3(-1.f * viewDir), 0.0);
-    float NdH = max(reflected.Dot3(-1.f * viewDir), 0.0);
+    float NdH = max(reflected.Dot3(-1.f * viewDir), 0.0f);
     float spec = pow(NdH, exponent);
     Vec3f specular = spec * lightColor * specularColor;
     radiance += specular;
@@ -19,12 +19,32 @@ public:
   Ray () {}
   Ray (const Vec3f &orig, const Vec3f &dir) {
     origin = orig; 
-    direction = dir; }
+    direction = dir;
+    // 1/+0 = +inf and 1/-0 = -inf, the slab tests rely on that
+    invDirection = Vec3f(1.0f/dir.x(), 1.0f/dir.y(), 1.0f/dir.z());
+    sign[0] = invDirection.x() < 0;
+    sign[1] = invDirection.y() < 0;
+    sign[2] = invDirection.z() < 0;
+    // the watertight triangle test looks along the largest component
+    float ax = fabsf(dir.x()), ay = fabsf(dir.y()), az = fabsf(dir.z());
+    int kz = (ax > ay) ? (ax > az ? 0 : 2) : (ay > az ? 1 : 2);
+    int kx = (kz + 1) % 3, ky = (kx + 1) % 3;
+    if (dir[kz] < 0) { int k = kx; kx = ky; ky = k; }
+    axes[0] = kx; axes[1] = ky; axes[2] = kz;
+    shear = Vec3f(dir[kx]*invDirection[kz], dir[ky]*invDirection[kz], invDirection[kz]); }
   Ray (const Ray& r) {*this=r;}
+  Ray& operator=(const Ray& r) = default;
 
   // ACCESSORS
   const Vec3f& getOrigin() const { return origin; }
   const Vec3f& getDirection() const { return direction; }
+  // componentwise 1/direction, and 1 where that is negative
+  const Vec3f& getInvDirection() const { return invDirection; }
+  int getSign(int axis) const { return sign[axis]; }
+  // the axes permuted so direction[getShearAxis(2)] is the largest
+  // (keeping the winding), and the shear that maps the direction to +z
+  int getShearAxis(int i) const { return axes[i]; }
+  const Vec3f& getShear() const { return shear; }
   Vec3f pointAtParameter(float t) const {
     return origin+direction*t; }
 
@@ -33,6 +53,10 @@ private:
   // REPRESENTATION
   Vec3f origin;
   Vec3f direction;
+  Vec3f invDirection;
+  int sign[3];
+  int axes[3];
+  Vec3f shear;
 };
 
 inline ostream &operator<<(ostream &os, const Ray &r) {
@@ -1,14 +1,20 @@
 #include <stdio.h>
 #include <string.h>
+#include <atomic>
+#include <exception>
+#include <algorithm>
+#include <set>
+#include <unordered_set>
 
 #include "scene_parser.h"
 #include "matrix.h"
-#include "camera.h" 
+#include "Camera.h" 
 #include "material.h"
-#include "object3d.h"
+#include "Object3D.h"
 #include "light.h"
 #include "../Primitives/Group.h"
 #include "../Primitives/Sphere.h"
+#include "../Primitives/SphereBatch.h"
 #include "../Primitives/Plane.h"
 #include "../Primitives/Triangle.h"
 #include "../Primitives/Transform.h"
@@ -30,6 +36,7 @@ SceneParser_v6::SceneParser_v6(const char* filename) {
 
     // initialize some reasonable default values
     group = NULL;
+    grid = NULL;
     camera = NULL;
     background_color = Vec3f(0.5, 0.5, 0.5);
     ambient_light = Vec3f(0, 0, 0);
@@ -38,6 +45,7 @@ SceneParser_v6::SceneParser_v6(const char* filename) {
     num_materials = 0;
     materials = NULL;
     current_material = NULL;
+    groupDepth = 0;
 
     // parse the file
     assert(filename != NULL);
@@ -45,9 +53,33 @@ SceneParser_v6::SceneParser_v6(const char* filename) {
     assert(!strcmp(ext, ".txt"));
     file = fopen(filename, "r");
     assert(file != NULL);
+    Object3D::RestartIDs();
+    prefetchMeshes(filename);
     parseFile();
+    readObjectKeys();
     fclose(file);
     file = NULL;
+    joinMeshLoaders();
+
+    // Groups of spheres are intersected several at a time. Done once
+    // the whole file is read, so the object ids stay in file order.
+    if (group != NULL) {
+        std::vector<int> spheres;
+        for (int i = 0; i < group->getNumObjects(); i++)
+            if (dynamic_cast<Sphere*>(group->getObject(i)) != NULL)
+                spheres.push_back(i);
+        BatchSpheres(group, arena);
+
+        // The spheres of the top group are one object now, which is
+        // reused only if none of them changed
+        if (!spheres.empty() && dynamic_cast<SphereBatch*>(group->getObject(spheres[0])) != NULL) {
+            for (size_t s = 1; s < spheres.size(); s++) {
+                objectKeys[spheres[0]] += '\n' + objectKeys[spheres[s]];
+                objectKeys[spheres[s]].clear();
+            }
+        }
+        objectScenes.assign(group->getNumObjects(), this);
+    }
 
     // if no lights are specified, set ambient light to white
     // (do solid color ray casting)
@@ -58,18 +90,8 @@ SceneParser_v6::SceneParser_v6(const char* filename) {
 }
 
 SceneParser_v6::~SceneParser_v6() {
-    if (group != NULL)
-        delete group;
-    if (camera != NULL)
-        delete camera;
-    int i;
-    for (i = 0; i < num_materials; i++) {
-        delete materials[i];
-    }
+    // the objects themselves go with the arena
     delete[] materials;
-    for (i = 0; i < num_lights; i++) {
-        delete lights[i];
-    }
     delete[] lights;
 }
 
@@ -125,7 +147,7 @@ void SceneParser_v6::parseOrthographicCamera() {
     getToken(token); assert(!strcmp(token, "size"));
     float size = readFloat();
     getToken(token); assert(!strcmp(token, "}"));
-    camera = new OrthographicCamera(center, direction, up, size);
+    camera = arena.create<OrthographicCamera>(center, direction, up, size);
 }
 
 
@@ -143,7 +165,7 @@ void SceneParser_v6::parsePerspectiveCamera() {
     float angle_degrees = readFloat();
     float angle_radians = DegreesToRadians(angle_degrees);
     getToken(token); assert(!strcmp(token, "}"));
-    camera = new PerspectiveCamera(center, direction, up, angle_radians);
+    camera = arena.create<PerspectiveCamera>(center, direction, up, angle_radians);
 }
 
 void SceneParser_v6::parseBackground() {
@@ -206,7 +228,7 @@ Light* SceneParser_v6::parseDirectionalLight() {
     getToken(token); assert(!strcmp(token, "color"));
     Vec3f color = readVec3f();
     getToken(token); assert(!strcmp(token, "}"));
-    return new DirectionalLight(direction, color);
+    return arena.create<DirectionalLight>(direction, color);
 }
 
 
@@ -226,7 +248,7 @@ Light* SceneParser_v6::parsePointLight() {
         getToken(token);
     }
     assert(!strcmp(token, "}"));
-    return new PointLight(position, color, att[0], att[1], att[2]);
+    return arena.create<PointLight>(position, color, att[0], att[1], att[2]);
 }
 
 // ====================================================================
@@ -303,7 +325,7 @@ Material* SceneParser_v6::parsePhongMaterial() {
             break;
         }
     }
-    Material* answer = new PhongMaterial(diffuseColor, specularColor, exponent,
+    Material* answer = arena.create<PhongMaterial>(diffuseColor, specularColor, exponent,
         reflectiveColor, transparentColor,
         indexOfRefraction);
     return answer;
@@ -315,7 +337,7 @@ Material* SceneParser_v6::parseCheckerboard(int count) {
     Matrix* matrix = NULL;
     getToken(token);
     if (!strcmp(token, "Transform")) {
-        matrix = new Matrix();
+        matrix = arena.create<Matrix>();
         matrix->SetToIdentity();
         getToken(token); assert(!strcmp(token, "{"));
         parseMatrixHelper(*matrix, token);
@@ -329,7 +351,7 @@ Material* SceneParser_v6::parseCheckerboard(int count) {
     int m2 = readInt();
     assert(m2 >= 0 && m2 < count);
     getToken(token); assert(!strcmp(token, "}"));
-    return new Checkerboard(matrix, materials[m1], materials[m2]);
+    return arena.create<Checkerboard>(matrix, materials[m1], materials[m2]);
 }
 
 
@@ -339,7 +361,7 @@ Material* SceneParser_v6::parseNoise(int count) {
     Matrix* matrix = NULL;
     getToken(token);
     if (!strcmp(token, "Transform")) {
-        matrix = new Matrix();
+        matrix = arena.create<Matrix>();
         matrix->SetToIdentity();
         getToken(token); assert(!strcmp(token, "{"));
         parseMatrixHelper(*matrix, token);
@@ -355,7 +377,7 @@ Material* SceneParser_v6::parseNoise(int count) {
     getToken(token); assert(!strcmp(token, "octaves"));
     int octaves = readInt();
     getToken(token); assert(!strcmp(token, "}"));
-    return new Noise(matrix, materials[m1], materials[m2], octaves);
+    return arena.create<Noise>(matrix, materials[m1], materials[m2], octaves);
 }
 
 Material* SceneParser_v6::parseMarble(int count) {
@@ -364,7 +386,7 @@ Material* SceneParser_v6::parseMarble(int count) {
     Matrix* matrix = NULL;
     getToken(token);
     if (!strcmp(token, "Transform")) {
-        matrix = new Matrix();
+        matrix = arena.create<Matrix>();
         matrix->SetToIdentity();
         getToken(token); assert(!strcmp(token, "{"));
         parseMatrixHelper(*matrix, token);
@@ -384,7 +406,7 @@ Material* SceneParser_v6::parseMarble(int count) {
     getToken(token); assert(!strcmp(token, "amplitude"));
     float amplitude = readFloat();
     getToken(token); assert(!strcmp(token, "}"));
-    return new Marble(matrix, materials[m1], materials[m2], octaves, frequency, amplitude);
+    return arena.create<Marble>(matrix, materials[m1], materials[m2], octaves, frequency, amplitude);
 }
 
 
@@ -394,7 +416,7 @@ Material* SceneParser_v6::parseWood(int count) {
     Matrix* matrix = NULL;
     getToken(token);
     if (!strcmp(token, "Transform")) {
-        matrix = new Matrix();
+        matrix = arena.create<Matrix>();
         matrix->SetToIdentity();
         getToken(token); assert(!strcmp(token, "{"));
         parseMatrixHelper(*matrix, token);
@@ -414,7 +436,7 @@ Material* SceneParser_v6::parseWood(int count) {
     getToken(token); assert(!strcmp(token, "amplitude"));
     float amplitude = readFloat();
     getToken(token); assert(!strcmp(token, "}"));
-    return new Wood(matrix, materials[m1], materials[m2], octaves, frequency, amplitude);
+    return arena.create<Wood>(matrix, materials[m1], materials[m2], octaves, frequency, amplitude);
 }
 
 
@@ -467,11 +489,13 @@ Group* SceneParser_v6::parseGroup() {
     getToken(token); assert(!strcmp(token, "numObjects"));
     int num_objects = readInt();
 
-    Group* answer = new Group(num_objects);
+    Group* answer = arena.create<Group>(num_objects);
+    groupDepth++;
 
     // read in the objects
     int count = 0;
     while (num_objects > count) {
+        long begin = (groupDepth == 1) ? ftell(file) : 0;
         getToken(token);
         if (!strcmp(token, "MaterialIndex")) {
             // change the current material
@@ -480,13 +504,24 @@ Group* SceneParser_v6::parseGroup() {
             current_material = getMaterial(index);
         }
         else {
+            // the text of the objects of the top group is read again
+            // once the file is parsed, see readObjectKeys
+            if (groupDepth == 1) {
+                int index = 0;
+                while (index < num_materials && materials[index] != current_material)
+                    index++;
+                objectKeys.push_back("MaterialIndex " + std::to_string(index));
+            }
             Object3D* object = parseObject(token);
             assert(object != NULL);
             answer->addObject(count, object);
             count++;
+            if (groupDepth == 1)
+                objectSpans.push_back(std::make_pair(begin, ftell(file)));
         }
     }
     getToken(token); assert(!strcmp(token, "}"));
+    groupDepth--;
 
     // return the group
     return answer;
@@ -504,7 +539,7 @@ Sphere* SceneParser_v6::parseSphere() {
     float radius = readFloat();
     getToken(token); assert(!strcmp(token, "}"));
     assert(current_material != NULL);
-    return new Sphere(center, radius, current_material);
+    return arena.create<Sphere>(center, radius, current_material);
 }
 
 
@@ -517,7 +552,7 @@ Plane* SceneParser_v6::parsePlane() {
     float offset = readFloat();
     getToken(token); assert(!strcmp(token, "}"));
     assert(current_material != NULL);
-    return new Plane(normal, offset, current_material);
+    return arena.create<Plane>(normal, offset, current_material);
 }
 
 
@@ -535,83 +570,237 @@ Triangle* SceneParser_v6::parseTriangle() {
     Vec3f v2 = readVec3f();
     getToken(token); assert(!strcmp(token, "}"));
     assert(current_material != NULL);
-    return new Triangle(v0, v1, v2, current_material);
-}
-
-Group* SceneParser_v6::parseTriangleMesh() {
-
-    char token[MAX_PARSER_TOKEN_LENGTH];
-    char filename[MAX_PARSER_TOKEN_LENGTH];
-    // get the filename
-    getToken(token); assert(!strcmp(token, "{"));
-    getToken(token); assert(!strcmp(token, "obj_file"));
-    getToken(filename);
-    getToken(token); assert(!strcmp(token, "}"));
-    const char* ext = &filename[strlen(filename) - 4];
-    assert(!strcmp(ext, ".obj"));
-    // read it once, get counts
-    char filepath[MAX_PARSER_TOKEN_LENGTH] = "./resource/mesh/";
-    strcat(filepath, filename);
-
-    FILE* file = fopen(filepath, "r");
-    assert(file != NULL);
-    int vcount = 0; int fcount = 0;
-    while (1) {
-        int c = fgetc(file);
-        if (c == EOF) {
-            break;
-        }
-        else if (c == 'v') {
-            assert(fcount == 0); float v0, v1, v2;
-            fscanf(file, "%f %f %f", &v0, &v1, &v2);
-            vcount++;
-        }
-        else if (c == 'f') {
-            int f0, f1, f2;
-            fscanf(file, "%d %d %d", &f0, &f1, &f2);
-            fcount++;
-        } // otherwise, must be whitespace
-    }
-    fclose(file);
-    // make arrays
-    Vec3f* verts = new Vec3f[vcount];
-    Group* answer = new Group(fcount);
-    // read it again, save it
-    file = fopen(filepath, "r");
-    assert(file != NULL);
-    int new_vcount = 0; int new_fcount = 0;
+    return arena.create<Triangle>(v0, v1, v2, current_material);
+}
+
+// Reads ./resource/mesh/filename. Runs on the mesh loader threads, so
+// it only touches its own result.
+static ObjMesh LoadObjMesh(const char* filename) {
+    ObjMesh mesh;
+    std::string filepath = std::string("./resource/mesh/") + filename;
+    FILE* file = fopen(filepath.c_str(), "r");
+    if (file == NULL)
+        return mesh;
+    mesh.found = true;
     while (1) {
         int c = fgetc(file);
         if (c == EOF) {
             break;
         }
         else if (c == 'v') {
-            assert(new_fcount == 0); float v0, v1, v2;
+            assert(mesh.faces.empty()); float v0, v1, v2;
             fscanf(file, "%f %f %f", &v0, &v1, &v2);
-            verts[new_vcount] = Vec3f(v0, v1, v2);
-            new_vcount++;
+            mesh.vertices.push_back(Vec3f(v0, v1, v2));
         }
         else if (c == 'f') {
-            assert(vcount == new_vcount);
             int f0, f1, f2;
             fscanf(file, "%d %d %d", &f0, &f1, &f2);
-            // indexed starting at 1...
-            assert(f0 > 0 && f0 <= vcount);
-            assert(f1 > 0 && f1 <= vcount);
-            assert(f2 > 0 && f2 <= vcount);
-            assert(current_material != NULL);
-            Triangle* t = new Triangle(verts[f0 - 1], verts[f1 - 1], verts[f2 - 1], current_material);
-            answer->addObject(new_fcount, t);
-            new_fcount++;
+            mesh.faces.push_back(f0);
+            mesh.faces.push_back(f1);
+            mesh.faces.push_back(f2);
         } // otherwise, must be whitespace
     }
-    delete[] verts;
-    assert(fcount == new_fcount);
-    assert(vcount == new_vcount);
     fclose(file);
+    return mesh;
+}
+
+Group* SceneParser_v6::parseTriangleMesh() {
+
+    char token[MAX_PARSER_TOKEN_LENGTH];
+    char filename[MAX_PARSER_TOKEN_LENGTH];
+    // get the filename
+    getToken(token); assert(!strcmp(token, "{"));
+    getToken(token); assert(!strcmp(token, "obj_file"));
+    getToken(filename);
+    getToken(token); assert(!strcmp(token, "}"));
+    const char* ext = &filename[strlen(filename) - 4];
+    assert(!strcmp(ext, ".obj"));
+    // the same mesh with the same material is shared, not loaded again
+    std::pair<std::string, Material*> key(filename, current_material);
+    auto loaded = meshes.find(key);
+    if (loaded != meshes.end()) {
+        loaded->second->setShared(true);
+        return loaded->second;
+    }
+    // normally started by prefetchMeshes, and maybe done by now
+    auto pending = meshFiles.find(filename);
+    if (pending == meshFiles.end()) {
+        std::promise<ObjMesh> now;
+        now.set_value(LoadObjMesh(filename));
+        pending = meshFiles.insert({ filename, now.get_future().share() }).first;
+    }
+    const ObjMesh& mesh = pending->second.get();
+    assert(mesh.found);
+
+    int fcount = (int)mesh.faces.size() / 3;
+    Group* answer = arena.create<Group>(fcount);
+    for (int i = 0; i < fcount; i++) {
+        int f0 = mesh.faces[3 * i], f1 = mesh.faces[3 * i + 1], f2 = mesh.faces[3 * i + 2];
+        // indexed starting at 1...
+        assert(f0 > 0 && f0 <= (int)mesh.vertices.size());
+        assert(f1 > 0 && f1 <= (int)mesh.vertices.size());
+        assert(f2 > 0 && f2 <= (int)mesh.vertices.size());
+        assert(current_material != NULL);
+        Vec3f v0 = mesh.vertices[f0 - 1], v1 = mesh.vertices[f1 - 1], v2 = mesh.vertices[f2 - 1];
+        answer->addObject(i, arena.create<Triangle>(v0, v1, v2, current_material));
+    }
+    meshes[key] = answer;
     return answer;
 }
 
+void SceneParser_v6::prefetchMeshes(const char* filename) {
+    // the obj files named in the scene, each once
+    std::vector<std::string> files;
+    char token[MAX_PARSER_TOKEN_LENGTH];
+    // "%99s ", at most a token's length without the terminating zero
+    char format[16];
+    snprintf(format, sizeof(format), "%%%ds ", MAX_PARSER_TOKEN_LENGTH - 1);
+    bool objFile = false;
+    FILE* scan = fopen(filename, "r");
+    assert(scan != NULL);
+    while (fscanf(scan, format, token) == 1) {
+        if (objFile && meshFiles.find(token) == meshFiles.end()) {
+            files.push_back(token);
+            meshFiles[token];
+        }
+        objFile = !strcmp(token, "obj_file");
+    }
+    fclose(scan);
+    if (files.empty())
+        return;
+
+    // a few loader threads take the files in scene order
+    auto results = std::make_shared<std::vector<std::promise<ObjMesh>>>(files.size());
+    auto next = std::make_shared<std::atomic<int>>(0);
+    for (size_t i = 0; i < files.size(); i++)
+        meshFiles[files[i]] = (*results)[i].get_future().share();
+    int threads = (int)(std::min)((size_t)(std::max)(1u, std::thread::hardware_concurrency()), files.size());
+    for (int t = 0; t < threads; t++) {
+        meshLoaders.emplace_back([files, results, next]() {
+            for (int i = (*next)++; i < (int)files.size(); i = (*next)++) {
+                // parseTriangleMesh rethrows it on the parsing thread
+                try {
+                    (*results)[i].set_value(LoadObjMesh(files[i].c_str()));
+                }
+                catch (...) {
+                    (*results)[i].set_exception(std::current_exception());
+                }
+            }
+        });
+    }
+}
+
+void SceneParser_v6::joinMeshLoaders() {
+    for (std::thread& loader : meshLoaders)
+        loader.join();
+    meshLoaders.clear();
+    meshFiles.clear();
+}
+
+void SceneParser_v6::readObjectKeys() {
+    char token[MAX_PARSER_TOKEN_LENGTH];
+    for (size_t i = 0; i < objectSpans.size(); i++) {
+        fseek(file, objectSpans[i].first, SEEK_SET);
+        while (ftell(file) < objectSpans[i].second && getToken(token)) {
+            objectKeys[i] += ' ';
+            objectKeys[i] += token;
+        }
+    }
+    objectSpans.clear();
+}
+
+// Points the primitives below object at the materials of the new parse
+static void RemapMaterials(Object3D* object, const std::map<Material*, Material*>& remap,
+    std::unordered_set<Object3D*>& visited) {
+    if (object == NULL || !visited.insert(object).second)
+        return;
+    if (Group* group = dynamic_cast<Group*>(object)) {
+        for (int i = 0; i < group->getNumObjects(); i++)
+            RemapMaterials(group->getObject(i), remap, visited);
+        return;
+    }
+    if (Transform* transform = dynamic_cast<Transform*>(object)) {
+        RemapMaterials(transform->getObject(), remap, visited);
+        return;
+    }
+    if (SphereBatch* batch = dynamic_cast<SphereBatch*>(object)) {
+        for (int i = 0; i < batch->getNumSpheres(); i++)
+            RemapMaterials(batch->getSphere(i), remap, visited);
+    }
+    auto found = remap.find(object->mat);
+    if (found != remap.end())
+        object->mat = found->second;
+}
+
+// Gives the objects below to the ids of those below from, parsed from
+// the same text, so a reused object keeps the id a fresh parse gives it
+static void CopyIDs(Object3D* from, Object3D* to, std::unordered_set<Object3D*>& visited) {
+    if (from == NULL || to == NULL || !visited.insert(to).second)
+        return;
+    to->setID(from->getID());
+    Group* fromGroup = dynamic_cast<Group*>(from);
+    Group* toGroup = dynamic_cast<Group*>(to);
+    if (fromGroup != NULL && toGroup != NULL && fromGroup->getNumObjects() == toGroup->getNumObjects()) {
+        for (int i = 0; i < toGroup->getNumObjects(); i++)
+            CopyIDs(fromGroup->getObject(i), toGroup->getObject(i), visited);
+    }
+    Transform* fromTransform = dynamic_cast<Transform*>(from);
+    Transform* toTransform = dynamic_cast<Transform*>(to);
+    if (fromTransform != NULL && toTransform != NULL)
+        CopyIDs(fromTransform->getObject(), toTransform->getObject(), visited);
+    SphereBatch* fromBatch = dynamic_cast<SphereBatch*>(from);
+    SphereBatch* toBatch = dynamic_cast<SphereBatch*>(to);
+    if (fromBatch != NULL && toBatch != NULL && fromBatch->getNumSpheres() == toBatch->getNumSpheres()) {
+        for (int i = 0; i < toBatch->getNumSpheres(); i++)
+            CopyIDs(fromBatch->getSphere(i), toBatch->getSphere(i), visited);
+    }
+}
+
+std::vector<int> SceneParser_v6::reuse(SceneParser_v6* loaded) {
+    std::unique_ptr<SceneParser_v6> previous(loaded);
+    std::vector<int> owners(loaded->objectKeys.size(), -1);
+    if (group == NULL || loaded->group == NULL)
+        return owners;
+
+    // The same text is the same object, the first unused one is taken
+    std::multimap<std::string, int> unused;
+    for (int j = 0; j < loaded->group->getNumObjects(); j++)
+        if (loaded->group->getObject(j) != NULL)
+            unused.insert(std::make_pair(loaded->objectKeys[j], j));
+
+    std::map<Material*, Material*> remap;
+    for (int k = 0; k < loaded->num_materials && k < num_materials; k++)
+        remap[loaded->materials[k]] = materials[k];
+
+    std::unordered_set<Object3D*> visited;
+    std::unordered_set<Object3D*> numbered;
+    for (int i = 0; i < group->getNumObjects(); i++) {
+        if (group->getObject(i) == NULL)
+            continue;
+        auto found = unused.find(objectKeys[i]);
+        if (found == unused.end())
+            continue;
+        int j = found->second;
+        unused.erase(found);
+        owners[j] = i;
+        CopyIDs(group->getObject(i), loaded->group->getObject(j), numbered);
+        group->replaceObject(i, loaded->group->getObject(j));
+        objectScenes[i] = loaded->objectScenes[j];
+        RemapMaterials(group->getObject(i), remap, visited);
+    }
+    group->updateBoundingBox();
+
+    // Only the scenes that objects are taken from stay
+    std::set<SceneParser_v6*> used(objectScenes.begin(), objectScenes.end());
+    for (std::unique_ptr<SceneParser_v6>& kept : loaded->keptScenes)
+        if (used.count(kept.get()) != 0)
+            keptScenes.push_back(std::move(kept));
+    loaded->keptScenes.clear();
+    if (used.count(loaded) != 0)
+        keptScenes.push_back(std::move(previous));
+    return owners;
+}
+
 
 Transform* SceneParser_v6::parseTransform() {
     char token[MAX_PARSER_TOKEN_LENGTH];
@@ -625,7 +814,7 @@ Transform* SceneParser_v6::parseTransform() {
     assert(object != NULL);
     // closing brace
     getToken(token); assert(!strcmp(token, "}"));
-    return new Transform(matrix, object);
+    return arena.create<Transform>(matrix, object);
 }
 
 void SceneParser_v6::parseMatrixHelper(Matrix& matrix, char token[MAX_PARSER_TOKEN_LENGTH]) {
@@ -3,6 +3,13 @@
 
 #include "vectors.h"
 #include <assert.h>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+#include <future>
+#include <thread>
+#include "SceneArena.h"
 
 #pragma warning(disable:4996)
 
@@ -19,6 +26,15 @@ class Grid;
 
 #define MAX_PARSER_TOKEN_LENGTH 100
 
+// The contents of an obj file: its vertices and three vertex indices
+// (from 1) per face
+struct ObjMesh
+{
+    bool found = false;
+    std::vector<Vec3f> vertices;
+    std::vector<int> faces;
+};
+
 
 // ====================================================================
 // ====================================================================
@@ -48,6 +64,21 @@ public:
     Group* getGroup() const { return group; }
     Grid* grid;
 
+    // Owns every object, material, light and matrix of the scene, they
+    // are all freed with the parser. Objects made later for this scene
+    // (by TransformCollapse) go here as well.
+    SceneArena& getArena() { return arena; }
+
+    // For a reload: loaded is a parse of the same file before it was
+    // edited. The objects of the top group whose text did not change
+    // (whitespace aside, obj files go by name) are taken over from it,
+    // with the materials and object ids of this parse, so everything
+    // else comes from the new file and only the edited objects are new.
+    // Returns for every object of loaded's top group its index in this
+    // one, -1 if it is gone. loaded is deleted, or kept while objects of
+    // it are used.
+    std::vector<int> reuse(SceneParser_v6* loaded);
+
 private:
 
     SceneParser_v6() { assert(0); } // don't use
@@ -76,6 +107,15 @@ private:
     Transform* parseTransform();
     void parseMatrixHelper(Matrix& matrix, char token[MAX_PARSER_TOKEN_LENGTH]);
 
+    // Starts reading every obj file the scene names on loader threads,
+    // so they load together and while the rest of the scene is parsed.
+    // parseTriangleMesh then waits only for the file it needs.
+    void prefetchMeshes(const char* filename);
+    void joinMeshLoaders();
+
+    // Fills objectKeys from the spans of the file recorded by parseGroup
+    void readObjectKeys();
+
     // HELPER FUNCTIONS
     int getToken(char token[MAX_PARSER_TOKEN_LENGTH]);
     Vec3f readVec3f();
@@ -95,6 +135,26 @@ private:
     Material** materials;
     Material* current_material;
     Group* group;
+
+    // Meshes loaded so far, by obj file and material. Placing the same
+    // mesh again reuses its triangles instead of loading a copy.
+    std::map<std::pair<std::string, Material*>, Group*> meshes;
+
+    // The obj files being read, by name, until the parse is done
+    std::map<std::string, std::shared_future<ObjMesh>> meshFiles;
+    std::vector<std::thread> meshLoaders;
+
+    // Every object of the top group as its material index and tokens,
+    // what reuse compares. objectSpans are where they are in the file.
+    int groupDepth;
+    std::vector<std::pair<long, long>> objectSpans;
+    std::vector<std::string> objectKeys;
+    // The scene each object of the top group was parsed by, this one or
+    // one of keptScenes, which are only here for those objects
+    std::vector<SceneParser_v6*> objectScenes;
+    std::vector<std::unique_ptr<SceneParser_v6>> keptScenes;
+
+    SceneArena arena;
 };
 
 // ====================================================================
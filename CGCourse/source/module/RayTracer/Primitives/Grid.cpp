@@ -1,17 +1,295 @@
 #include "Grid.h"
 #include <Windows.h>
-#include <gl/GL.h>
+#include <GL/gl.h>
 
 #include <RayTracer/Core/RayTree.h>
 #include <RayTracer/Core/RayTracingStas.h>
 #include <RayTracer/Primitives/Transform.h>
+#include <RayTracer/Primitives/Group.h>
 #include <RayTracer/Primitives/Plane.h>
+#include <RayTracer/Primitives/Sphere.h>
+#include <RayTracer/Primitives/SphereBatch.h>
+#include <RayTracer/Primitives/Triangle.h>
+#include <algorithm>
+#include <unordered_set>
+#include <float.h>
+#include <math.h>
+
+static PrimitiveType TypeOf(Object3D* object)
+{
+	if (dynamic_cast<SphereBatch*>(object) != nullptr)
+		return PrimitiveSphereBatch;
+	if (dynamic_cast<Sphere*>(object) != nullptr)
+		return PrimitiveSphere;
+	if (dynamic_cast<Triangle*>(object) != nullptr)
+		return PrimitiveTriangle;
+	if (dynamic_cast<Plane*>(object) != nullptr)
+		return PrimitivePlane;
+	if (dynamic_cast<Grid*>(object) != nullptr)
+		return PrimitiveLocalGrid;
+	return PrimitiveOther;
+}
+
+// Qualified calls, so the compiler calls the function directly
+static inline bool IntersectPrimitive(PrimitiveType type, Object3D* object, const Ray& r, Hit& h, float tmin)
+{
+	switch (type)
+	{
+	case PrimitiveSphereBatch:
+		return static_cast<SphereBatch*>(object)->SphereBatch::intersect(r, h, tmin);
+	case PrimitiveSphere:
+		return static_cast<Sphere*>(object)->Sphere::intersect(r, h, tmin);
+	case PrimitiveTriangle:
+		return static_cast<Triangle*>(object)->Triangle::intersect(r, h, tmin);
+	case PrimitivePlane:
+		return static_cast<Plane*>(object)->Plane::intersect(r, h, tmin);
+	case PrimitiveLocalGrid:
+		return static_cast<Grid*>(object)->Grid::intersect(r, h, tmin);
+	default:
+		return object->intersect(r, h, tmin);
+	}
+}
 
 void Grid::InsertPlane(DrawItem& plane)
 {
+	plane.instance = GetInstance(plane.matrix);
+	plane.type = TypeOf(plane.object);
+	plane.owner = insertOwner;
 	planes.emplace_back(plane);
 }
 
+Matrix* Grid::AddMatrix(const Matrix& m)
+{
+	instances.emplace_back();
+	GridInstance& instance = instances.back();
+	instance.matrix = m;
+	m.Inverse(instance.inverse);
+	instance.inverse.Transpose(instance.invTranspose);
+	instanceOf[&instance.matrix] = &instance;
+	return &instance.matrix;
+}
+
+void Grid::InsertInstance(Object3D* object, Matrix* m)
+{
+	BoundingBox* box = object->getBoundingBox();
+	if (box == nullptr)
+	{
+		object->insertIntoGrid(this, m);
+		return;
+	}
+
+	Grid*& local = localGrids[object];
+	if (local == nullptr)
+	{
+		local = new Grid(*box, mX, mY, mZ);
+		object->insertIntoGrid(local, nullptr);
+	}
+
+	// World bounds of the placed box
+	Vec3f lo = box->getMin(), hi = box->getMax();
+	Vec3f worldMin(FLT_MAX, FLT_MAX, FLT_MAX), worldMax(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+	for (int c = 0; c < 8; c++)
+	{
+		Vec3f corner((c & 1) ? hi.x() : lo.x(), (c & 2) ? hi.y() : lo.y(), (c & 4) ? hi.z() : lo.z());
+		m->Transform(corner);
+		Vec3f::Min(worldMin, worldMin, corner);
+		Vec3f::Max(worldMax, worldMax, corner);
+	}
+
+	auto cellRange = [](float a, float b, float start, float step, int n, int& first, int& last) {
+		first = (std::max)(0, (int)floor((a - start) / step));
+		last = (std::min)(n - 1, (int)floor((b - start) / step));
+	};
+	GridInstance* instance = instanceOf[m];
+	instance->bounded = true;
+	instance->worldMin = worldMin;
+	instance->worldMax = worldMax;
+
+	int x0, x1, y0, y1, z0, z1;
+	cellRange(worldMin.x(), worldMax.x(), startX, stepX, mX, x0, x1);
+	cellRange(worldMin.y(), worldMax.y(), startY, stepY, mY, y0, y1);
+	cellRange(worldMin.z(), worldMax.z(), startZ, stepZ, mZ, z0, z1);
+	for (int i = x0; i <= x1; i++)
+		for (int j = y0; j <= y1; j++)
+			for (int k = z0; k <= z1; k++)
+			{
+				SetVoxelState(i, j, k, true);
+				DrawItem item = { local, m };
+				InsertVoxelItem(i, j, k, item);
+			}
+}
+
+void Grid::InsertObjects(Group* group, const std::vector<bool>* which)
+{
+	int num = group->getNumObjects();
+	for (int i = 0; i < num; i++)
+	{
+		if (i % 1000 == 0)
+		{
+			std::cout << i * 100.0 / num << "%" << std::endl;
+		}
+		if (group->getObject(i) != NULL && (which == nullptr || (*which)[i]))
+		{
+			SetOwner(i);
+			group->getObject(i)->insertIntoGrid(this, nullptr);
+		}
+	}
+	SetOwner(0);
+}
+
+void Grid::Reassign(const std::vector<int>& owners)
+{
+	int cells = mX * mY * mZ;
+	if (packed)
+	{
+		for (int c = 0; c < cells; c++)
+			VoxelS[c].Items.assign(cellItems.begin() + cellStart[c], cellItems.begin() + cellStart[c + 1]);
+		std::vector<DrawItem>().swap(cellItems);
+		packed = false;
+	}
+
+	auto reassign = [&owners](std::vector<DrawItem>& items) {
+		for (DrawItem& item : items)
+		{
+			assert(item.owner >= 0 && item.owner < (int)owners.size());
+			item.owner = owners[item.owner];
+		}
+		items.erase(std::remove_if(items.begin(), items.end(),
+			[](const DrawItem& item) { return item.owner < 0; }), items.end());
+	};
+	reassign(planes);
+	for (int c = 0; c < cells; c++)
+	{
+		reassign(VoxelS[c].Items);
+		VoxelS[c].IsOpaque = !VoxelS[c].Items.empty();
+	}
+
+	// Only compared, the objects of dropped items may be gone already
+	std::unordered_set<const Object3D*> used;
+	for (const DrawItem& item : planes)
+		used.insert(item.object);
+	for (int c = 0; c < cells; c++)
+		for (const DrawItem& item : VoxelS[c].Items)
+			used.insert(item.object);
+	for (auto local = localGrids.begin(); local != localGrids.end();)
+	{
+		if (used.count(local->second) == 0)
+		{
+			delete local->second;
+			local = localGrids.erase(local);
+		}
+		else
+			++local;
+	}
+	batches.erase(std::remove_if(batches.begin(), batches.end(),
+		[&used](const std::unique_ptr<SphereBatch>& batch) { return used.count(batch.get()) == 0; }), batches.end());
+}
+
+int Grid::BatchSpheres()
+{
+	int made = 0;
+	for (auto& local : localGrids)
+		made += local.second->BatchSpheres();
+
+	for (int c = 0; c < mX * mY * mZ; c++)
+	{
+		std::vector<DrawItem>& items = VoxelS[c].Items;
+
+		// The spheres of the cell by matrix and owner, usually there is
+		// just one
+		struct SphereGroup
+		{
+			Matrix* matrix;
+			int owner;
+			std::vector<Sphere*> spheres;
+		};
+		std::vector<SphereGroup> groups;
+		auto groupOf = [&groups](const DrawItem& item) {
+			size_t g = 0;
+			while (g < groups.size() && (groups[g].matrix != item.matrix || groups[g].owner != item.owner))
+				g++;
+			return g;
+		};
+		for (const DrawItem& item : items)
+		{
+			Sphere* sphere = dynamic_cast<Sphere*>(item.object);
+			if (sphere == nullptr)
+				continue;
+			size_t g = groupOf(item);
+			if (g == groups.size())
+				groups.push_back({ item.matrix, item.owner, {} });
+			groups[g].spheres.push_back(sphere);
+		}
+
+		bool any = false;
+		for (auto& group : groups)
+			any = any || (int)group.spheres.size() >= SphereBatch::MinSpheres;
+		if (!any)
+			continue;
+
+		// The batch takes the place of the first of its spheres
+		std::vector<DrawItem> batched;
+		for (const DrawItem& item : items)
+		{
+			if (dynamic_cast<Sphere*>(item.object) == nullptr)
+			{
+				batched.push_back(item);
+				continue;
+			}
+			std::vector<Sphere*>& spheres = groups[groupOf(item)].spheres;
+			if ((int)spheres.size() < SphereBatch::MinSpheres)
+				batched.push_back(item);
+			else if (spheres.front() == item.object)
+			{
+				batches.emplace_back(new SphereBatch(spheres));
+				DrawItem batch = { batches.back().get(), item.matrix, item.instance, PrimitiveSphereBatch, item.owner };
+				batched.push_back(batch);
+				made++;
+			}
+		}
+		items.swap(batched);
+	}
+	return made;
+}
+
+void Grid::Pack()
+{
+	for (auto& local : localGrids)
+		if (!local.second->packed)
+			local.second->Pack();
+
+	int cells = mX * mY * mZ;
+	size_t total = 0;
+	for (int c = 0; c < cells; c++)
+		total += VoxelS[c].Items.size();
+
+	cellItems.clear();
+	cellItems.reserve(total);
+	cellStart.resize(cells + 1);
+	for (int c = 0; c < cells; c++)
+	{
+		cellStart[c] = (int)cellItems.size();
+		std::vector<DrawItem>& items = VoxelS[c].Items;
+		// Runs of one type keep the switch predictable, the order
+		// within a type stays the insertion order
+		std::stable_sort(items.begin(), items.end(),
+			[](const DrawItem& a, const DrawItem& b) { return a.type < b.type; });
+		cellItems.insert(cellItems.end(), items.begin(), items.end());
+		std::vector<DrawItem>().swap(items);
+	}
+	cellStart[cells] = (int)cellItems.size();
+	packed = true;
+}
+
+const GridInstance* Grid::GetInstance(const Matrix* m) const
+{
+	if (m == nullptr)
+		return nullptr;
+	auto found = instanceOf.find(m);
+	assert(found != instanceOf.end());
+	return found->second;
+}
+
 bool MarchingInfo::nextCell(int& surface)
 {
 	RayTracingStats::IncrementNumGridCellsTraversed();
@@ -84,18 +362,19 @@ Material* GetMaterial(int i)
 		return &materials[16];
 }
 
-Grid::Grid(BoundingBox* bb, int nx, int ny, int nz)
-	: mBoundingBox(bb), mX(nx), mY(ny), mZ(nz)
+Grid::Grid(const BoundingBox& bb, int nx, int ny, int nz)
+	: mX(nx), mY(ny), mZ(nz)
 {
 	VoxelS = new Voxel[nx * ny * nz];
+	setBoundingBox(bb.getMin(), bb.getMax());
 
-	startX = bb->getMin().x();
-	startY = bb->getMin().y();
-	startZ = bb->getMin().z();
+	startX = boundingBox.getMin().x();
+	startY = boundingBox.getMin().y();
+	startZ = boundingBox.getMin().z();
 
-	stepX = (bb->getMax().x() - startX) / mX;
-	stepY = (bb->getMax().y() - startY) / mY;
-	stepZ = (bb->getMax().z() - startZ) / mZ;
+	stepX = (boundingBox.getMax().x() - startX) / mX;
+	stepY = (boundingBox.getMax().y() - startY) / mY;
+	stepZ = (boundingBox.getMax().z() - startZ) / mZ;
 
 	for (int i = 0; i < mX; i++)
 		for (int j = 0; j < mY; j++)
@@ -108,6 +387,8 @@ Grid::Grid(BoundingBox* bb, int nx, int ny, int nz)
 Grid::~Grid()
 {
 	delete[] VoxelS;
+	for (auto& local : localGrids)
+		delete local.second;
 }
 
 Vec3f GridNormals[] =
@@ -122,17 +403,36 @@ Vec3f GridNormals[] =
 
 void intersectDrawItem(DrawItem& item, const Ray& r, Hit& h, float tmin, bool& firstIntersected, bool& onceIntersected, float tbmax)
 {
-	Object3D* object = item.object;
-	if (item.matrix != nullptr)
-		object = new Transform(*item.matrix, item.object);
-	if (object->intersect(r, h, tmin))
+	bool intersected;
+	float tnear = tmin, tfar = h.getT();
+	if (item.instance != nullptr && item.instance->bounded &&
+		!IntersectSlabs(r, item.instance->worldMin, item.instance->worldMax, tnear, tfar))
+	{
+		intersected = false;
+	}
+	else if (item.instance != nullptr)
+	{
+		PrimitiveType type = item.type;
+		Object3D* object = item.object;
+		intersected = Transform::IntersectTransformed(item.instance->inverse, item.instance->invTranspose, r, h, tmin,
+			[type, object](const Ray& osr, Hit& hit, float t) { return IntersectPrimitive(type, object, osr, hit, t); });
+		// Keep the primitive hit inside a local grid, unless it has a
+		// matrix of its own, then the whole placed local grid is recorded
+		if (intersected && (h.getObject() == nullptr || h.getObjectMatrix() != nullptr))
+			h.setObject(item.object, item.matrix);
+		else if (intersected)
+			h.setObject(h.getObject(), item.matrix);
+	}
+	else
+	{
+		intersected = IntersectPrimitive(item.type, item.object, r, h, tmin);
+	}
+	if (intersected)
 	{
 		onceIntersected = true;
 		if (h.getT() < tbmax)
 			firstIntersected = true;
 	}
-	if (item.matrix != nullptr)
-		delete object;
 }
 
 bool Grid::intersect(const Ray& r, Hit& h, float tmin)
@@ -158,22 +458,15 @@ bool Grid::intersect(const Ray& r, Hit& h, float tmin)
 
 	int surface = -1;
 	int index = 0;
+	DrawItem* begin;
+	DrawItem* end;
 
 	if (GetVoxelState(mi.i, mi.j, mi.k))
 	{
-		std::vector<DrawItem>& items = Grid::GetVoxelItems(mi.i, mi.j, mi.k);
-		for (int i = 0; i < items.size(); i++)
+		getCellItems(mi.i * mY * mZ + mi.j * mZ + mi.k, begin, end);
+		for (DrawItem* item = begin; item != end; item++)
 		{
-			Object3D* object = items[i].object;
-			if (items[i].matrix != nullptr)
-				object = new Transform(*items[i].matrix, items[i].object);
-			if (object->intersect(r, h, tmin))
-			{
-				onceIntersected = true;
-				firstIntersected = true;
-			}
-			if (items[i].matrix != nullptr)
-				delete object;
+			intersectDrawItem(*item, r, h, tmin, firstIntersected, onceIntersected, 9999999);
 		}
 	}
 	
@@ -185,10 +478,10 @@ bool Grid::intersect(const Ray& r, Hit& h, float tmin)
 
 		if (GetVoxelState(mi.i, mi.j, mi.k))
 		{
-			std::vector<DrawItem>& items = Grid::GetVoxelItems(mi.i, mi.j, mi.k);
-			for (int i = 0; i < items.size(); i++)
+			getCellItems(mi.i * mY * mZ + mi.j * mZ + mi.k, begin, end);
+			for (DrawItem* item = begin; item != end; item++)
 			{
-				intersectDrawItem(items[i], r, h, tmin, firstIntersected, onceIntersected, mi.gridBegin + mi.GetMinTNext());
+				intersectDrawItem(*item, r, h, tmin, firstIntersected, onceIntersected, mi.gridBegin + mi.GetMinTNext());
 			}
 		}
 	}
@@ -287,9 +580,18 @@ Vec3f Grid::GetVoxelCenter(int x, int y, int z)
 		startZ + stepZ * (z + 0.5));
 }
 
-std::vector<DrawItem>& Grid::GetVoxelItems(int x, int y, int z)
+void Grid::getCellItems(int c, DrawItem*& begin, DrawItem*& end)
 {
-	return VoxelS[x * mY * mZ + y * mZ + z].Items;
+	if (packed)
+	{
+		begin = cellItems.data() + cellStart[c];
+		end = cellItems.data() + cellStart[c + 1];
+	}
+	else
+	{
+		begin = VoxelS[c].Items.data();
+		end = begin + VoxelS[c].Items.size();
+	}
 }
 
 Vec3f Grid::GetVoxelSizeHalf()
@@ -304,6 +606,9 @@ void Grid::SetVoxelState(int x, int y, int z, bool state)
 
 void Grid::InsertVoxelItem(int x, int y, int z, DrawItem& item)
 {
+	item.instance = GetInstance(item.matrix);
+	item.type = TypeOf(item.object);
+	item.owner = insertOwner;
 	VoxelS[x * mY * mZ + y * mZ + z].Items.emplace_back(item);
 }
 
@@ -461,281 +766,127 @@ bool Between(const Vec3f& min, const Vec3f& max, const Vec3f& value)
 		return false;
 }
 
-bool Intersect(const Ray& ray, const Vec3f& min, const Vec3f& max)
+// Distance along the ray to the next cell boundary, infinite when the
+// ray runs parallel to it (0 * inf)
+static float NextCrossing(float distance, float invDirection)
 {
-	Vec3f hitPoint;
-	const Vec3f& origin = ray.getOrigin(); 
-	const Vec3f& dir = ray.getDirection(); 
-
-	float t;
-
-	float ox = origin.x(); float oy = origin.y(); float oz = origin.z();
-	float dx = dir.x(); float dy = dir.y(); float dz = dir.z();
-	float tx_min, ty_min, tz_min;
-	float tx_max, ty_max, tz_max;
-
-	if (abs(dx) < 0.000001f)
-	{
-		if (ox < min.x() || ox > max.x())
-			return false;
-		else
-			return true;
-	}
-	else
-	{
-		if (dx >= 0)
-		{
-			tx_min = (min.x() - ox) / dx;
-			tx_max = (max.x() - ox) / dx;
-		}
-		else
-		{
-			tx_min = (max.x() - ox) / dx;
-			tx_max = (min.x() - ox) / dx;
-		}
-
-	}
-
-	if (abs(dy) < 0.000001f)
-	{
-		if (oy < min.y() || oy > max.y())
-			return false;
-		else
-			return true;
-	}
-	else
-	{
-		if (dy >= 0)
-		{
-			ty_min = (min.y() - oy) / dy;
-			ty_max = (max.y() - oy) / dy;
-		}
-		else
-		{
-			ty_min = (max.y() - oy) / dy;
-			ty_max = (min.y() - oy) / dy;
-		}
-
-	}
-
-	if (abs(dz) < 0.000001f)
-	{
-		if (oz < min.z() || oz > max.z())
-			return false;
-		else
-			return true;
-	}
-	else
-	{
-		if (dz >= 0)
-		{
-			tz_min = (min.z() - oz) / dz;
-			tz_max = (max.z() - oz) / dz;
-		}
-		else
-		{
-			tz_min = (max.z() - oz) / dz;
-			tz_max = (min.z() - oz) / dz;
-		}
-
-	}
-
-	float t0, t1;
-	t0 = max(tz_min, max(tx_min, ty_min));
-	t1 = min(tz_max, min(tx_max, ty_max));
-
-	return t0 < t1;
+	float t = fabsf(distance * invDirection);
+	return (t == t) ? t : INFINITY;
 }
 
+// Entry face of the grid for each axis, by the sign of the direction
+static const int EntryFace[3][2] = { {0, 2}, {5, 4}, {3, 1} };
+
 void Grid::initializeRayMarch(MarchingInfo& mi, const Ray& r, float tmin) const
 {
-	Vec3f min = boundingBox->getMin();
-	Vec3f max = boundingBox->getMax();
+	Vec3f min = boundingBox.getMin();
+	Vec3f max = boundingBox.getMax();
 	Vec3f origin = r.getOrigin();
+	const Vec3f& inv = r.getInvDirection();
 	mi.maxX = mX;
 	mi.maxY = mY;
 	mi.maxZ = mZ;
 	mi.firstSurface = -1;
+	mi.gridTMin = 0;
+	mi.gridBegin = 0;
 
-	// CASE1: The origin is inside the grid
-	if (Between(min, max, origin))
-	{
-		mi.IntersectedBB = true;
-
-		Vec3f offset = origin - min;
-		mi.i = floor(offset.x() / stepX);
-		mi.j = floor(offset.y() / stepY);
-		mi.k = floor(offset.z() / stepZ);
-
-		mi.d_tx = abs(stepX / r.getDirection().x());
-		mi.d_ty = abs(stepY / r.getDirection().y());
-		mi.d_tz = abs(stepZ / r.getDirection().z());
-
-		mi.sign_x = r.getDirection().x() > 0 ? 1 : -1;
-		mi.sign_y = r.getDirection().y() > 0 ? 1 : -1;
-		mi.sign_z = r.getDirection().z() > 0 ? 1 : -1;
-
-		int d_next_x = (mi.sign_x == 1) ? ceil(offset.x() / stepX) : floor(offset.x() / stepX);
-		int d_next_y = (mi.sign_y == 1) ? ceil(offset.y() / stepY) : floor(offset.y() / stepY);
-		int d_next_z = (mi.sign_z == 1) ? ceil(offset.z() / stepZ) : floor(offset.z() / stepZ);
-
-		mi.t_next_x = abs((d_next_x * stepX - offset.x()) / r.getDirection().x());
-		mi.t_next_y = abs((d_next_y * stepY - offset.y()) / r.getDirection().y());
-		mi.t_next_z = abs((d_next_z * stepZ - offset.z()) / r.getDirection().z());
+	// CASE1: The origin is inside the grid, march from the origin
+	bool inside = Between(min, max, origin);
 
-		Vec3f miNextX = origin + r.getDirection() * mi.t_next_x;
-		Vec3f miNextY = origin + r.getDirection() * mi.t_next_y;
-		Vec3f miNextZ = origin + r.getDirection() * mi.t_next_z;
-	}
-
-	// CASE2: The origin is outside & ray hits the grid
-	else if (Intersect(r, min, max))
+	// CASE2: The origin is outside & ray hits the grid, march from the entry point
+	if (!inside)
 	{
-		mi.IntersectedBB = true;
-
-		Vec3f Nearest(-999, -999, -999);
-		Vec3f hitPoint;
-		float t, tmin = 999999;
-		mi.gridTMin = 999999;
-		mi.gridBegin = 999999;
-		if (r.getDirection().x() != 0.f)
+		float tnear = 0, tfar = INFINITY;
+		// CASE3: The origin is outside & ray misses the grid
+		if (!boundingBox.Intersect(r, tnear, tfar))
 		{
-			if (r.getDirection().x() > 0)
-				t = (min.x() - origin.x()) / r.getDirection().x();
-			else
-				t = (max.x() - origin.x()) / r.getDirection().x();
-
-			if (t > 0.f)
-			{
-				hitPoint = origin + (t + 0.001) * r.getDirection();
-				if (min.y() < hitPoint.y() && hitPoint.y() < max.y() && min.z() < hitPoint.z() && hitPoint.z() < max.z())
-				{
-					Nearest = hitPoint;
-					mi.gridTMin = 0;
-					mi.gridBegin = t;
-					mi.firstSurface = (r.getDirection().x() > 0) ? 0 : 2;
-				}
-			}
+			mi.IntersectedBB = false;
+			return;
 		}
 
-		if (r.getDirection().y() != 0.f)
+		// The entry face lies on the axis whose near plane is farthest
+		float entry = -INFINITY;
+		for (int a = 0; a < 3; a++)
 		{
-			if (r.getDirection().y() > 0)
-				t = (min.y() - origin.y()) / r.getDirection().y();
-			else
-				t = (max.y() - origin.y()) / r.getDirection().y();
-
-			if (t > 0.f)
+			float t = ((r.getSign(a) ? max : min)[a] - origin[a]) * inv[a];
+			if (t > entry)
 			{
-				hitPoint = origin + (t + 0.001) * r.getDirection();
-
-				if (min.z() < hitPoint.z() && hitPoint.z() < max.z() && min.x() < hitPoint.x() && hitPoint.x() < max.x())
-				{
-					if (t < mi.gridBegin)
-					{
-						Nearest = hitPoint;
-						mi.gridTMin = 0;
-						mi.gridBegin = t;
-						mi.firstSurface = (r.getDirection().y() > 0) ? 5 : 4;
-					}
-				}
+				entry = t;
+				mi.firstSurface = EntryFace[a][r.getSign(a)];
 			}
 		}
+		mi.gridBegin = tnear;
+		origin = origin + (tnear + 0.001) * r.getDirection();
+	}
+	mi.IntersectedBB = true;
 
-		if (r.getDirection().z() != 0.f)
-		{
-			if (r.getDirection().z() > 0)
-				t = (min.z() - origin.z()) / r.getDirection().z();
-			else
-				t = (max.z() - origin.z()) / r.getDirection().z();
-
-			if (t > 0.f)
-			{
-				hitPoint = origin + (t + 0.001) * r.getDirection();
-
-				if (min.x() < hitPoint.x() && hitPoint.x() < max.x() && min.y() < hitPoint.y() && hitPoint.y() < max.y())
-				{
-					if (t < mi.gridBegin)
-					{
-						Nearest = hitPoint;
-						mi.gridTMin = 0;
-						mi.gridBegin = t;
-						mi.firstSurface = (r.getDirection().z() > 0) ? 3 : 1;
-					}
-				}
-			}
-		}
+	Vec3f offset = origin - min;
+	mi.i = floor(offset.x() / stepX);
+	mi.j = floor(offset.y() / stepY);
+	mi.k = floor(offset.z() / stepZ);
 
-		origin = Nearest;
-		Vec3f offset = origin - min;
-		mi.i = floor(offset.x() / stepX);
-		mi.j = floor(offset.y() / stepY);
-		mi.k = floor(offset.z() / stepZ);
+	mi.d_tx = fabsf(stepX * inv.x());
+	mi.d_ty = fabsf(stepY * inv.y());
+	mi.d_tz = fabsf(stepZ * inv.z());
 
-		mi.d_tx = abs(stepX / r.getDirection().x());
-		mi.d_ty = abs(stepY / r.getDirection().y());
-		mi.d_tz = abs(stepZ / r.getDirection().z());
+	mi.sign_x = r.getDirection().x() > 0 ? 1 : -1;
+	mi.sign_y = r.getDirection().y() > 0 ? 1 : -1;
+	mi.sign_z = r.getDirection().z() > 0 ? 1 : -1;
 
-		mi.sign_x = r.getDirection().x() > 0 ? 1 : -1;
-		mi.sign_y = r.getDirection().y() > 0 ? 1 : -1;
-		mi.sign_z = r.getDirection().z() > 0 ? 1 : -1;
+	int d_next_x = (mi.sign_x == 1) ? ceil(offset.x() / stepX) : floor(offset.x() / stepX);
+	int d_next_y = (mi.sign_y == 1) ? ceil(offset.y() / stepY) : floor(offset.y() / stepY);
+	int d_next_z = (mi.sign_z == 1) ? ceil(offset.z() / stepZ) : floor(offset.z() / stepZ);
 
-		int d_next_x = (mi.sign_x == 1) ? ceil(offset.x() / stepX) : floor(offset.x() / stepX);
-		int d_next_y = (mi.sign_y == 1) ? ceil(offset.y() / stepY) : floor(offset.y() / stepY);
-		int d_next_z = (mi.sign_z == 1) ? ceil(offset.z() / stepZ) : floor(offset.z() / stepZ);
+	mi.t_next_x = NextCrossing(d_next_x * stepX - offset.x(), inv.x());
+	mi.t_next_y = NextCrossing(d_next_y * stepY - offset.y(), inv.y());
+	mi.t_next_z = NextCrossing(d_next_z * stepZ - offset.z(), inv.z());
 
-		mi.t_next_x = abs((d_next_x * stepX - offset.x()) / r.getDirection().x());
-		mi.t_next_y = abs((d_next_y * stepY - offset.y()) / r.getDirection().y());
-		mi.t_next_z = abs((d_next_z * stepZ - offset.z()) / r.getDirection().z());
+	if (inside)
+		return;
 
-		if (mi.i < 0 || mi.j < 0 || mi.k < 0 || mi.i >= mi.maxX || mi.j >= mi.maxY || mi.k >= mi.maxZ)
+	if (mi.i < 0 || mi.j < 0 || mi.k < 0 || mi.i >= mi.maxX || mi.j >= mi.maxY || mi.k >= mi.maxZ)
+	{
+		float t_min_next = (std::min)(mi.t_next_x, (std::min)(mi.t_next_y, mi.t_next_z));
+		if (t_min_next == mi.t_next_x)
 		{
-			float t_min_next = min(mi.t_next_x, min(mi.t_next_y, mi.t_next_z));
-			if (t_min_next == mi.t_next_x)
-			{
-				mi.gridTMin = mi.t_next_x;
-				mi.t_next_x += mi.d_tx;
-				mi.i += mi.sign_x;
-				mi.firstSurface = (mi.sign_x == 1) ? 0 : 2;
-				if (mi.i < 0 || mi.i >= mi.maxX)
-					mi.IntersectedBB = false;
-			}
-			else if (t_min_next == mi.t_next_y)
-			{
-				mi.gridTMin = mi.t_next_y;
-				mi.t_next_y += mi.d_ty;
-				mi.j += mi.sign_y;
-				mi.firstSurface = (mi.sign_y == 1) ? 5 : 4;
-				if (mi.j < 0 || mi.j >= mi.maxY)
-					mi.IntersectedBB = false;
-			}
-			else
-			{
-				mi.gridTMin = mi.t_next_z;
-				mi.t_next_z += mi.d_tz;
-				mi.k += mi.sign_z;
-				mi.firstSurface = (mi.sign_z == 1) ? 3 : 1;
-				if (mi.k < 0 || mi.k >= mi.maxZ)
-					mi.IntersectedBB = false;
-			}
-
+			mi.gridTMin = mi.t_next_x;
+			mi.t_next_x += mi.d_tx;
+			mi.i += mi.sign_x;
+			mi.firstSurface = (mi.sign_x == 1) ? 0 : 2;
+			if (mi.i < 0 || mi.i >= mi.maxX)
+				mi.IntersectedBB = false;
 		}
-
-		if (mi.gridTMin == 999999 || mi.firstSurface == -1)
+		else if (t_min_next == mi.t_next_y)
 		{
-			mi.IntersectedBB = false;
+			mi.gridTMin = mi.t_next_y;
+			mi.t_next_y += mi.d_ty;
+			mi.j += mi.sign_y;
+			mi.firstSurface = (mi.sign_y == 1) ? 5 : 4;
+			if (mi.j < 0 || mi.j >= mi.maxY)
+				mi.IntersectedBB = false;
+		}
+		else
+		{
+			mi.gridTMin = mi.t_next_z;
+			mi.t_next_z += mi.d_tz;
+			mi.k += mi.sign_z;
+			mi.firstSurface = (mi.sign_z == 1) ? 3 : 1;
+			if (mi.k < 0 || mi.k >= mi.maxZ)
+				mi.IntersectedBB = false;
 		}
-
 	}
 
-	// CASE3: The origin is outside & ray misses the grid
-	else
-	{
+	// A ray grazing an edge can leave the grid again before the entry
+	// offset, there is no cell to march then
+	if (mi.firstSurface == -1 ||
+		mi.i < 0 || mi.j < 0 || mi.k < 0 || mi.i >= mi.maxX || mi.j >= mi.maxY || mi.k >= mi.maxZ)
 		mi.IntersectedBB = false;
-	}
 }
 
 int Grid::GetVoxelItemNum(int x, int y, int z)
 {
-	return VoxelS[x * mY * mZ + y * mZ + z].Items.size();
+	int c = x * mY * mZ + y * mZ + z;
+	if (packed)
+		return cellStart[c + 1] - cellStart[c];
+	return VoxelS[c].Items.size();
 }
\ No newline at end of file
@@ -2,7 +2,13 @@
 
 #include "../Core/Object3D.h"
 #include <vector>
+#include <deque>
+#include <unordered_map>
+#include <memory>
+#include <matrix.h>
 class Plane;
+class SphereBatch;
+class Group;
 
 class MarchingInfo
 {
@@ -25,10 +31,42 @@ public:
 	bool nextCell(int& surface);
 };
 
+// A matrix the grid items are inserted with, and the inverses
+// needed to intersect them, computed once when it is added
+struct GridInstance
+{
+	Matrix matrix;
+	Matrix inverse;
+	Matrix invTranspose;
+	// World bounds of a placed local grid, the ray is only moved into
+	// its space if it hits them
+	bool bounded = false;
+	Vec3f worldMin;
+	Vec3f worldMax;
+};
+
+// What a grid item is, so the traversal calls its intersect directly
+// instead of through the vtable. Everything else stays virtual.
+enum PrimitiveType : unsigned char
+{
+	PrimitiveSphereBatch,
+	PrimitiveSphere,
+	PrimitiveTriangle,
+	PrimitivePlane,
+	PrimitiveLocalGrid,
+	PrimitiveOther,
+};
+
 struct DrawItem
 {
 	Object3D* object;
 	Matrix* matrix;
+	// Filled in by the grid from matrix and object
+	const GridInstance* instance = nullptr;
+	PrimitiveType type = PrimitiveOther;
+	// The object of the scene's top group the item comes from, see
+	// SetOwner
+	int owner = 0;
 };
 
 struct Voxel
@@ -40,7 +78,8 @@ struct Voxel
 class Grid :public Object3D
 {
 public:
-	Grid(BoundingBox* bb, int nx, int ny, int nz);
+	// The cells split bb, which is copied into the grid's own box
+	Grid(const BoundingBox& bb, int nx, int ny, int nz);
 	~Grid();
 
 	virtual bool intersect(const Ray& r, Hit& h, float tmin) override;
@@ -50,7 +89,6 @@ public:
 
 	Vec3f GetVoxelCenter(int x, int y, int z);
 	Vec3f GetVoxelSizeHalf();
-	std::vector<DrawItem>& GetVoxelItems(int x, int y, int z);
 	void SetVoxelState(int x, int y, int z, bool state);
 	void InsertVoxelItem(int x, int y, int z, DrawItem& item);
 	bool GetVoxelState(int x, int y, int z);
@@ -61,14 +99,65 @@ public:
 
 	void InsertPlane(DrawItem& plane);
 
+	// Stores a copy of m for items inserted under a transform. The copy
+	// lives as long as the grid.
+	Matrix* AddMatrix(const Matrix& m);
+	const GridInstance* GetInstance(const Matrix* m) const;
+
+	// Places a shared object with the matrix m (from AddMatrix). The
+	// object gets a local grid of its own, built the first time it is
+	// placed, and the voxels under its world bounding box reference that
+	// local grid instead of its primitives.
+	void InsertInstance(Object3D* object, Matrix* m);
+	int GetNumLocalGrids() const { return (int)localGrids.size(); }
+
+	// Items inserted from now on come from object owner of the scene's
+	// top group. InsertObjects sets it for every object it inserts.
+	void SetOwner(int owner) { insertOwner = owner; }
+
+	// Inserts the objects of the top group of a scene, or only those
+	// marked in which, each as the owner of its items
+	void InsertObjects(Group* group, const std::vector<bool>* which = nullptr);
+
+	// For a reload of the scene: the items of owner o now belong to
+	// owners[o], or are dropped when that is -1. Unpacks the grid, so
+	// insert the new objects, then call BatchSpheres and Pack again.
+	// Local grids and batches nothing refers to any more are freed, the
+	// matrices stay until the grid goes.
+	void Reassign(const std::vector<int>& owners);
+
+	// Replaces the spheres of a cell that share a matrix by one
+	// SphereBatch when there are SphereBatch::MinSpheres of them, in the
+	// local grids as well. Spheres of different owners are never batched
+	// together. Call once everything is inserted.
+	int BatchSpheres();
+
+	// Moves the items of all cells into one array, each cell a run
+	// grouped by type, in the local grids that are not packed yet. Call
+	// once after BatchSpheres. intersect() reads the packed items, or
+	// the lists of the cells while the grid is not packed.
+	void Pack();
+
 private:
 	Voxel* VoxelS;
-	BoundingBox* mBoundingBox;
 	int mX, mY, mZ;
 	float startX, startY, startZ;
 	float stepX, stepY, stepZ;
 
 	std::vector<DrawItem> planes;
+	std::deque<GridInstance> instances;
+	std::unordered_map<const Matrix*, GridInstance*> instanceOf;
+	std::unordered_map<Object3D*, Grid*> localGrids;
+	std::vector<std::unique_ptr<SphereBatch>> batches;
+	int insertOwner = 0;
+
+	// Set by Pack(): the items of cell c are cellItems[cellStart[c]]
+	// up to cellItems[cellStart[c + 1]]
+	bool packed = false;
+	std::vector<DrawItem> cellItems;
+	std::vector<int> cellStart;
+	// The items of cell c, in whichever of the two layouts is current
+	void getCellItems(int c, DrawItem*& begin, DrawItem*& end);
 
 	void addVoxel(int& x, int& y, int& z, Material* mat);
 	void addVoxelSurface(int& x, int& y, int& z, int surface, Material* mat);
@@ -1,7 +1,7 @@
 #include "Group.h"
 
 Group::Group(int num) :
-	objnum(num)
+	objnum(num), unbounded(false)
 {
 	list = new Object3D* [num];
 }
@@ -13,6 +13,13 @@ Group::~Group()
 
 bool Group::intersect(const Ray& r, Hit& h, float tmin)
 {
+	if (bounded && !unbounded)
+	{
+		float tnear = tmin, tfar = h.getT();
+		if (!boundingBox.Intersect(r, tnear, tfar))
+			return false;
+	}
+
 	bool intersected = false;
 	for (int i = 0; i < objnum; i++)
 	{
@@ -27,20 +34,23 @@ bool Group::intersect(const Ray& r, Hit& h, float tmin)
 void Group::addObject(int index, Object3D* obj)
 {
 	list[index] = obj;
-	if (boundingBox == nullptr && obj->getBoundingBox() != nullptr)
-	{
-		boundingBox = new BoundingBox(*obj->getBoundingBox());
-	}
-	else if (obj->getBoundingBox() != nullptr)
+	BoundingBox* bb = obj->getBoundingBox();
+	if (bb == nullptr)
+		unbounded = true;
+	else if (!bounded)
+		setBoundingBox(bb);
+	else
+		boundingBox.Extend(bb);
+}
+
+void Group::updateBoundingBox()
+{
+	bounded = false;
+	unbounded = false;
+	for (int i = 0; i < objnum; i++)
 	{
-		Vec3f min;
-		Vec3f max;
-		Vec3f minx = boundingBox->getMin();
-		Vec3f maxx = boundingBox->getMax();
-		Vec3f::Min(min, obj->getBoundingBox()->getMin(), minx);
-		Vec3f::Max(max, obj->getBoundingBox()->getMax(), maxx);
-		delete boundingBox;
-		boundingBox = new BoundingBox(min, max);
+		if (list[i] != NULL)
+			addObject(i, list[i]);
 	}
 }
 
@@ -14,7 +14,16 @@ public:
 
 	void addObject(int index, Object3D* obj);
 
+	int getNumObjects() const { return objnum; }
+	Object3D* getObject(int index) const { return list[index]; }
+	// Swaps a child without touching the bounding box, call
+	// updateBoundingBox once all the children are replaced
+	void replaceObject(int index, Object3D* obj) { list[index] = obj; }
+	void updateBoundingBox();
+
 private:
 	int objnum;
 	Object3D** list;
+	// a child without a bounding box (a plane) turns off the box test
+	bool unbounded;
 };
\ No newline at end of file
@@ -1,6 +1,6 @@
 #include "Plane.h"
 #include <Windows.h>
-#include <gl/GL.h>
+#include <GL/gl.h>
 #include "Grid.h"
 #include <RayTracer/Core/RayTracingStas.h>
 #include "Triangle.h"
@@ -11,7 +11,11 @@ Plane::Plane(Vec3f& normal, float d, Material* m)
 	normal.Normalize();
 	this->normal = normal;
 	this->mat = m;
+	setup();
+}
 
+void Plane::setup()
+{
 	Vec3f axis1, axis2;
 	Vec3f v(1, 0, 0);
 	if (normal == Vec3f(1, 0, 0)) v = Vec3f(0, 1, 0);
@@ -27,12 +31,34 @@ Plane::Plane(Vec3f& normal, float d, Material* m)
 	p4 = zero + big * axis1 - big * axis2;
 }
 
+bool Plane::bakeTransform(const Matrix& m)
+{
+	// Normals go through the inverse transpose, the point closest to
+	// the origin goes through m and fixes the new distance
+	Matrix invTranspose;
+	if (!m.Inverse(invTranspose))
+		return false;
+	invTranspose.Transpose();
+	Vec3f zero = normal * distance;
+	m.Transform(zero);
+	invTranspose.TransformDirection(normal);
+	normal.Normalize();
+	distance = zero.Dot3(normal);
+	setup();
+	return true;
+}
+
 void Plane::insertIntoGrid(Grid* g, Matrix* m)
 {
 	DrawItem item = { this,m };
 	g->InsertPlane(item);
 }
 
+Vec3f Plane::getHitNormal(const Vec3f&, float, float) const
+{
+	return normal;
+}
+
 bool Plane::intersect(const Ray& r, Hit& h, float tmin)
 {
 	RayTracingStats::IncrementNumIntersections();
@@ -55,9 +81,10 @@ bool Plane::intersect(const Ray& r, Hit& h, float tmin)
 	if (distance < h.getT())
 	{
 #if(RTVersion>=2)
-		h.set(distance, this->mat, normal, r);
+		h.record(distance, this);
 #endif
 	}
+	return true;
 }
 
 void Plane::paint(void)
@@ -9,8 +9,12 @@ public:
 	virtual void paint(void) override;
 	virtual bool intersect(const Ray& r, Hit& h, float tmin) override;
 	virtual void insertIntoGrid(Grid* g, Matrix* m) override;
+	virtual bool bakeTransform(const Matrix& m) override;
+	virtual Vec3f getHitNormal(const Vec3f& point, float u, float v) const override;
 
 private:
+	void setup();
+
 	Vec3f normal;
 	float distance;
 
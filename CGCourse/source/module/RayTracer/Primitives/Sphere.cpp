@@ -1,10 +1,12 @@
 #include "Sphere.h"
 #include "../VersionControl.h"
 #include <Windows.h>
-#include <gl/GL.h>
+#include <GL/gl.h>
 #include "Grid.h"
 #include <matrix.h>
 #include <RayTracer/Core/RayTracingStas.h>
+#include <cstring>
+#include <memory>
 
 int tessx = 0, tessy = 0;
 bool gouraud = false;
@@ -13,14 +15,13 @@ Sphere::Sphere(Vec3f center, float radius, Material* mat)
 	:center(center), radius(radius)
 {
 	this->mat = mat;
-	BuildMesh();
 
-	boundingBox = new BoundingBox(
+	setBoundingBox(
 		center - Vec3f(radius, radius, radius),
 		center + Vec3f(radius, radius, radius));
 }
 
-Vec3f Sphere::getPoint(float u, float v)
+Vec3f Sphere::GetPoint(float u, float v)
 {
 	float r = 0.9f;
 	float pi = M_PI;
@@ -28,32 +29,39 @@ Vec3f Sphere::getPoint(float u, float v)
 	float x = r * std::sin(pi * u) * std::cos(2 * pi * v);
 	float z = r * std::sin(pi * u) * std::sin(2 * pi * v);
 
-	x *= radius;
-	y *= radius;
-	z *= radius;
-
-	return Vec3f(x, y, z) + center;
+	return Vec3f(x, y, z);
 }
 
-void Sphere::BuildMesh()
+const Sphere::Mesh* Sphere::GetMesh(int tessx, int tessy, bool gouraud)
 {
+	static std::vector<std::unique_ptr<Mesh>> meshes;
+	for (const std::unique_ptr<Mesh>& m : meshes)
+		if (m->tessx == tessx && m->tessy == tessy && m->gouraud == gouraud)
+			return m.get();
+
+	meshes.emplace_back(new Mesh{ tessx, tessy, gouraud, {}, {} });
+	Mesh* mesh = meshes.back().get();
+	Vec3f center(0, 0, 0);
+
 	int Longitude = tessx;
 	int Latitude = tessy;
 	float lon_step = 1.0f / Longitude;
 	float lat_step = 1.0f / Latitude;
 	int offset = 0;
 
-	num = Latitude * Longitude * 6;
-	points = new Vec3f[num];
-	normals = new Vec3f[num];
+	int num = Latitude * Longitude * 6;
+	mesh->points.resize(num);
+	mesh->normals.resize(num);
+	Vec3f* points = mesh->points.data();
+	Vec3f* normals = mesh->normals.data();
 	
 	for (int lat = 0; lat < Latitude; lat++) {  // γu
 		for (int lon = 0; lon < Longitude; lon++) { // v
 			// һι4㣬Σ
-			Vec3f point1 = getPoint(lat * lat_step, lon * lon_step);
-			Vec3f point2 = getPoint((lat + 1) * lat_step, lon * lon_step);
-			Vec3f point3 = getPoint((lat + 1) * lat_step, (lon + 1) * lon_step);
-			Vec3f point4 = getPoint(lat * lat_step, (lon + 1) * lon_step);
+			Vec3f point1 = GetPoint(lat * lat_step, lon * lon_step);
+			Vec3f point2 = GetPoint((lat + 1) * lat_step, lon * lon_step);
+			Vec3f point3 = GetPoint((lat + 1) * lat_step, (lon + 1) * lon_step);
+			Vec3f point4 = GetPoint(lat * lat_step, (lon + 1) * lon_step);
 
 			if (gouraud)
 			{
@@ -100,6 +108,14 @@ void Sphere::BuildMesh()
 			offset += 1;
 		}
 	}
+	return mesh;
+}
+
+Vec3f Sphere::getHitNormal(const Vec3f& point, float, float) const
+{
+	Vec3f normal = point - center;
+	normal.Normalize();
+	return normal;
 }
 
 bool Sphere::intersect(const Ray& r, Hit& h, float tmin)
@@ -146,10 +162,7 @@ bool Sphere::intersect(const Ray& r, Hit& h, float tmin)
 		h.set(nearest, this->mat, r);
 #endif
 #if(RTVersion>=2)
-		Vec3f hitpoint = r.pointAtParameter(nearest);
-		Vec3f normal = hitpoint - center;
-		normal.Normalize();
-		h.set(nearest, this->mat, normal, r);
+		h.record(nearest, this);
 #endif
 	}
 
@@ -157,8 +170,40 @@ bool Sphere::intersect(const Ray& r, Hit& h, float tmin)
 	return true;
 }
 
+bool Sphere::bakeTransform(const Matrix& m)
+{
+	// Still a sphere only if m rotates and scales uniformly
+	Vec3f x(m.Get(0, 0), m.Get(0, 1), m.Get(0, 2));
+	Vec3f y(m.Get(1, 0), m.Get(1, 1), m.Get(1, 2));
+	Vec3f z(m.Get(2, 0), m.Get(2, 1), m.Get(2, 2));
+	float scale = x.Length();
+	float eps = 1e-5f * scale * scale;
+	if (fabs(y.Length() - scale) > 1e-5f * scale || fabs(z.Length() - scale) > 1e-5f * scale ||
+		fabs(x.Dot3(y)) > eps || fabs(y.Dot3(z)) > eps || fabs(z.Dot3(x)) > eps)
+		return false;
+
+	m.Transform(center);
+	radius *= scale;
+	setBoundingBox(
+		center - Vec3f(radius, radius, radius),
+		center + Vec3f(radius, radius, radius));
+	return true;
+}
+
 void Sphere::paint(void)
 {
+	// The headless build has no GL, and no use for the mesh
+#ifndef HEADLESS
+	if (mesh == nullptr)
+		mesh = GetMesh(tessx, tessy, gouraud);
+	const Vec3f* points = mesh->points.data();
+	const Vec3f* normals = mesh->normals.data();
+	int num = (int)mesh->points.size();
+
+	// The canvas turns on GL_NORMALIZE, so the scale leaves the normals alone
+	glPushMatrix();
+	glTranslatef(center.x(), center.y(), center.z());
+	glScalef(radius, radius, radius);
 	mat->glSetMaterial();
 	glBegin(GL_TRIANGLES);
 
@@ -172,6 +217,8 @@ void Sphere::paint(void)
 		glVertex3f(points[i + 2].x(), points[i + 2].y(), points[i + 2].z());
 	}
 	glEnd();
+	glPopMatrix();
+#endif
 }
 
 void Sphere::insertIntoGrid(Grid* g, Matrix* m)
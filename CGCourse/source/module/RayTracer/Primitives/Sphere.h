@@ -1,6 +1,7 @@
 #pragma once
 
 #include "../Core/Object3D.h"
+#include <vector>
 
 extern int tessx;
 extern int tessy;
@@ -13,14 +14,27 @@ public:
 	virtual void paint(void) override;
 	virtual bool intersect(const Ray& r, Hit& h, float tmin) override;
 	virtual void insertIntoGrid(Grid* g, Matrix* m) override;
+	virtual bool bakeTransform(const Matrix& m) override;
+	virtual Vec3f getHitNormal(const Vec3f& point, float u, float v) const override;
+
+	const Vec3f& getCenter() const { return center; }
+	float getRadius() const { return radius; }
 
 private:
 	float radius;
 	Vec3f center;
 
-	void BuildMesh();
-	Vec3f getPoint(float u, float v);
-	int num;
-	Vec3f* points;
-	Vec3f* normals;
+	// The preview mesh of a sphere of radius 1 around the origin. It is
+	// only built by the first paint(), and shared by every sphere of the
+	// same tessellation; paint() places it with a transform
+	struct Mesh
+	{
+		int tessx, tessy;
+		bool gouraud;
+		std::vector<Vec3f> points;
+		std::vector<Vec3f> normals;
+	};
+	static const Mesh* GetMesh(int tessx, int tessy, bool gouraud);
+	static Vec3f GetPoint(float u, float v);
+	const Mesh* mesh = nullptr;
 };
\ No newline at end of file
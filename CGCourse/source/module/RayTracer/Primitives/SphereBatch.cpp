@@ -0,0 +1,227 @@
+#include "SphereBatch.h"
+#include "Sphere.h"
+#include "Group.h"
+#include "Transform.h"
+#include <RayTracer/Core/RayTracingStas.h>
+#include <unordered_set>
+#include <math.h>
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#define SPHERE_LANES 8
+typedef __m256 Lanes;
+static inline Lanes Splat(float f) { return _mm256_set1_ps(f); }
+static inline Lanes Load(const float* p) { return _mm256_loadu_ps(p); }
+static inline void Store(float* p, Lanes a) { _mm256_storeu_ps(p, a); }
+static inline Lanes Add(Lanes a, Lanes b) { return _mm256_add_ps(a, b); }
+static inline Lanes Sub(Lanes a, Lanes b) { return _mm256_sub_ps(a, b); }
+static inline Lanes Mul(Lanes a, Lanes b) { return _mm256_mul_ps(a, b); }
+static inline Lanes Sqrt(Lanes a) { return _mm256_sqrt_ps(a); }
+static inline Lanes Less(Lanes a, Lanes b) { return _mm256_cmp_ps(a, b, _CMP_LT_OQ); }
+static inline Lanes Greater(Lanes a, Lanes b) { return _mm256_cmp_ps(a, b, _CMP_GT_OQ); }
+static inline Lanes Or(Lanes a, Lanes b) { return _mm256_or_ps(a, b); }
+static inline Lanes Select(Lanes mask, Lanes a, Lanes b) { return _mm256_blendv_ps(b, a, mask); }
+static inline int Mask(Lanes a) { return _mm256_movemask_ps(a); }
+#elif defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#include <xmmintrin.h>
+#define SPHERE_LANES 4
+typedef __m128 Lanes;
+static inline Lanes Splat(float f) { return _mm_set1_ps(f); }
+static inline Lanes Load(const float* p) { return _mm_loadu_ps(p); }
+static inline void Store(float* p, Lanes a) { _mm_storeu_ps(p, a); }
+static inline Lanes Add(Lanes a, Lanes b) { return _mm_add_ps(a, b); }
+static inline Lanes Sub(Lanes a, Lanes b) { return _mm_sub_ps(a, b); }
+static inline Lanes Mul(Lanes a, Lanes b) { return _mm_mul_ps(a, b); }
+static inline Lanes Sqrt(Lanes a) { return _mm_sqrt_ps(a); }
+static inline Lanes Less(Lanes a, Lanes b) { return _mm_cmplt_ps(a, b); }
+static inline Lanes Greater(Lanes a, Lanes b) { return _mm_cmpgt_ps(a, b); }
+static inline Lanes Or(Lanes a, Lanes b) { return _mm_or_ps(a, b); }
+static inline Lanes Select(Lanes mask, Lanes a, Lanes b) { return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b)); }
+static inline int Mask(Lanes a) { return _mm_movemask_ps(a); }
+#else
+#define SPHERE_LANES 1
+#endif
+
+SphereBatch::SphereBatch(const std::vector<Sphere*>& spheres)
+	:spheres(spheres)
+{
+	mat = spheres.front()->mat;
+	setup();
+}
+
+int SphereBatch::GetWidth()
+{
+	return SPHERE_LANES;
+}
+
+void SphereBatch::setup()
+{
+	// The padding lanes have a negative radius, nothing is closer than that
+	size_t padded = (spheres.size() + SPHERE_LANES - 1) / SPHERE_LANES * SPHERE_LANES;
+	centerX.assign(padded, 0);
+	centerY.assign(padded, 0);
+	centerZ.assign(padded, 0);
+	radius.assign(padded, -1);
+
+	bounded = false;
+	for (size_t i = 0; i < spheres.size(); i++)
+	{
+		const Vec3f& center = spheres[i]->getCenter();
+		centerX[i] = center.x();
+		centerY[i] = center.y();
+		centerZ[i] = center.z();
+		radius[i] = spheres[i]->getRadius();
+
+		BoundingBox* bb = spheres[i]->getBoundingBox();
+		if (!bounded)
+			setBoundingBox(bb);
+		else
+			boundingBox.Extend(bb);
+	}
+}
+
+bool SphereBatch::intersect(const Ray& r, Hit& h, float tmin)
+{
+	RayTracingStats::AddNumIntersections(spheres.size());
+
+	const Vec3f& origin = r.getOrigin();
+	const Vec3f& direction = r.getDirection();
+	float nearestT = h.getT();
+	int nearest = -1;
+	bool intersected = false;
+
+#if SPHERE_LANES > 1
+	Lanes ox = Splat(origin.x()), oy = Splat(origin.y()), oz = Splat(origin.z());
+	Lanes dx = Splat(direction.x()), dy = Splat(direction.y()), dz = Splat(direction.z());
+	Lanes vtmin = Splat(tmin);
+	for (size_t i = 0; i < centerX.size(); i += SPHERE_LANES)
+	{
+		Lanes cx = Load(&centerX[i]), cy = Load(&centerY[i]), cz = Load(&centerZ[i]);
+		Lanes rad = Load(&radius[i]);
+
+		// The cases of Sphere::intersect, for every lane
+		Lanes lx = Sub(cx, ox), ly = Sub(cy, oy), lz = Sub(cz, oz);
+		Lanes inside = Less(Sqrt(Add(Add(Mul(lx, lx), Mul(ly, ly)), Mul(lz, lz))), rad);
+		Lanes projection = Add(Add(Mul(lx, dx), Mul(ly, dy)), Mul(lz, dz));
+		Lanes px = Sub(cx, Add(ox, Mul(dx, projection)));
+		Lanes py = Sub(cy, Add(oy, Mul(dy, projection)));
+		Lanes pz = Sub(cz, Add(oz, Mul(dz, projection)));
+		Lanes mindis = Sqrt(Add(Add(Mul(px, px), Mul(py, py)), Mul(pz, pz)));
+		Lanes miss = Or(Less(projection, vtmin), Greater(mindis, rad));
+		int hits = (Mask(inside) | ~Mask(miss)) & ((1 << SPHERE_LANES) - 1);
+		if (hits == 0)
+			continue;
+
+		Lanes half = Sqrt(Sub(Mul(rad, rad), Mul(mindis, mindis)));
+		Lanes minus = Sub(projection, half);
+		float t[SPHERE_LANES];
+		Store(t, Select(Greater(minus, vtmin), minus, Add(projection, half)));
+
+		// In sphere order, so ties go to the same sphere as one by one
+		intersected = true;
+		for (int lane = 0; lane < SPHERE_LANES; lane++)
+		{
+			if ((hits & (1 << lane)) && t[lane] < nearestT)
+			{
+				nearestT = t[lane];
+				nearest = (int)i + lane;
+			}
+		}
+	}
+#else
+	for (size_t i = 0; i < spheres.size(); i++)
+	{
+		Vec3f center(centerX[i], centerY[i], centerZ[i]);
+		Vec3f connection = center - origin;
+		bool inside = connection.Length() < radius[i];
+		float projection = connection.Dot3(direction);
+		float mindis = (center - r.pointAtParameter(projection)).Length();
+		if (!inside && (projection < tmin || mindis > radius[i]))
+			continue;
+
+		float half = (float)sqrt(radius[i] * radius[i] - mindis * mindis);
+		float minus = projection - half;
+		float t = (minus > tmin) ? minus : projection + half;
+		intersected = true;
+		if (t < nearestT)
+		{
+			nearestT = t;
+			nearest = (int)i;
+		}
+	}
+#endif
+
+	if (nearest >= 0)
+		h.record(nearestT, spheres[nearest]);
+	return intersected;
+}
+
+void SphereBatch::paint(void)
+{
+	for (Sphere* sphere : spheres)
+		sphere->paint();
+}
+
+void SphereBatch::insertIntoGrid(Grid* g, Matrix* m)
+{
+	// The grid batches its cells itself
+	for (Sphere* sphere : spheres)
+		sphere->insertIntoGrid(g, m);
+}
+
+bool SphereBatch::bakeTransform(const Matrix& m)
+{
+	// Whether a sphere can be baked only depends on m, so either all of
+	// them are or none
+	for (Sphere* sphere : spheres)
+		if (!sphere->bakeTransform(m))
+			return false;
+	setup();
+	return true;
+}
+
+static void BatchSpheres(Object3D* object, SceneArena& arena, std::unordered_set<Object3D*>& visited, int& batches)
+{
+	if (object == nullptr || !visited.insert(object).second)
+		return;
+
+	if (Transform* transform = dynamic_cast<Transform*>(object))
+	{
+		BatchSpheres(transform->getObject(), arena, visited, batches);
+		return;
+	}
+	Group* group = dynamic_cast<Group*>(object);
+	if (group == nullptr)
+		return;
+
+	std::vector<Sphere*> spheres;
+	int first = -1;
+	for (int i = 0; i < group->getNumObjects(); i++)
+	{
+		Object3D* child = group->getObject(i);
+		BatchSpheres(child, arena, visited, batches);
+		if (Sphere* sphere = dynamic_cast<Sphere*>(child))
+		{
+			if (spheres.empty())
+				first = i;
+			spheres.push_back(sphere);
+		}
+	}
+	if ((int)spheres.size() < SphereBatch::MinSpheres)
+		return;
+
+	for (int i = first; i < group->getNumObjects(); i++)
+		if (dynamic_cast<Sphere*>(group->getObject(i)) != nullptr)
+			group->replaceObject(i, NULL);
+	group->replaceObject(first, arena.create<SphereBatch>(spheres));
+	group->updateBoundingBox();
+	batches++;
+}
+
+int BatchSpheres(Object3D* root, SceneArena& arena)
+{
+	std::unordered_set<Object3D*> visited;
+	int batches = 0;
+	BatchSpheres(root, arena, visited, batches);
+	return batches;
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include "../Core/Object3D.h"
+#include "../Core/SceneArena.h"
+#include <vector>
+
+class Sphere;
+
+// Several spheres intersected together. Their centers and radii are
+// kept as structure of arrays, padded to whole packs, and a ray is
+// tested against a pack at a time: 8 spheres with AVX, 4 with SSE,
+// otherwise one by one. The arithmetic is the one of Sphere::intersect,
+// so the hits are the same, and the hit records the sphere itself.
+class SphereBatch :public Object3D
+{
+public:
+	// Fewer spheres than this are left on their own
+	static const int MinSpheres = 4;
+
+	SphereBatch(const std::vector<Sphere*>& spheres);
+	virtual bool intersect(const Ray& r, Hit& h, float tmin) override;
+	virtual void paint(void) override;
+	virtual void insertIntoGrid(Grid* g, Matrix* m) override;
+	virtual bool bakeTransform(const Matrix& m) override;
+
+	int getNumSpheres() const { return (int)spheres.size(); }
+	Sphere* getSphere(int index) const { return spheres[index]; }
+
+	// Spheres tested per step
+	static int GetWidth();
+
+private:
+	void setup();
+
+	std::vector<Sphere*> spheres;
+	std::vector<float> centerX, centerY, centerZ, radius;
+};
+
+// Replaces the spheres of every group below root that holds at least
+// SphereBatch::MinSpheres of them by one batch, made in arena, in the
+// slot of the first one. Returns the number of batches made.
+int BatchSpheres(Object3D* root, SceneArena& arena);
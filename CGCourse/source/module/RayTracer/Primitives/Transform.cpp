@@ -1,6 +1,7 @@
 #include "Transform.h"
 #include <Windows.h>
-#include <gl/GL.h>
+#include <GL/gl.h>
+#include "Grid.h"
 
 Transform::Transform(Matrix& m, Object3D* o)
 	:matrix(m), inverse(m), Object(o)
@@ -27,51 +28,38 @@ Transform::Transform(Matrix& m, Object3D* o)
 				Vec3f::Max(maxAxis, point, maxAxis);
 			}
 
-	boundingBox = new BoundingBox(minAxis, maxAxis);
+	setBoundingBox(minAxis, maxAxis);
 }
 
 bool Transform::intersect(const Ray& r, Hit& h, float tmin)
 {
-	Vec3f origin = r.getOrigin();
-	Vec3f direction = r.getDirection();
-	inverse.Transform(origin);
-	inverse.TransformDirection(direction);
-	float scale = direction.Length();
-	direction.Normalize();
-
-	Ray osr(origin, direction);
-	Hit hit(99999, nullptr, Vec3f(0, 0, 0));
-	if (Object->intersect(osr, hit, tmin / scale))
+	// skip the change of space when the world box is missed
+	float tnear = tmin, tfar = h.getT();
+	if (!boundingBox.Intersect(r, tnear, tfar))
+		return false;
+	if (IntersectTransformed(Object, inverse, invTranspose, r, h, tmin))
 	{
-		float t = hit.getT() / scale;
-		if (t > tmin && t < h.getT())
-		{
-			Vec3f normal = hit.getNormal();
-			invTranspose.TransformDirection(normal);
-			normal.Normalize();
-			h.set(t, hit.getMaterial(), normal, r);
-			return true;
-		}
+		h.setTransform(this);
+		return true;
 	}
 	return false;
 }
 
+bool Transform::IntersectTransformed(Object3D* object, const Matrix& inverse,
+	const Matrix& invTranspose, const Ray& r, Hit& h, float tmin)
+{
+	return IntersectTransformed(inverse, invTranspose, r, h, tmin,
+		[object](const Ray& osr, Hit& hit, float t) { return object->intersect(osr, hit, t); });
+}
+
 void Transform::insertIntoGrid(Grid* g, Matrix* m)
 {
-	if (m == nullptr)
-	{
-		m = new Matrix();
-		*m = Matrix::MakeScale(1);
-	}
+	// The grid owns the combined matrix and keeps its inverse
+	Matrix combined = (m == nullptr) ? matrix : (*m) * matrix;
+	if (Object->isShared())
+		g->InsertInstance(Object, g->AddMatrix(combined));
 	else
-	{
-		Matrix* tmp = new Matrix();
-		*tmp = *m;
-		m = tmp;
-	}
-
-	*m *= matrix;
-	Object->insertIntoGrid(g, m);
+		Object->insertIntoGrid(g, g->AddMatrix(combined));
 }
 
 void Transform::paint(void)
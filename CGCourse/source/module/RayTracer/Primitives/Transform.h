@@ -11,9 +11,60 @@ public:
 	virtual bool intersect(const Ray& r, Hit& h, float tmin) override;
 	virtual void insertIntoGrid(Grid* g, Matrix* m) override;
 
+	const Matrix& getMatrix() const { return matrix; }
+	Object3D* getObject() const { return Object; }
+
+	// Intersects object, placed by a transform with the given inverse and
+	// inverse transpose, without building a Transform for it
+	static bool IntersectTransformed(Object3D* object, const Matrix& inverse,
+		const Matrix& invTranspose, const Ray& r, Hit& h, float tmin);
+	// The same with intersect(ray, hit, tmin) in place of the virtual
+	// call, for callers that know what the object is
+	template <class Intersect>
+	static bool IntersectTransformed(const Matrix& inverse, const Matrix& invTranspose,
+		const Ray& r, Hit& h, float tmin, Intersect intersect);
+
 private:
 	Matrix matrix;
 	Matrix inverse;
 	Matrix invTranspose;
 	Object3D* Object;
-};
\ No newline at end of file
+};
+
+template <class Intersect>
+bool Transform::IntersectTransformed(const Matrix& inverse, const Matrix& invTranspose,
+	const Ray& r, Hit& h, float tmin, Intersect intersect)
+{
+	Vec3f origin = r.getOrigin();
+	Vec3f direction = r.getDirection();
+	inverse.Transform(origin);
+	inverse.TransformDirection(direction);
+	float scale = direction.Length();
+	direction.Normalize();
+
+	Ray osr(origin, direction);
+	// Only hits closer than h can win
+	Hit hit(h.getT() * scale, nullptr, Vec3f(0, 0, 0));
+	if (intersect(osr, hit, tmin / scale))
+	{
+		float t = hit.getT() / scale;
+		if (t > tmin && t < h.getT())
+		{
+			if (hit.isPending() && hit.pushSpace(&inverse, &invTranspose))
+			{
+				// Leave the normal to Hit::finalize
+				h = hit;
+				h.setT(t);
+				return true;
+			}
+			hit.finalize(osr);
+			Vec3f normal = hit.getNormal();
+			invTranspose.TransformDirection(normal);
+			normal.Normalize();
+			h.set(t, hit.getMaterial(), normal, r);
+			h.setObject(hit.getObject(), hit.getObjectMatrix());
+			return true;
+		}
+	}
+	return false;
+}
@@ -0,0 +1,110 @@
+#include "TransformCollapse.h"
+#include "Group.h"
+#include "Transform.h"
+
+TransformCollapse::TransformCollapse(bool bake, SceneArena& arena)
+	:bake(bake), arena(arena), merged(0), baked(0)
+{
+}
+
+Object3D* TransformCollapse::run(Object3D* root)
+{
+	uses.clear();
+	sharedResults.clear();
+	countUses(root);
+	return collapse(root, nullptr);
+}
+
+void TransformCollapse::countUses(Object3D* object)
+{
+	if (object == nullptr || ++uses[object] > 1)
+		return;
+
+	if (Group* group = dynamic_cast<Group*>(object))
+	{
+		for (int i = 0; i < group->getNumObjects(); i++)
+			countUses(group->getObject(i));
+	}
+	else if (Transform* transform = dynamic_cast<Transform*>(object))
+	{
+		countUses(transform->getObject());
+	}
+}
+
+Object3D* TransformCollapse::wrap(Object3D* object, const Matrix* m)
+{
+	if (m == nullptr)
+		return object;
+	Matrix copy = *m;
+	return arena.create<Transform>(copy, object);
+}
+
+// m is the matrix accumulated above object, NULL for none
+Object3D* TransformCollapse::collapse(Object3D* object, const Matrix* m)
+{
+	if (object == nullptr)
+		return nullptr;
+
+	// A shared object is collapsed once in its own space, every use
+	// then gets its own matrix on top
+	if (uses[object] > 1)
+	{
+		auto found = sharedResults.find(object);
+		if (found == sharedResults.end())
+		{
+			uses[object] = 1;
+			Object3D* result = collapse(object, nullptr);
+			uses[object] = 2;
+			found = sharedResults.insert({ object, result }).first;
+		}
+		return wrap(found->second, m);
+	}
+
+	if (Transform* transform = dynamic_cast<Transform*>(object))
+	{
+		Object3D* child = transform->getObject();
+		bool leaf = dynamic_cast<Group*>(child) == nullptr && dynamic_cast<Transform*>(child) == nullptr;
+		if (m == nullptr && leaf && uses[child] <= 1)
+		{
+			// Nothing to merge, keep the node unless the child can be baked
+			if (bake && child->bakeTransform(transform->getMatrix()))
+			{
+				baked++;
+				return child;
+			}
+			return transform;
+		}
+
+		Matrix combined = (m == nullptr) ? transform->getMatrix() : (*m) * transform->getMatrix();
+		if (m != nullptr)
+			merged++;
+		return collapse(child, &combined);
+	}
+
+	if (Group* group = dynamic_cast<Group*>(object))
+	{
+		// Push the matrix into the children when some of them have
+		// transforms of their own, or when they are going to be baked.
+		// Otherwise one Transform over the whole group is cheaper.
+		bool push = bake;
+		for (int i = 0; i < group->getNumObjects() && !push; i++)
+		{
+			Object3D* child = group->getObject(i);
+			push = dynamic_cast<Group*>(child) != nullptr || dynamic_cast<Transform*>(child) != nullptr;
+		}
+
+		const Matrix* childMatrix = push ? m : nullptr;
+		for (int i = 0; i < group->getNumObjects(); i++)
+			group->replaceObject(i, collapse(group->getObject(i), childMatrix));
+		group->updateBoundingBox();
+		return push ? group : wrap(group, m);
+	}
+
+	// Primitive
+	if (m != nullptr && bake && object->bakeTransform(*m))
+	{
+		baked++;
+		return object;
+	}
+	return wrap(object, m);
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include "../Core/Object3D.h"
+#include "../Core/SceneArena.h"
+#include <matrix.h>
+#include <unordered_map>
+
+// Scene post-processing pass for nested transforms.
+// Chains of Transform nodes are multiplied into one matrix, and a transform
+// above a group of transforms is pushed down into its children, so every
+// primitive sits below at most one Transform. With baking on, primitives
+// that are used only once are moved to world space instead (triangles,
+// planes, and spheres under rotation / uniform scale), dropping the
+// transform altogether. Objects shared by several parents keep their own
+// space and get one Transform per use. New Transform nodes are made in
+// the arena of the scene.
+class TransformCollapse
+{
+public:
+	TransformCollapse(bool bake, SceneArena& arena);
+
+	// Rewrites the tree below root and returns the object that takes its
+	// place (root itself for a group)
+	Object3D* run(Object3D* root);
+
+	// Transform nodes folded into the matrix above them
+	int getMerged() const { return merged; }
+	// Primitives moved to world space
+	int getBaked() const { return baked; }
+
+private:
+	void countUses(Object3D* object);
+	Object3D* collapse(Object3D* object, const Matrix* m);
+	Object3D* wrap(Object3D* object, const Matrix* m);
+
+	bool bake;
+	SceneArena& arena;
+	int merged;
+	int baked;
+	std::unordered_map<Object3D*, int> uses;
+	std::unordered_map<Object3D*, Object3D*> sharedResults;
+};
@@ -1,6 +1,6 @@
 #include "Triangle.h"
 #include <Windows.h>
-#include <gl/GL.h>
+#include <GL/gl.h>
 #include <matrix.h>
 #include "Grid.h"
 #include <RayTracer/Core/RayTracingStas.h>
@@ -9,20 +9,64 @@ Triangle::Triangle(Vec3f& a, Vec3f& b, Vec3f& c, Material* m)
 	:p1(a), p2(b), p3(c)
 {
 	this->mat = m;
+	setup();
+}
+
+void Triangle::setup()
+{
 	// Calc edge
-	e1 = p2 - p1;
-	e2 = p3 - p1;
+	Vec3f e1 = p2 - p1;
+	Vec3f e2 = p3 - p1;
 	// Calc normal
-	Vec3f::Cross3(this->normal, e1, e2);
+	Vec3f n;
+	Vec3f::Cross3(n, e1, e2);
+	this->normal = n;
 	this->normal.Normalize();
-	// Calc distance
-	this->distance = p1.Dot3(this->normal);
+
+#if (TRIANGLE_TEST == TRIANGLE_WALD)
+	// Project along the largest normal component. A degenerate triangle
+	// gets infinite or NaN coefficients and is never hit
+	k = (fabsf(n.x()) > fabsf(n.y())) ?
+		(fabsf(n.x()) > fabsf(n.z()) ? 0 : 2) :
+		(fabsf(n.y()) > fabsf(n.z()) ? 1 : 2);
+	int u = (k + 1) % 3, v = (k + 2) % 3;
+	float nk = 1.0f / n[k];
+	nu = n[u] * nk;
+	nv = n[v] * nk;
+	nd = n.Dot3(p1) * nk;
+	// Solve h - p1 = beta e1 + gamma e2 in the projection
+	float det = 1.0f / (e1[u] * e2[v] - e1[v] * e2[u]);
+	bu = e2[v] * det;
+	bv = -e2[u] * det;
+	bd = (e2[u] * p1[v] - e2[v] * p1[u]) * det;
+	cu = -e1[v] * det;
+	cv = e1[u] * det;
+	cd = (e1[v] * p1[u] - e1[u] * p1[v]) * det;
+#endif
 
 	Vec3f minAB, minABC;
 	Vec3f maxAB, maxABC;
-	Vec3f::Min(minAB, a, b); Vec3f::Min(minABC, c, minAB);
-	Vec3f::Max(maxAB, a, b); Vec3f::Max(maxABC, c, maxAB);
-	this->boundingBox = new BoundingBox(minABC, maxABC);
+	Vec3f::Min(minAB, p1, p2); Vec3f::Min(minABC, p3, minAB);
+	Vec3f::Max(maxAB, p1, p2); Vec3f::Max(maxABC, p3, maxAB);
+	setBoundingBox(minABC, maxABC);
+}
+
+bool Triangle::bakeTransform(const Matrix& m)
+{
+	m.Transform(p1);
+	m.Transform(p2);
+	m.Transform(p3);
+	// A mirroring matrix flips the winding, swap two vertices so the
+	// normal keeps pointing the same way as through a Transform
+	Vec3f x(m.Get(0, 0), m.Get(0, 1), m.Get(0, 2));
+	Vec3f y(m.Get(1, 0), m.Get(1, 1), m.Get(1, 2));
+	Vec3f z(m.Get(2, 0), m.Get(2, 1), m.Get(2, 2));
+	Vec3f yz;
+	Vec3f::Cross3(yz, y, z);
+	if (x.Dot3(yz) < 0)
+		std::swap(p2, p3);
+	setup();
+	return true;
 }
 
 bool Triangle::intersect(const Ray& r, Hit& h, float tmin)
@@ -30,31 +74,72 @@ bool Triangle::intersect(const Ray& r, Hit& h, float tmin)
 	RayTracingStats::IncrementNumIntersections();
 
 	const Vec3f& origin = r.getOrigin();
+
+#if (TRIANGLE_TEST == TRIANGLE_WALD)
 	const Vec3f& direction = r.getDirection();
+	static const int next[5] = { 0, 1, 2, 0, 1 };
+	int u = next[k + 1], v = next[k + 2];
+	float t = (nd - origin[k] - nu * origin[u] - nv * origin[v]) /
+		(direction[k] + nu * direction[u] + nv * direction[v]);
+	// The negated tests also reject NaN (a ray parallel to the plane)
+	if (!(t >= tmin && t <= h.getT())) return false;
+	float hu = origin[u] + t * direction[u];
+	float hv = origin[v] + t * direction[v];
+	float beta = bu * hu + bv * hv + bd;
+	if (!(beta >= 0)) return false;
+	float gamma = cu * hu + cv * hv + cd;
+	if (!(gamma >= 0) || beta + gamma > 1) return false;
+	float u = beta, v = gamma;
+#else
+	// Move the vertices to the ray origin, permute the axes and shear
+	// them so the ray runs along +z through (0, 0)
+	int kx = r.getShearAxis(0), ky = r.getShearAxis(1), kz = r.getShearAxis(2);
+	const Vec3f& S = r.getShear();
+	Vec3f A = p1 - origin;
+	Vec3f B = p2 - origin;
+	Vec3f C = p3 - origin;
+	float Ax = A[kx] - S.x() * A[kz], Ay = A[ky] - S.y() * A[kz];
+	float Bx = B[kx] - S.x() * B[kz], By = B[ky] - S.y() * B[kz];
+	float Cx = C[kx] - S.x() * C[kz], Cy = C[ky] - S.y() * C[kz];
 
-	// On the other way, intersection point is needed
-	Vec3f T = origin - p1;
-	Vec3f P, Q;
-	Vec3f::Cross3(P, direction, e2);
-	Vec3f::Cross3(Q, T, e1);
-	float ipe1 = 1. / P.Dot3(e1);
-	float t = ipe1 * Q.Dot3(e2);
-	// If the intersection point is outside
-	if (t < tmin || t > h.getT()) return false;
-	// Calc the u & v
-	float u = ipe1 * P.Dot3(T);
-	float v = ipe1 * Q.Dot3(direction);
-	// If the intersction point is outside the triangle
-	if (u < 0 || v < 0 || u + v>1)
+	// Scaled barycentric coordinates, the edge functions at (0, 0).
+	// Exactly zero on an edge, where the float products can tie, so
+	// those are redone in double to give both triangles the same answer
+	float U = Cx * By - Cy * Bx;
+	float V = Ax * Cy - Ay * Cx;
+	float W = Bx * Ay - By * Ax;
+	if (U == 0 || V == 0 || W == 0)
+	{
+		U = (float)((double)Cx * By - (double)Cy * Bx);
+		V = (float)((double)Ax * Cy - (double)Ay * Cx);
+		W = (float)((double)Bx * Ay - (double)By * Ax);
+	}
+	// Both sides of the triangle are hit
+	if ((U < 0 || V < 0 || W < 0) && (U > 0 || V > 0 || W > 0))
 		return false;
+	float det = U + V + W;
+	if (det == 0)
+		return false;
+
+	float T = S.z() * (U * A[kz] + V * B[kz] + W * C[kz]);
+	float t = T / det;
+	if (t < tmin || t > h.getT()) return false;
+	float invDet = 1.0f / det;
+	float u = V * invDet, v = W * invDet;
+#endif
 
 #if(RTVersion>=2)
-	h.set(t, this->mat, normal, r);
+	h.record(t, this, u, v);
 #endif
 
 	return true;
 }
 
+Vec3f Triangle::getHitNormal(const Vec3f&, float, float) const
+{
+	return normal;
+}
+
 void Triangle::paint(void)
 {
 	mat->glSetMaterial();
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "../Core/Object3D.h"
+#include <RayTracer/VersionControl.h>
 
 class Triangle :public Object3D
 {
@@ -9,17 +10,28 @@ public:
 	virtual void paint(void) override;
 	virtual bool intersect(const Ray& r, Hit& h, float tmin) override;
 	virtual void insertIntoGrid(Grid* g, Matrix* m) override;
+	virtual bool bakeTransform(const Matrix& m) override;
+	virtual Vec3f getHitNormal(const Vec3f& point, float u, float v) const override;
 
 	static bool TriangleAABB(Triangle* triangle, const Vec3f& center, const Vec3f& extents, Matrix* m);
 
 private:
+	void setup();
+
 	Vec3f p1;
 	Vec3f p2;
 	Vec3f p3;
 
-	Vec3f e1;
-	Vec3f e2;
-
 	Vec3f normal;
-	float distance;
+
+#if (TRIANGLE_TEST == TRIANGLE_WALD)
+	// Plane and barycentric coordinates of the triangle projected along
+	// its dominant normal axis k, with u = k + 1 and v = k + 2:
+	// t = (nd - o.k - nu o.u - nv o.v) / (d.k + nu d.u + nv d.v),
+	// beta = bu h.u + bv h.v + bd, gamma = cu h.u + cv h.v + cd
+	int k;
+	float nu, nv, nd;
+	float bu, bv, bd;
+	float cu, cv, cd;
+#endif
 };
\ No newline at end of file